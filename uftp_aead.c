@@ -0,0 +1,606 @@
+/*
+ * uftp_aead.c - AES-128-GCM (NIST SP 800-38D) and ChaCha20-Poly1305 (RFC 8439)
+ *
+ * GCM runs entirely in registers: counter blocks go through the AES rounds
+ * 8 (or 16) at a time and GHASH folds as many ciphertext blocks per
+ * reduction, multiplying them by precomputed powers of H. The inputs to the
+ * carry-less multiplies are byte-reversed, as in Intel's white paper on
+ * GCM with PCLMULQDQ. Other architectures only get ChaCha20-Poly1305.
+ */
+#include <string.h>
+
+#include "uftp_aead.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AEAD_X86 1
+#include <immintrin.h>
+
+#define AESNI __attribute__((target("aes,pclmul,ssse3,sse4.1")))
+#define VAES __attribute__((target("aes,pclmul,ssse3,sse4.1,avx2,avx512f,avx512bw,avx512vl,vaes,vpclmulqdq")))
+#endif
+
+static int have_aesni = -1, have_vaes;
+
+static void detect_cpu(void)
+{
+    if (have_aesni >= 0)
+        return;
+#ifndef AEAD_X86
+    have_aesni = have_vaes = 0;
+#else
+    __builtin_cpu_init();
+    have_aesni = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+                 __builtin_cpu_supports("sse4.1");
+    have_vaes = have_aesni && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+                __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("vaes") &&
+                __builtin_cpu_supports("vpclmulqdq");
+#endif
+}
+
+int aead_supported(int cipher)
+{
+    detect_cpu();
+    if (cipher == AEAD_AES128_GCM)
+        return have_aesni;
+    return cipher == AEAD_CHACHA20_POLY1305;
+}
+
+int aead_default_cipher(void)
+{
+    return aead_supported(AEAD_AES128_GCM) ? AEAD_AES128_GCM : AEAD_CHACHA20_POLY1305;
+}
+
+const char *aead_name(int cipher)
+{
+    switch (cipher)
+    {
+    case AEAD_AES128_GCM:
+        return "aes128-gcm";
+    case AEAD_CHACHA20_POLY1305:
+        return "chacha20-poly1305";
+    default:
+        return "none";
+    }
+}
+
+static uint32_t load32_le(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void store32_le(uint8_t *p, uint32_t v)
+{
+    p[0] = v, p[1] = v >> 8, p[2] = v >> 16, p[3] = v >> 24;
+}
+
+/* Compares tags without an early exit */
+static int tags_differ(const uint8_t *a, const uint8_t *b)
+{
+    uint8_t d = 0;
+    for (int i = 0; i < AEAD_TAG_LEN; i++)
+        d |= a[i] ^ b[i];
+    return d != 0;
+}
+
+/* ---- AES-128-GCM ---- */
+
+#ifdef AEAD_X86
+
+#define BSWAP_MASK _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+/* counters are kept with their last word in host order, this turns them into the wire form */
+#define CTR_MASK _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 15, 14, 13, 12)
+
+AESNI static __m128i expand_step(__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+AESNI static __m128i aes_encrypt(const __m128i *rk, __m128i b)
+{
+    b = _mm_xor_si128(b, rk[0]);
+    for (int i = 1; i < 10; i++)
+        b = _mm_aesenc_si128(b, rk[i]);
+    return _mm_aesenclast_si128(b, rk[10]);
+}
+
+/* Adds a * b (unreduced) to the accumulators */
+AESNI static inline void clmul_acc(__m128i a, __m128i b, __m128i *lo, __m128i *mid, __m128i *hi)
+{
+    *lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+    *hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+    *mid = _mm_xor_si128(*mid, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x01), _mm_clmulepi64_si128(a, b, 0x10)));
+}
+
+/* Reduces a 256-bit product of byte-reversed operands modulo the GCM polynomial */
+AESNI static inline __m128i ghash_reduce(__m128i lo, __m128i mid, __m128i hi)
+{
+    __m128i t3 = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    __m128i t6 = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    // the operands are bit-reflected, so the product is shifted left by one
+    __m128i t7 = _mm_srli_epi32(t3, 31);
+    __m128i t8 = _mm_srli_epi32(t6, 31);
+    t3 = _mm_slli_epi32(t3, 1);
+    t6 = _mm_slli_epi32(t6, 1);
+    __m128i t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    t3 = _mm_or_si128(t3, t7);
+    t6 = _mm_or_si128(_mm_or_si128(t6, t8), t9);
+
+    t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(t3, 31), _mm_slli_epi32(t3, 30)), _mm_slli_epi32(t3, 25));
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    t3 = _mm_xor_si128(t3, t7);
+
+    __m128i t2 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(t3, 1), _mm_srli_epi32(t3, 2)), _mm_srli_epi32(t3, 7));
+    t2 = _mm_xor_si128(t2, t8);
+    t3 = _mm_xor_si128(t3, t2);
+    return _mm_xor_si128(t6, t3);
+}
+
+AESNI static __m128i gfmul(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+    clmul_acc(a, b, &lo, &mid, &hi);
+    return ghash_reduce(lo, mid, hi);
+}
+
+/* Hashes len bytes, the last block padded with zeros */
+AESNI static __m128i ghash_bytes(__m128i x, __m128i h, const uint8_t *p, int len)
+{
+    for (; len > 0; p += 16, len -= 16)
+    {
+        uint8_t block[16] = {0};
+        memcpy(block, p, len < 16 ? len : 16);
+        x = gfmul(_mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)block), BSWAP_MASK)), h);
+    }
+    return x;
+}
+
+AESNI static void aes_gcm_init(struct aead_key *k, const uint8_t *key)
+{
+    __m128i *rk = (__m128i *)k->aes_rk;
+
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+#define EXPAND(i, rcon) rk[i] = expand_step(rk[i - 1], _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+    EXPAND(1, 0x01);
+    EXPAND(2, 0x02);
+    EXPAND(3, 0x04);
+    EXPAND(4, 0x08);
+    EXPAND(5, 0x10);
+    EXPAND(6, 0x20);
+    EXPAND(7, 0x40);
+    EXPAND(8, 0x80);
+    EXPAND(9, 0x1b);
+    EXPAND(10, 0x36);
+#undef EXPAND
+
+    // ghash_h[j] = H^(16 - j), so block i of a 16 (or 8) block run lines up with its power
+    __m128i *powers = (__m128i *)k->ghash_h;
+    __m128i h = _mm_shuffle_epi8(aes_encrypt(rk, _mm_setzero_si128()), BSWAP_MASK);
+    powers[15] = h;
+    for (int j = 14; j >= 0; j--)
+        powers[j] = gfmul(powers[j + 1], h);
+}
+
+/* 16 blocks per step on 512-bit registers; returns how many blocks it did */
+VAES static int gcm_bulk_vaes(const struct aead_key *k, __m128i *xp, __m128i *ctrp, const uint8_t *in, uint8_t *out,
+                              int nblocks, int decrypt)
+{
+    const __m512i bswap = _mm512_broadcast_i32x4(BSWAP_MASK);
+    const __m512i ctr_mask = _mm512_broadcast_i32x4(CTR_MASK);
+    const __m512i four = _mm512_broadcast_i32x4(_mm_setr_epi32(0, 0, 0, 4));
+    __m512i rk[11], h[4];
+    int done = 0;
+
+    for (int i = 0; i < 11; i++)
+        rk[i] = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)k->aes_rk + i));
+    for (int i = 0; i < 4; i++)
+        h[i] = _mm512_load_si512((const __m512i *)k->ghash_h + i);
+
+    __m512i ctr = _mm512_add_epi32(_mm512_broadcast_i32x4(*ctrp), _mm512_setr_epi32(0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 2,
+                                                                                     0, 0, 0, 3));
+    __m128i x = *xp;
+
+    for (; nblocks - done >= 16; done += 16, in += 256, out += 256)
+    {
+        __m512i b[4], d[4];
+        for (int i = 0; i < 4; i++)
+        {
+            b[i] = _mm512_xor_si512(_mm512_shuffle_epi8(ctr, ctr_mask), rk[0]);
+            ctr = _mm512_add_epi32(ctr, four);
+        }
+#pragma GCC unroll 9
+        for (int r = 1; r < 10; r++)
+#pragma GCC unroll 4
+            for (int i = 0; i < 4; i++)
+                b[i] = _mm512_aesenc_epi128(b[i], rk[r]);
+        for (int i = 0; i < 4; i++)
+        {
+            d[i] = _mm512_loadu_si512((const void *)(in + 64 * i));
+            b[i] = _mm512_xor_si512(_mm512_aesenclast_epi128(b[i], rk[10]), d[i]);
+            _mm512_storeu_si512((void *)(out + 64 * i), b[i]);
+        }
+
+        __m512i lo = _mm512_setzero_si512(), mid = lo, hi = lo;
+        for (int i = 0; i < 4; i++)
+        {
+            __m512i c = _mm512_shuffle_epi8(decrypt ? d[i] : b[i], bswap);
+            if (i == 0)
+                c = _mm512_xor_si512(c, _mm512_zextsi128_si512(x));
+            lo = _mm512_xor_si512(lo, _mm512_clmulepi64_epi128(c, h[i], 0x00));
+            hi = _mm512_xor_si512(hi, _mm512_clmulepi64_epi128(c, h[i], 0x11));
+            mid = _mm512_ternarylogic_epi64(mid, _mm512_clmulepi64_epi128(c, h[i], 0x01),
+                                            _mm512_clmulepi64_epi128(c, h[i], 0x10), 0x96);
+        }
+#define FOLD(v) ({                                                                                    \
+    __m256i t = _mm256_xor_si256(_mm512_castsi512_si256(v), _mm512_extracti64x4_epi64(v, 1));        \
+    _mm_xor_si128(_mm256_castsi256_si128(t), _mm256_extracti128_si256(t, 1));                         \
+})
+        x = ghash_reduce(FOLD(lo), FOLD(mid), FOLD(hi));
+#undef FOLD
+    }
+
+    *xp = x;
+    *ctrp = _mm_add_epi32(*ctrp, _mm_setr_epi32(0, 0, 0, done));
+    return done;
+}
+
+AESNI static void aes_gcm(const struct aead_key *k, const uint8_t *nonce, const uint8_t *aad, int aadlen,
+                          const uint8_t *in, uint8_t *out, int len, int decrypt, uint8_t tag[AEAD_TAG_LEN])
+{
+    const __m128i *rk = (const __m128i *)k->aes_rk;
+    const __m128i *powers = (const __m128i *)k->ghash_h;
+    const __m128i bswap = BSWAP_MASK, ctr_mask = CTR_MASK, one = _mm_setr_epi32(0, 0, 0, 1);
+    __m128i h = powers[15];
+
+    uint8_t j0[16];
+    memcpy(j0, nonce, AEAD_NONCE_LEN);
+    uint32_t first = 1;
+    memcpy(j0 + 12, &first, 4);
+    __m128i ctr = _mm_loadu_si128((const __m128i *)j0);
+    __m128i tag_mask = aes_encrypt(rk, _mm_shuffle_epi8(ctr, ctr_mask));
+    ctr = _mm_add_epi32(ctr, one);
+
+    __m128i x = ghash_bytes(_mm_setzero_si128(), h, aad, aadlen);
+
+    int nblocks = len / 16, done = 0;
+    if (have_vaes && nblocks >= 16)
+        done = gcm_bulk_vaes(k, &x, &ctr, in, out, nblocks, decrypt);
+
+    for (; nblocks - done >= 8; done += 8)
+    {
+        const uint8_t *src = in + 16 * done;
+        uint8_t *dst = out + 16 * done;
+        __m128i b[8], d[8];
+
+        for (int i = 0; i < 8; i++)
+        {
+            b[i] = _mm_xor_si128(_mm_shuffle_epi8(ctr, ctr_mask), rk[0]);
+            ctr = _mm_add_epi32(ctr, one);
+        }
+#pragma GCC unroll 9
+        for (int r = 1; r < 10; r++)
+#pragma GCC unroll 8
+            for (int i = 0; i < 8; i++)
+                b[i] = _mm_aesenc_si128(b[i], rk[r]);
+        for (int i = 0; i < 8; i++)
+        {
+            d[i] = _mm_loadu_si128((const __m128i *)(src + 16 * i));
+            b[i] = _mm_xor_si128(_mm_aesenclast_si128(b[i], rk[10]), d[i]);
+            _mm_storeu_si128((__m128i *)(dst + 16 * i), b[i]);
+        }
+
+        __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+        for (int i = 0; i < 8; i++)
+        {
+            __m128i c = _mm_shuffle_epi8(decrypt ? d[i] : b[i], bswap);
+            if (i == 0)
+                c = _mm_xor_si128(c, x);
+            clmul_acc(c, powers[8 + i], &lo, &mid, &hi);
+        }
+        x = ghash_reduce(lo, mid, hi);
+    }
+
+    // the remaining blocks, the last one possibly partial
+    for (int off = 16 * done; off < len; off += 16)
+    {
+        int n = len - off < 16 ? len - off : 16;
+        uint8_t block[16] = {0}, ks[16];
+
+        _mm_storeu_si128((__m128i *)ks, aes_encrypt(rk, _mm_shuffle_epi8(ctr, ctr_mask)));
+        ctr = _mm_add_epi32(ctr, one);
+        memcpy(block, in + off, n);
+        if (decrypt)
+            x = gfmul(_mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)block), bswap)), h);
+        for (int i = 0; i < n; i++)
+            out[off + i] = block[i] ^= ks[i];
+        if (!decrypt)
+        {
+            memset(block + n, 0, 16 - n);
+            x = gfmul(_mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)block), bswap)), h);
+        }
+    }
+
+    __m128i lengths = _mm_set_epi64x((uint64_t)aadlen * 8, (uint64_t)len * 8);
+    x = gfmul(_mm_xor_si128(x, lengths), h);
+    _mm_storeu_si128((__m128i *)tag, _mm_xor_si128(_mm_shuffle_epi8(x, bswap), tag_mask));
+}
+
+#endif /* AEAD_X86 */
+
+/* ---- ChaCha20-Poly1305 ---- */
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTER(a, b, c, d)                    \
+    a += b, d ^= a, d = ROTL(d, 16);           \
+    c += d, b ^= c, b = ROTL(b, 12);           \
+    a += b, d ^= a, d = ROTL(d, 8);            \
+    c += d, b ^= c, b = ROTL(b, 7)
+
+static void chacha20_block(const uint8_t key[32], const uint8_t nonce[12], uint32_t counter, uint8_t out[64])
+{
+    uint32_t s[16], x[16];
+
+    s[0] = 0x61707865, s[1] = 0x3320646e, s[2] = 0x79622d32, s[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++)
+        s[4 + i] = load32_le(key + 4 * i);
+    s[12] = counter;
+    for (int i = 0; i < 3; i++)
+        s[13 + i] = load32_le(nonce + 4 * i);
+
+    memcpy(x, s, sizeof(x));
+    for (int i = 0; i < 10; i++)
+    {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+        store32_le(out + 4 * i, x[i] + s[i]);
+}
+
+/* four blocks side by side, one per vector lane */
+typedef uint32_t lanes4 __attribute__((vector_size(16)));
+
+static void chacha20_block4(const uint8_t key[32], const uint8_t nonce[12], uint32_t counter, uint8_t out[256])
+{
+    lanes4 s[16], x[16];
+
+    s[0] = (lanes4){0} + 0x61707865, s[1] = (lanes4){0} + 0x3320646e;
+    s[2] = (lanes4){0} + 0x79622d32, s[3] = (lanes4){0} + 0x6b206574;
+    for (int i = 0; i < 8; i++)
+        s[4 + i] = (lanes4){0} + load32_le(key + 4 * i);
+    s[12] = (lanes4){counter, counter + 1, counter + 2, counter + 3};
+    for (int i = 0; i < 3; i++)
+        s[13 + i] = (lanes4){0} + load32_le(nonce + 4 * i);
+
+    memcpy(x, s, sizeof(x));
+    for (int i = 0; i < 10; i++)
+    {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        lanes4 v = x[i] + s[i];
+        for (int lane = 0; lane < 4; lane++)
+            store32_le(out + 64 * lane + 4 * i, v[lane]);
+    }
+}
+
+static void chacha20_xor(const uint8_t key[32], const uint8_t nonce[12], const uint8_t *in, uint8_t *out, int len)
+{
+    uint8_t ks[256];
+    uint32_t counter = 1;
+
+    for (; len >= 256; counter += 4, in += 256, out += 256, len -= 256)
+    {
+        chacha20_block4(key, nonce, counter, ks);
+        for (int i = 0; i < 256; i += 8)
+        {
+            uint64_t a, b;
+            memcpy(&a, in + i, 8);
+            memcpy(&b, ks + i, 8);
+            a ^= b;
+            memcpy(out + i, &a, 8);
+        }
+    }
+    for (; len > 0; counter++, in += 64, out += 64, len -= 64)
+    {
+        chacha20_block(key, nonce, counter, ks);
+        for (int i = 0; i < (len < 64 ? len : 64); i++)
+            out[i] = in[i] ^ ks[i];
+    }
+}
+
+/* Poly1305 with 44/44/42-bit limbs */
+struct poly1305
+{
+    uint64_t r[3], h[3], pad[2];
+};
+
+static uint64_t load64_le(const uint8_t *p)
+{
+    return (uint64_t)load32_le(p) | (uint64_t)load32_le(p + 4) << 32;
+}
+
+#define M44 0xfffffffffffull
+#define M42 0x3ffffffffffull
+
+static void poly1305_init(struct poly1305 *p, const uint8_t key[32])
+{
+    uint64_t t0 = load64_le(key), t1 = load64_le(key + 8);
+
+    p->r[0] = t0 & 0xffc0fffffffull;
+    p->r[1] = (t0 >> 44 | t1 << 20) & 0xfffffc0ffffull;
+    p->r[2] = (t1 >> 24) & 0x00ffffffc0full;
+    memset(p->h, 0, sizeof(p->h));
+    p->pad[0] = load64_le(key + 16);
+    p->pad[1] = load64_le(key + 24);
+}
+
+/* Absorbs len bytes, the last block padded with zeros as RFC 8439 pads the AEAD input */
+static void poly1305_blocks(struct poly1305 *p, const uint8_t *m, int len)
+{
+    uint64_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2];
+    uint64_t s1 = r1 * 20, s2 = r2 * 20; // 2^130 = 5 (mod p), and the limbs leave 2 bits over
+    uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+
+    for (; len > 0; m += 16, len -= 16)
+    {
+        uint8_t block[16] = {0};
+        const uint8_t *b = m;
+        if (len < 16)
+        {
+            memcpy(block, m, len);
+            b = block;
+        }
+
+        uint64_t t0 = load64_le(b), t1 = load64_le(b + 8);
+        h0 += t0 & M44;
+        h1 += (t0 >> 44 | t1 << 20) & M44;
+        h2 += (t1 >> 24 & M42) | 1ull << 40;
+
+        unsigned __int128 d0 = (unsigned __int128)h0 * r0 + (unsigned __int128)h1 * s2 + (unsigned __int128)h2 * s1;
+        unsigned __int128 d1 = (unsigned __int128)h0 * r1 + (unsigned __int128)h1 * r0 + (unsigned __int128)h2 * s2;
+        unsigned __int128 d2 = (unsigned __int128)h0 * r2 + (unsigned __int128)h1 * r1 + (unsigned __int128)h2 * r0;
+
+        uint64_t c = (uint64_t)(d0 >> 44);
+        h0 = (uint64_t)d0 & M44;
+        d1 += c, c = (uint64_t)(d1 >> 44), h1 = (uint64_t)d1 & M44;
+        d2 += c, c = (uint64_t)(d2 >> 42), h2 = (uint64_t)d2 & M42;
+        h0 += c * 5, c = h0 >> 44, h0 &= M44;
+        h1 += c;
+    }
+
+    p->h[0] = h0, p->h[1] = h1, p->h[2] = h2;
+}
+
+static void poly1305_finish(struct poly1305 *p, uint8_t tag[16])
+{
+    uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], c;
+
+    c = h1 >> 44, h1 &= M44;
+    h2 += c, c = h2 >> 42, h2 &= M42;
+    h0 += c * 5, c = h0 >> 44, h0 &= M44;
+    h1 += c, c = h1 >> 44, h1 &= M44;
+    h2 += c, c = h2 >> 42, h2 &= M42;
+    h0 += c * 5, c = h0 >> 44, h0 &= M44;
+    h1 += c;
+
+    // h - p, kept only if h >= p = 2^130 - 5
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44, g0 &= M44;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44, g1 &= M44;
+    uint64_t g2 = h2 + c - (1ull << 42);
+
+    uint64_t keep = (g2 >> 63) - 1; // all ones when g did not go negative
+    h0 = (h0 & ~keep) | (g0 & keep);
+    h1 = (h1 & ~keep) | (g1 & keep);
+    h2 = (h2 & ~keep) | (g2 & keep);
+
+    uint64_t t0 = p->pad[0], t1 = p->pad[1];
+    h0 += t0 & M44, c = h0 >> 44, h0 &= M44;
+    h1 += ((t0 >> 44 | t1 << 20) & M44) + c, c = h1 >> 44, h1 &= M44;
+    h2 += (t1 >> 24 & M42) + c, h2 &= M42;
+
+    h0 = h0 | h1 << 44;
+    h1 = h1 >> 20 | h2 << 24;
+    store32_le(tag, (uint32_t)h0), store32_le(tag + 4, (uint32_t)(h0 >> 32));
+    store32_le(tag + 8, (uint32_t)h1), store32_le(tag + 12, (uint32_t)(h1 >> 32));
+}
+
+static void chacha_poly_tag(const struct aead_key *k, const uint8_t *nonce, const uint8_t *aad, int aadlen,
+                            const uint8_t *ct, int len, uint8_t tag[16])
+{
+    struct poly1305 p;
+    uint8_t block0[64], lengths[16];
+
+    chacha20_block(k->chacha_key, nonce, 0, block0);
+    poly1305_init(&p, block0);
+    poly1305_blocks(&p, aad, aadlen);
+    poly1305_blocks(&p, ct, len);
+    store32_le(lengths, aadlen), store32_le(lengths + 4, 0);
+    store32_le(lengths + 8, len), store32_le(lengths + 12, 0);
+    poly1305_blocks(&p, lengths, 16);
+    poly1305_finish(&p, tag);
+}
+
+/* ---- interface ---- */
+
+int aead_init(struct aead_key *k, int cipher, const uint8_t key[AEAD_KEY_LEN])
+{
+    if (!aead_supported(cipher))
+        return -1;
+    memset(k, 0, sizeof(*k));
+    k->cipher = cipher;
+#ifdef AEAD_X86
+    if (cipher == AEAD_AES128_GCM)
+    {
+        aes_gcm_init(k, key);
+        return 0;
+    }
+#endif
+    memcpy(k->chacha_key, key, AEAD_KEY_LEN);
+    return 0;
+}
+
+/* Encrypts len bytes from in to out (which may be the same buffer) */
+void aead_seal(const struct aead_key *k, const uint8_t nonce[AEAD_NONCE_LEN], const uint8_t *aad, int aadlen,
+               const uint8_t *in, uint8_t *out, int len, uint8_t tag[AEAD_TAG_LEN])
+{
+#ifdef AEAD_X86
+    if (k->cipher == AEAD_AES128_GCM)
+    {
+        aes_gcm(k, nonce, aad, aadlen, in, out, len, 0, tag);
+        return;
+    }
+#endif
+    chacha20_xor(k->chacha_key, nonce, in, out, len);
+    chacha_poly_tag(k, nonce, aad, aadlen, out, len, tag);
+}
+
+/* Decrypts buf in place; returns -1 (and wipes buf) if the tag does not match */
+int aead_open(const struct aead_key *k, const uint8_t nonce[AEAD_NONCE_LEN], const uint8_t *aad, int aadlen,
+              uint8_t *buf, int len, const uint8_t tag[AEAD_TAG_LEN])
+{
+    uint8_t expect[AEAD_TAG_LEN];
+
+#ifdef AEAD_X86
+    if (k->cipher == AEAD_AES128_GCM)
+    {
+        aes_gcm(k, nonce, aad, aadlen, buf, buf, len, 1, expect);
+        if (tags_differ(expect, tag))
+        {
+            memset(buf, 0, len);
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    // Poly1305 covers the ciphertext, so a forgery is caught before any decryption
+    chacha_poly_tag(k, nonce, aad, aadlen, buf, len, expect);
+    if (tags_differ(expect, tag))
+        return -1;
+    chacha20_xor(k->chacha_key, nonce, buf, buf, len);
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * uftp_aead.h - authenticated encryption of datagram payloads
+ *
+ * AES-128-GCM runs on AES-NI and PCLMULQDQ (16 blocks per step with VAES
+ * and VPCLMULQDQ where the CPU has them, 8 otherwise). CPUs without AES-NI,
+ * and every non-x86 machine, use ChaCha20-Poly1305 (RFC 8439) in portable C
+ * instead. Both take a
+ * 96-bit nonce and produce a 16-byte tag.
+ */
+#ifndef UFTP_AEAD_H
+#define UFTP_AEAD_H
+
+#include <stdint.h>
+
+#define AEAD_AES128_GCM 1
+#define AEAD_CHACHA20_POLY1305 2
+
+#define AEAD_KEY_LEN 32 /* AES-128 uses the first 16 bytes */
+#define AEAD_NONCE_LEN 12
+#define AEAD_TAG_LEN 16
+
+struct aead_key
+{
+    int cipher;
+    uint8_t aes_rk[11 * 16] __attribute__((aligned(64))); /* AES-128 round keys */
+    uint8_t ghash_h[16 * 16] __attribute__((aligned(64))); /* H^16 .. H^1, byte-reversed */
+    uint8_t chacha_key[AEAD_KEY_LEN];
+};
+
+int aead_supported(int cipher);
+int aead_default_cipher(void);
+const char *aead_name(int cipher);
+int aead_init(struct aead_key *k, int cipher, const uint8_t key[AEAD_KEY_LEN]);
+void aead_seal(const struct aead_key *k, const uint8_t nonce[AEAD_NONCE_LEN], const uint8_t *aad, int aadlen,
+               const uint8_t *in, uint8_t *out, int len, uint8_t tag[AEAD_TAG_LEN]);
+int aead_open(const struct aead_key *k, const uint8_t nonce[AEAD_NONCE_LEN], const uint8_t *aad, int aadlen,
+              uint8_t *buf, int len, const uint8_t tag[AEAD_TAG_LEN]);
+
+#endif
@@ -0,0 +1,661 @@
+/*
+ * uftp_batch.c - queue of transfers run concurrently over one event loop
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "uftp_batch.h"
+#include "uftp_sync.h"
+
+static const char *op_names[] = {"?", "get", "put", "delete"};
+
+/* Allocates the queue; returns -1 (errno set) if the wake-up pipe cannot be made */
+int batch_init(struct batch *b, struct uftp_conn *conn, int concurrency)
+{
+    memset(b, 0, sizeof(*b));
+    if (pipe(b->wake) < 0)
+        return -1;
+    fcntl(b->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(b->wake[1], F_SETFL, O_NONBLOCK);
+
+    b->conn = conn;
+    b->concurrency = concurrency > 0 ? concurrency : 1;
+    b->ra_depth = RA_DEFAULT_DEPTH;
+    b->tag = "";
+    pthread_mutex_init(&b->lock, NULL);
+    return 0;
+}
+
+/*------------------------------------ session map ------------------------------------*/
+
+static void map_put(struct batch *b, uint32_t session, struct batch_job *job);
+
+static void map_grow(struct batch *b)
+{
+    struct batch_slot *old = b->slots;
+    int n = b->nslots;
+
+    b->nslots = n ? n * 2 : 256;
+    b->slots = calloc(b->nslots, sizeof(*b->slots));
+    b->used = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (old[i].job)
+            map_put(b, old[i].session, old[i].job);
+    }
+    free(old);
+}
+
+static void map_put(struct batch *b, uint32_t session, struct batch_job *job)
+{
+    if (2 * (b->used + 1) > b->nslots)
+        map_grow(b);
+
+    int i = session & (b->nslots - 1);
+    while (b->slots[i].job)
+        i = (i + 1) & (b->nslots - 1);
+    b->slots[i] = (struct batch_slot){session, job};
+    b->used++;
+}
+
+static struct batch_job *map_get(struct batch *b, uint32_t session)
+{
+    if (!b->nslots)
+        return NULL;
+    for (int i = session & (b->nslots - 1); b->slots[i].job; i = (i + 1) & (b->nslots - 1))
+    {
+        if (b->slots[i].session == session)
+            return b->slots[i].job;
+    }
+    return NULL;
+}
+
+/*------------------------------------ queue ------------------------------------*/
+
+/*
+    Queues a job; safe to call while batch_run is going on another thread.
+    A put of a file that cannot be read is recorded as failed right away.
+    Returns the job's number (from 1).
+*/
+int batch_add(struct batch *b, int op, const char *path)
+{
+    struct batch_job *job = calloc(1, sizeof(*job));
+    struct stat st;
+
+    job->op = op;
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    job->fd = -1;
+    job->size = -1;
+    if (op == BATCH_PUT)
+    {
+        if (stat(path, &st) < 0)
+        {
+            job->state = BATCH_FAILED;
+            snprintf(job->reason, sizeof(job->reason), "%s", strerror(errno));
+        }
+        else if (!S_ISREG(st.st_mode))
+        {
+            job->state = BATCH_FAILED;
+            snprintf(job->reason, sizeof(job->reason), "not a regular file");
+        }
+        else
+        {
+            job->size = st.st_size;
+        }
+    }
+
+    pthread_mutex_lock(&b->lock);
+    if (b->count == b->cap)
+    {
+        b->cap = b->cap ? b->cap * 2 : 64;
+        b->jobs = realloc(b->jobs, b->cap * sizeof(*b->jobs));
+    }
+    b->jobs[b->count++] = job;
+    int number = b->count;
+    pthread_mutex_unlock(&b->lock);
+
+    if (write(b->wake[1], "", 1) < 0)
+    {
+        // the pipe is full, so batch_run is already due to wake up
+    }
+    return number;
+}
+
+/*
+    Queues a job written as "<op> <path>" (a job file line or a `bg`
+    command). Blank lines and lines starting with '#' are ignored.
+    Returns -1 for anything else that is not a get, put or delete.
+*/
+int batch_add_line(struct batch *b, const char *line)
+{
+    char op[16];
+    int pos = 0;
+
+    line += strspn(line, " \t");
+    if (!*line || *line == '\n' || *line == '#')
+        return 0;
+    if (sscanf(line, "%15s%n", op, &pos) != 1)
+        return -1;
+
+    // the rest of the line is the path, so it may contain spaces
+    char path[PATH_MAX];
+    const char *arg = line + pos;
+    arg += strspn(arg, " \t");
+    snprintf(path, sizeof(path), "%s", arg);
+    path[strcspn(path, "\r\n")] = '\0';
+    for (int end = strlen(path); end > 0 && path[end - 1] == ' '; end--)
+        path[end - 1] = '\0';
+    if (!*path)
+        return -1;
+
+    for (int i = BATCH_GET; i <= BATCH_DELETE; i++)
+    {
+        if (!strcmp(op, op_names[i]))
+            return batch_add(b, i, path);
+    }
+    return -1;
+}
+
+/* Makes batch_run return once nothing is queued or running any more */
+void batch_stop(struct batch *b)
+{
+    pthread_mutex_lock(&b->lock);
+    b->stop = 1;
+    pthread_mutex_unlock(&b->lock);
+    if (write(b->wake[1], "", 1) < 0)
+    {
+        // already due to wake up
+    }
+}
+
+void batch_free(struct batch *b)
+{
+    for (int i = 0; i < b->count; i++)
+        free(b->jobs[i]);
+    free(b->jobs);
+    free(b->slots);
+    close(b->wake[0]);
+    close(b->wake[1]);
+    pthread_mutex_destroy(&b->lock);
+}
+
+/*------------------------------------ progress ------------------------------------*/
+
+static off_t job_bytes(struct batch_job *job)
+{
+    if (job->state == BATCH_QUEUED || job->op == BATCH_DELETE)
+        return 0;
+    if (job->op == BATCH_GET)
+        return job->rx.bytes;
+
+    off_t acked = (off_t)job->tx.base * CHUNKSIZE;
+    return job->size >= 0 && acked > job->size ? job->size : acked;
+}
+
+static void format_bytes(double bytes, char *out, size_t len)
+{
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int u = 0;
+
+    while (bytes >= 1000 && u < 4)
+    {
+        bytes /= 1000;
+        u++;
+    }
+    snprintf(out, len, u ? "%.1f %s" : "%.0f %s", bytes, units[u]);
+}
+
+static void format_eta(off_t left, uint64_t rate, char *out, size_t len)
+{
+    if (left < 0 || rate == 0)
+    {
+        snprintf(out, len, "--");
+        return;
+    }
+    uint64_t secs = left / rate;
+    if (secs >= 3600)
+        snprintf(out, len, "%lluh%02llum", (unsigned long long)secs / 3600, (unsigned long long)secs / 60 % 60);
+    else
+        snprintf(out, len, "%llum%02llus", (unsigned long long)secs / 60, (unsigned long long)secs % 60);
+}
+
+/* One status line for the whole queue: jobs done, bytes moved, rate and time left */
+static void print_progress(struct batch *b, uint64_t now)
+{
+    int tty = isatty(STDERR_FILENO);
+    off_t moved = 0, left = 0;
+
+    for (int i = 0; i < b->count; i++)
+    {
+        struct batch_job *job = b->jobs[i];
+        off_t bytes = job_bytes(job);
+
+        moved += bytes;
+        if (job->state == BATCH_QUEUED || job->state == BATCH_RUNNING)
+        {
+            if (job->op != BATCH_DELETE && job->size < 0)
+                left = -1; // a get whose size has not come back yet
+            else if (left >= 0 && job->op != BATCH_DELETE)
+                left += job->size - bytes;
+        }
+    }
+
+    if (now > b->printed_us)
+    {
+        uint64_t rate = (moved - b->progress_bytes) * 1000000 / (now - b->printed_us);
+        b->rate = b->rate ? (b->rate + rate) / 2 : rate;
+    }
+    b->progress_bytes = moved;
+    b->printed_us = now;
+
+    char moved_s[32], rate_s[32], eta_s[32];
+    format_bytes(moved, moved_s, sizeof(moved_s));
+    format_bytes(b->rate, rate_s, sizeof(rate_s));
+    format_eta(left, b->rate, eta_s, sizeof(eta_s));
+
+    fprintf(stderr, "%s[%d/%d done, %d running, %d failed] %s at %s/s, ETA %s%s", tty ? "\r\033[K" : "",
+            b->succeeded + b->failed, b->count, b->running, b->failed, moved_s, rate_s, eta_s, tty ? "" : "\n");
+}
+
+/* What `jobs` shows: one line per job with its progress */
+void batch_print_jobs(struct batch *b, FILE *out)
+{
+    static const char *states[] = {"queued", "running", "done", "FAILED"};
+    uint64_t now = uftp_now_us();
+
+    pthread_mutex_lock(&b->lock);
+    for (int i = 0; i < b->count; i++)
+    {
+        struct batch_job *job = b->jobs[i];
+        off_t bytes = job_bytes(job);
+        uint64_t elapsed = (job->end_us ? job->end_us : now) - job->start_us;
+        uint64_t rate = job->start_us && elapsed ? bytes * 1000000 / elapsed : 0;
+        char bytes_s[32], rate_s[32], eta_s[32];
+
+        format_bytes(bytes, bytes_s, sizeof(bytes_s));
+        format_bytes(rate, rate_s, sizeof(rate_s));
+        format_eta(job->size < 0 ? -1 : job->size - bytes, rate, eta_s, sizeof(eta_s));
+
+        fprintf(out, "%3d %-7s %-6s %s", i + 1, states[job->state], op_names[job->op], job->path);
+        if (job->state == BATCH_RUNNING && job->op != BATCH_DELETE)
+        {
+            if (job->size > 0)
+                fprintf(out, "  %d%%", (int)(bytes * 100 / job->size));
+            fprintf(out, "  %s at %s/s, ETA %s", bytes_s, rate_s, eta_s);
+        }
+        else if (job->state == BATCH_FAILED)
+        {
+            fprintf(out, "  (%s)", job->reason);
+        }
+        fprintf(out, "\n");
+    }
+    if (!b->count)
+        fprintf(out, "No background jobs.\n");
+    pthread_mutex_unlock(&b->lock);
+}
+
+/*------------------------------------ jobs ------------------------------------*/
+
+static void send_all_paths(struct batch *b, int type, uint32_t session, const char *text)
+{
+    for (int i = 0; i < b->conn->npaths; i++)
+        uftp_conn_send_text(b->conn, i, type, session, text);
+}
+
+static void send_command(struct batch *b, struct batch_job *job)
+{
+    // a delete only needs to get through once; a get is sent on every path so the server learns them
+    if (job->op == BATCH_DELETE)
+        uftp_conn_send_text(b->conn, job->tries % b->conn->npaths, UFTP_CMD, job->session, job->cmd);
+    else
+        send_all_paths(b, UFTP_CMD, job->session, job->cmd);
+
+    // the size only feeds the progress display, so its query rides along without retries of its own
+    if (job->op == BATCH_GET && job->size < 0)
+    {
+        char cmd[UFTP_CMD_MAX];
+        snprintf(cmd, sizeof(cmd), "stat %s", job->path);
+        uftp_conn_send_text(b->conn, 0, UFTP_CMD, job->stat_session, cmd);
+    }
+}
+
+static void finish_job(struct batch *b, struct batch_job *job, int state, const char *reason)
+{
+    char partname[PATH_MAX + 16];
+    uint64_t now = uftp_now_us();
+
+    job->state = state;
+    job->end_us = now;
+    if (reason)
+        snprintf(job->reason, sizeof(job->reason), "%s", reason);
+    b->running--;
+
+    ra_close(job->ra);
+    job->ra = NULL;
+    if (job->op == BATCH_GET)
+    {
+        snprintf(partname, sizeof(partname), "%s.uftp-part", job->path);
+        if (job->fd >= 0)
+            close(job->fd);
+        job->fd = -1;
+        job->rx.fd = -1; // keeps answering retransmissions of the last chunk, without writing
+        if (state == BATCH_OK && rename(partname, job->path) < 0)
+        {
+            job->state = state = BATCH_FAILED;
+            snprintf(job->reason, sizeof(job->reason), "%s", strerror(errno));
+        }
+        if (state != BATCH_OK)
+            remove(partname);
+    }
+
+    if (state == BATCH_OK)
+        b->succeeded++;
+    else
+        b->failed++;
+
+    // report the job on stdout, clearing the progress line first
+    if (b->progress && isatty(STDERR_FILENO))
+        fprintf(stderr, "\r\033[K");
+    if (state == BATCH_OK && job->op != BATCH_DELETE)
+    {
+        off_t bytes = job->op == BATCH_GET ? job->rx.bytes : job->size;
+        double secs = (job->end_us - job->start_us) / 1e6;
+        char bytes_s[32], rate_s[32];
+
+        format_bytes(bytes, bytes_s, sizeof(bytes_s));
+        format_bytes(secs > 0 ? bytes / secs : 0, rate_s, sizeof(rate_s));
+        printf("%s%s %s: ok, %s in %.2f s (%s/s)\n", b->tag, op_names[job->op], job->path, bytes_s, secs, rate_s);
+    }
+    else if (state == BATCH_OK)
+    {
+        printf("%s%s %s: ok\n", b->tag, op_names[job->op], job->path);
+    }
+    else
+    {
+        printf("%s%s %s: FAILED (%s)\n", b->tag, op_names[job->op], job->path, job->reason);
+    }
+    fflush(stdout);
+}
+
+static void start_job(struct batch *b, struct batch_job *job, uint64_t now)
+{
+    char partname[PATH_MAX + 16];
+
+    job->start_us = now;
+    b->running++;
+    if (job->state == BATCH_FAILED)
+    {
+        finish_job(b, job, BATCH_FAILED, NULL); // failed while being queued
+        return;
+    }
+
+    job->state = BATCH_RUNNING;
+    job->session = uftp_new_session();
+    map_put(b, job->session, job);
+
+    if (job->op == BATCH_PUT)
+    {
+        job->ra = ra_open(job->path, b->ra_depth, b->ra_direct);
+        if (!job->ra)
+        {
+            finish_job(b, job, BATCH_FAILED, strerror(errno));
+            return;
+        }
+        snprintf(job->cmd, sizeof(job->cmd), "put %s", job->path);
+        sender_init(&job->tx, job->ra, job->session, job->cmd);
+        for (int i = 0; i < b->conn->npaths; i++)
+            sender_add_path(&job->tx, i);
+        sender_pump(&job->tx, now, uftp_conn_send, b->conn);
+        return;
+    }
+
+    if (job->op == BATCH_GET)
+    {
+        snprintf(partname, sizeof(partname), "%s.uftp-part", job->path);
+        sync_make_parents(partname);
+        job->fd = open(partname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (job->fd < 0)
+        {
+            finish_job(b, job, BATCH_FAILED, strerror(errno));
+            return;
+        }
+        receiver_init(&job->rx, job->fd, job->session, NULL);
+        job->stat_session = uftp_new_session();
+        map_put(b, job->stat_session, job);
+        snprintf(job->cmd, sizeof(job->cmd), "get %s", job->path);
+    }
+    else
+    {
+        snprintf(job->cmd, sizeof(job->cmd), "delete %s", job->path);
+    }
+
+    job->rto_us = UFTP_RTO_INIT_US;
+    job->cmd_deadline_us = now + job->rto_us;
+    send_command(b, job);
+}
+
+static void wake_by(uint64_t *wake, uint64_t t)
+{
+    if (t && t < *wake)
+        *wake = t;
+}
+
+/* Runs a job's timers and lets a put fill its window; lowers *wake to when it next needs attention */
+static void drive_job(struct batch *b, struct batch_job *job, uint64_t now, uint64_t *wake)
+{
+    if (job->op == BATCH_PUT)
+    {
+        struct uftp_sender *s = &job->tx;
+
+        sender_on_timer(s, now);
+        sender_pump(s, now, uftp_conn_send, b->conn);
+        if (s->done)
+        {
+            finish_job(b, job, BATCH_OK, s->final_text);
+        }
+        else if (s->failed)
+        {
+            const char *why = s->failed == UFTP_ERR_IO ? "Error reading file on the sending side."
+                                                       : "Sender gave up after maximum retries.";
+            send_all_paths(b, UFTP_FAIL, s->session, why);
+            finish_job(b, job, BATCH_FAILED, s->failed == UFTP_ERR_IO ? strerror(EIO) : "no answer from server");
+        }
+        else
+        {
+            wake_by(wake, s->rto_deadline_us);
+            // the reader is behind: come back soon to pick up its chunks
+            if (!s->eof && s->next - s->base < (uint32_t)s->window)
+                wake_by(wake, now + 1000);
+        }
+        return;
+    }
+
+    if (!job->started)
+    {
+        if (now >= job->cmd_deadline_us)
+        {
+            if (++job->tries > UFTP_MAX_RETRIES)
+            {
+                finish_job(b, job, BATCH_FAILED, "no answer from server");
+                return;
+            }
+            send_command(b, job);
+            job->rto_us = job->rto_us * 2 > UFTP_RTO_MAX_US ? UFTP_RTO_MAX_US : job->rto_us * 2;
+            job->cmd_deadline_us = now + job->rto_us;
+        }
+        wake_by(wake, job->cmd_deadline_us);
+        return;
+    }
+
+    // a get that has started: flush delayed ACKs, give up if the server went quiet
+    receiver_on_timer(&job->rx, now, uftp_conn_send, b->conn);
+    uint64_t silent_until = job->last_heard_us + (uint64_t)UFTP_MAX_RETRIES * UFTP_RTO_MAX_US;
+    if (now >= silent_until)
+    {
+        finish_job(b, job, BATCH_FAILED, "server stopped sending");
+        return;
+    }
+    wake_by(wake, job->rx.ack_due_us);
+    wake_by(wake, silent_until);
+}
+
+static void copy_text(const struct uftp_pkt *p, char *text, int textlen)
+{
+    int n = p->len < textlen - 1 ? p->len : textlen - 1;
+    memcpy(text, p->data, n);
+    text[n] = '\0';
+}
+
+/* Routes one packet from the server to the job whose session it belongs to */
+static void dispatch(struct batch *b, struct uftp_pkt *p, uint64_t now)
+{
+    struct batch_job *job = map_get(b, p->session);
+    char text[UFTP_REPLY_MAX];
+
+    if (!job)
+        return;
+
+    if (p->session == job->stat_session)
+    {
+        long long size;
+        if (p->type == UFTP_REPLY && p->len < (int)sizeof(text))
+        {
+            copy_text(p, text, sizeof(text));
+            if (sscanf(text, "%lld", &size) == 1 && job->size < 0)
+                job->size = size;
+        }
+        return;
+    }
+
+    if (job->op == BATCH_GET && p->type == UFTP_DATA)
+    {
+        // finished gets still re-ACK the last chunk in case the server missed our final ACK
+        if (job->state != BATCH_RUNNING && !job->rx.done)
+            return;
+        job->started = 1;
+        job->last_heard_us = now;
+        receiver_on_data(&job->rx, p, now, uftp_conn_send, b->conn);
+        if (job->state == BATCH_RUNNING && job->rx.done)
+            finish_job(b, job, BATCH_OK, NULL);
+        else if (job->state == BATCH_RUNNING && job->rx.failed)
+        {
+            send_all_paths(b, UFTP_FAIL, job->session, "Error writing file on the receiving side.");
+            finish_job(b, job, BATCH_FAILED, strerror(EIO));
+        }
+        return;
+    }
+
+    if (job->state != BATCH_RUNNING)
+        return;
+
+    if (p->type == UFTP_ACK && job->op == BATCH_PUT)
+    {
+        sender_on_ack(&job->tx, p, now);
+    }
+    else if (p->type == UFTP_REPLY && job->op == BATCH_DELETE)
+    {
+        copy_text(p, text, sizeof(text));
+        finish_job(b, job, BATCH_OK, text);
+    }
+    else if (p->type == UFTP_FAIL)
+    {
+        copy_text(p, text, sizeof(text));
+        finish_job(b, job, BATCH_FAILED, text);
+    }
+}
+
+/*
+    The event loop: starts queued jobs while fewer than `concurrency` run,
+    drives every running job, and routes each packet to its job. With
+    until_empty it returns as soon as the queue is done, otherwise it waits
+    for more jobs until batch_stop. Returns the number of failed jobs.
+*/
+int batch_run(struct batch *b, int until_empty)
+{
+    struct uftp_conn *c = b->conn;
+    struct pollfd pfd[UFTP_MAX_PATHS + 1];
+    char buf[UFTP_MAX_PACKET];
+    struct uftp_pkt p;
+
+    pthread_mutex_lock(&b->lock);
+    b->printed_us = uftp_now_us();
+    b->progress_us = b->printed_us + (isatty(STDERR_FILENO) ? BATCH_PROGRESS_US : BATCH_PROGRESS_LOG_US);
+
+    while (1)
+    {
+        uint64_t now = uftp_now_us();
+        uint64_t wake = now + UFTP_RTO_MAX_US;
+
+        while (b->running < b->concurrency && b->next < b->count)
+            start_job(b, b->jobs[b->next++], now);
+
+        while (b->oldest < b->next && b->jobs[b->oldest]->state != BATCH_RUNNING)
+            b->oldest++;
+        for (int i = b->oldest; i < b->next; i++)
+        {
+            if (b->jobs[i]->state == BATCH_RUNNING)
+                drive_job(b, b->jobs[i], now, &wake);
+        }
+        // a job that just finished leaves room for the next one
+        if (b->running < b->concurrency && b->next < b->count)
+            continue;
+
+        if (b->running == 0 && b->next == b->count && (until_empty || b->stop))
+            break;
+
+        if (b->progress)
+        {
+            if (now >= b->progress_us)
+            {
+                print_progress(b, now);
+                b->progress_us = now + (isatty(STDERR_FILENO) ? BATCH_PROGRESS_US : BATCH_PROGRESS_LOG_US);
+            }
+            wake_by(&wake, b->progress_us);
+        }
+
+        for (int i = 0; i < c->npaths; i++)
+            pfd[i] = (struct pollfd){c->paths[i].sockfd, POLLIN, 0};
+        pfd[c->npaths] = (struct pollfd){b->wake[0], POLLIN, 0};
+
+        pthread_mutex_unlock(&b->lock);
+        now = uftp_now_us();
+        poll(pfd, c->npaths + 1, wake > now ? (wake - now + 999) / 1000 : 0);
+        while (read(b->wake[0], buf, sizeof(buf)) > 0)
+            ;
+        pthread_mutex_lock(&b->lock);
+
+        // drain every path
+        for (int i = 0; i < c->npaths; i++)
+        {
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            int n;
+
+            while ((n = recvfrom(c->paths[i].sockfd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from,
+                                 &fromlen)) >= 0)
+            {
+                fromlen = sizeof(from);
+                if (from.sin_addr.s_addr != c->paths[i].peer.sin_addr.s_addr ||
+                    from.sin_port != c->paths[i].peer.sin_port)
+                    continue;
+                if ((n = crypto_unseal(c->crypto, buf, n)) >= 0 && uftp_parse(buf, n, &p) == 0)
+                    dispatch(b, &p, uftp_now_us());
+            }
+        }
+    }
+
+    if (b->progress)
+        print_progress(b, uftp_now_us());
+    if (b->progress && isatty(STDERR_FILENO))
+        fprintf(stderr, "\n");
+    int failed = b->failed;
+    pthread_mutex_unlock(&b->lock);
+    return failed;
+}
@@ -0,0 +1,105 @@
+/*
+ * uftp_batch.h - queue of transfers run concurrently over one event loop
+ *
+ * Jobs (get, put, delete) wait in a queue and up to `concurrency` of them
+ * run at once, each in its own session over the same sockets. The sender
+ * and receiver state machines of uftp_proto.c are driven side by side and
+ * every packet is routed to its job by session id, so no job ever blocks
+ * another. The client's batch mode runs a queue to completion; the
+ * interactive `bg` command feeds one that runs on a background thread.
+ */
+#ifndef UFTP_BATCH_H
+#define UFTP_BATCH_H
+
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "uftp_proto.h"
+#include "uftp_readahead.h"
+
+#define BATCH_GET 1
+#define BATCH_PUT 2
+#define BATCH_DELETE 3
+
+/* job states */
+#define BATCH_QUEUED 0
+#define BATCH_RUNNING 1
+#define BATCH_OK 2
+#define BATCH_FAILED 3
+
+#define BATCH_PROGRESS_US 500000      /* live progress refresh on a terminal */
+#define BATCH_PROGRESS_LOG_US 5000000 /* progress lines when stderr is a file or pipe */
+
+struct batch_job
+{
+    int op;
+    char path[PATH_MAX]; /* the same name locally and on the server */
+    int state;
+    char reason[UFTP_REPLY_MAX]; /* why it failed, or the server's answer */
+
+    uint32_t session;      /* the transfer (or request) itself */
+    uint32_t stat_session; /* get: size query sent along with the command */
+    char cmd[UFTP_CMD_MAX];
+
+    /* command retransmission until the server answers (get, delete) */
+    int started;
+    int tries;
+    uint64_t rto_us, cmd_deadline_us;
+    uint64_t last_heard_us;
+
+    int fd; /* get: written to <path>.uftp-part, renamed when complete */
+    struct uftp_receiver rx;
+
+    struct readahead *ra; /* put */
+    struct uftp_sender tx;
+
+    off_t size; /* -1 until known */
+    uint64_t start_us, end_us;
+};
+
+/* session id -> job, open addressing */
+struct batch_slot
+{
+    uint32_t session;
+    struct batch_job *job;
+};
+
+struct batch
+{
+    struct uftp_conn *conn;
+    int concurrency;
+    int ra_depth, ra_direct; /* read-ahead for puts, as for the interactive put */
+    int progress;            /* print live progress to stderr */
+    const char *tag;         /* prefix of the lines reporting finished jobs */
+
+    pthread_mutex_t lock; /* guards everything below; batch_run drops it only to wait */
+    int wake[2];          /* pipe poked by batch_add and batch_stop */
+    int stop;             /* batch_run returns once the queue is empty */
+
+    struct batch_job **jobs;
+    int count, cap;
+    int next;    /* first job not started yet */
+    int oldest;  /* no job before this one is running */
+    int running;
+    int succeeded, failed;
+
+    struct batch_slot *slots;
+    int nslots, used;
+
+    uint64_t progress_us; /* next progress print */
+    uint64_t printed_us;  /* the last one */
+    off_t progress_bytes; /* bytes moved as of the last one */
+    uint64_t rate;        /* smoothed bytes/s over all jobs */
+};
+
+int batch_init(struct batch *b, struct uftp_conn *conn, int concurrency);
+int batch_add(struct batch *b, int op, const char *path);
+int batch_add_line(struct batch *b, const char *line);
+int batch_run(struct batch *b, int until_empty);
+void batch_stop(struct batch *b);
+void batch_print_jobs(struct batch *b, FILE *out);
+void batch_free(struct batch *b);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * uftp_cdc.c - content-defined chunking (FastCDC) for deduplicated uploads
+ *
+ * FastCDC rolls a gear hash over the data, h = (h << 1) + gear[byte], and
+ * cuts where the masked hash is zero. A stricter mask applies before the
+ * normal size and a looser one after it, which keeps chunk sizes close to
+ * CDC_AVG_SIZE ("normalized chunking"). The first CDC_MIN_SIZE bytes of a
+ * chunk are not hashed at all.
+ *
+ * The loop is bound by the gear table loads rather than by the hash's
+ * dependency chain: splitting the scan into independent SIMD lanes (each
+ * warmed up on the 64 bytes that determine the hash) gave identical cuts
+ * but ran at half the speed, since every lane past the first scans data
+ * beyond the cut, and there is no cheap vector gather for the table.
+ */
+#include "uftp_cdc.h"
+
+#define CDC_MASK_S 0x0003590703530000ull /* 15 bits: before the normal size */
+#define CDC_MASK_L 0x0000d90003530000ull /* 11 bits: after it */
+
+/* fixed random values, identical on client and server so both cut alike */
+static const uint64_t gear[256] = {
+    0x533253a619eb6ac5ull, 0x7e930a0bbd91e680ull, 0x8d07a1c85b2395e2ull, 0xde034ae5e13579ccull,
+    0x1f9d33e0398940a3ull, 0x780938cd6af57158ull, 0xaf8ee0e741f098c0ull, 0xffa48e549f6a75daull,
+    0x629d50819956661bull, 0xd16e205dcff10607ull, 0x767a74994444007aull, 0x09029b4b206b910cull,
+    0x5721a244482755eeull, 0x6a53ecba10d84730ull, 0xbb97ee08257a9351ull, 0x26c00ddc78440dabull,
+    0xd846442bcfe83a75ull, 0x6331cb9a4fce3b9bull, 0x1acdf15815a7d4b1ull, 0xa119a5c06d7212caull,
+    0xf26c27dd41bede4aull, 0x4442e8c8825a0a61ull, 0xe96d868f7f7e1acfull, 0x30ac11b31af43028ull,
+    0xc6143b35e9817e38ull, 0x6f7fb788b8e571f4ull, 0x0a432c9d1ffe2e03ull, 0x002ea5add9782ce4ull,
+    0x34e601f3bdf3cd7dull, 0x2993ba515738a25cull, 0xe8e48d631d120d98ull, 0xf96463cd074ea725ull,
+    0xd32041096fd1ffafull, 0xfd6ec77e4c2b357dull, 0xfed2657722eee5c1ull, 0x55d13639fb1c7e1eull,
+    0x7475d76aa819a65bull, 0x15651a32fb8f2cf0ull, 0xb6d907c8b358e62eull, 0x3558af5aa93a7e7dull,
+    0x6a557e87c5a1e23bull, 0x988e3792dbaf5474ull, 0x12be0bc350d75b3full, 0x5b6c98f13ece1715ull,
+    0x2f9de1684bfed31cull, 0x1cc288b12429f735ull, 0x8f3390d274214a9aull, 0x76e04d2337161c98ull,
+    0x42cde46e89e0f41eull, 0xc099f9fe53a6c862ull, 0x0fbad120a6fdcc9full, 0x392b3c6c041fd01cull,
+    0xbf7d0dacc5e5bf8dull, 0x6914fa7374942eeaull, 0xfdcd19a34f2d06aeull, 0xf520b4dcabcdb72bull,
+    0x95dde4dab2b15621ull, 0x8a1b44d3c6238730ull, 0x17202eab4ff71fd2ull, 0xfda4b6c907ccc4eaull,
+    0xe00ea73ba3c6a06full, 0x3c0fc4b194db4d90ull, 0xc8965c5217e29819ull, 0x4b5db062ef9e9379ull,
+    0xddbf29e11e305b61ull, 0x89bdaf112c3093bcull, 0x57b58518682dd6ceull, 0x6d2bfc75a51fc569ull,
+    0xbec925effbd46659ull, 0x72a35a1d0ac2146dull, 0xdbb4518f10161df8ull, 0xcd64fb7fca94a9a8ull,
+    0xe824cb3be28e4c8full, 0xea334ba83265fdaaull, 0x5c4025b0bfa06c9cull, 0xe3ca11f5369dcb05ull,
+    0xf9f3af570961bbf8ull, 0x19c6f07651b707dfull, 0x6d62590330254931ull, 0xfa68f39258944ad6ull,
+    0x967cf33d4d5a4c37ull, 0x28331d6a5067114dull, 0x3472c440215c1059ull, 0x30a5d941a7b720a4ull,
+    0x9689d33f15ce3b9cull, 0xe9639acd82a2b030ull, 0xb6d49d06491d01ebull, 0xc14e51186e9d332aull,
+    0x0e38e287f3c4248full, 0xc0256f5fcb4a352cull, 0x140b2722ba2f77aaull, 0xea5de2a63ec72ab5ull,
+    0x9a16224cffe41e01ull, 0x031edf2f00c10a66ull, 0xa656e5f83df45f72ull, 0xb0987156684aa8eeull,
+    0x51416f3b295b3607ull, 0x46575b206aaf8de1ull, 0x2ee93db8183a82d3ull, 0xdd0fd8744e0bf107ull,
+    0x667815731fdc1593ull, 0xee5b244c7d154883ull, 0xc67a018abb529860ull, 0xefd1cf716abe9e00ull,
+    0x347b6c96f2621ad5ull, 0xcf59f637535d5726ull, 0x53743daf9ccdb725ull, 0x2b8712c78efd4ef8ull,
+    0xee29c27862a82fb8ull, 0xfda763bfb5a848d3ull, 0xe3a96db4317965b9ull, 0xe2c1e8a718f66e1cull,
+    0x9b4393cdfc940433ull, 0x412d6418eeefc9c0ull, 0x9c2f6c8adc792f28ull, 0xe2c730b256db937eull,
+    0x54ddccc3ea065a2eull, 0xfea81f339038ef06ull, 0x418898d060c42ff3ull, 0x282f548564b1f3ceull,
+    0xfe6b80f626985b6aull, 0x80906da80a2bc0e8ull, 0xd5b0de40e7a2fcd3ull, 0x87f23ecb335119e9ull,
+    0x5120b5d20e5b8cf4ull, 0x21cf82623567a15dull, 0x77a85f4651a86a61ull, 0xf7c7f0358be6819dull,
+    0xbe6ebca0710aff6aull, 0x7c13cdd3432e2600ull, 0x6af75905041fd8d5ull, 0x51c12fb73c3a1b28ull,
+    0x884b43021d7d18c5ull, 0x7fcb64c30cbca293ull, 0xbfdf1f6116b16fb2ull, 0xaa03050b0c9ab317ull,
+    0xe0d5834f68a3519cull, 0x9b879131c4d33b72ull, 0xfdea51c1a565a8c4ull, 0xe71302d6302cdf05ull,
+    0xd77cc7672a284898ull, 0x441abc585a4e1a7eull, 0xeffbacea1367d10full, 0x956c7eeadc99604cull,
+    0xc42dc5d4a43cd150ull, 0x192172fdb9c5d0a1ull, 0xa4cbd9a3dd557003ull, 0xfd65d573549e23d0ull,
+    0x3173f09a43802279ull, 0xbf82b555d80d1d22ull, 0xd6defeb8894deeedull, 0x2ddf5cf558c13632ull,
+    0x42b30ded20d1dd45ull, 0x42dd6e14f1b96c8bull, 0x0ceebf1a04f88cd6ull, 0x47065bd2fb0809bdull,
+    0x064d72c33bb0a336ull, 0x77cab87c3ddb4189ull, 0xbf889b91c5495871ull, 0x989e0c387641faf4ull,
+    0xdc3255587e3e96feull, 0xf435e0dccadcf401ull, 0x4dfb0921aac34ef5ull, 0x85e1baf88b275b98ull,
+    0x32544429e203ae7eull, 0x6d19a5d36a3d6864ull, 0x2f9a97ed8fe166e7ull, 0x86928a5f9673cf5cull,
+    0x24c6a213efce0b60ull, 0xfe251fdad656b196ull, 0x6252fbed00896a8bull, 0x63c3f8a9f79be882ull,
+    0x53f3c940ab22f41full, 0x898f58da2de0922eull, 0xa0a11b3626bbc729ull, 0x594ddd56d9c55cf8ull,
+    0x23f572528ef52dd5ull, 0xcc779a3a58ca48efull, 0x81fa0f822fa2d9deull, 0xb32da4061582dc71ull,
+    0x7e9563bc5e8ed91eull, 0x69190ff1a710489eull, 0x98cd2df01cfe0dd4ull, 0x7573d56f0d659defull,
+    0x28a39bbb1f3c3f74ull, 0xe40526788f4b0548ull, 0xa53812a4c807a7c6ull, 0x1a67d7b31f709c17ull,
+    0x5066c7811bc39499ull, 0x39abe206d155daa5ull, 0x98949fcbb98e22dbull, 0x36c85192b2fc2c6aull,
+    0x23d0c1305748761eull, 0xea1b14342f105f78ull, 0x2ee1b2884b557efdull, 0xdbeaad0c68388497ull,
+    0x38b0ba7fe315ecb4ull, 0x7023c03c70fb729bull, 0x781be685d82b708eull, 0xfec205903208711aull,
+    0x968c78cc9702a981ull, 0x1043c53d5a3a0819ull, 0xa21d37dcd60d2ec1ull, 0x0c8287d4746cd0d1ull,
+    0x15372d7de1a86bb0ull, 0x4ad56fec7375ef6aull, 0x967736aaa2e63daeull, 0x034ffe48f3e76442ull,
+    0x0b4b7a9a1b28ae3bull, 0xe95b43055def2f13ull, 0xef2f9edfe4e5a10eull, 0x6320ed982358fbe2ull,
+    0x09dffd6f4527f4dbull, 0x010f9969d236f2c2ull, 0xd1feecf8a367f331ull, 0x070b6ffae1955213ull,
+    0x4058f21e7c78720aull, 0x9442b57cdd2f5f2eull, 0xbee60a2f62d22470ull, 0x34ba1f95c3910477ull,
+    0xc8d42c4b3a1415c1ull, 0x34dbfdea1bbcc911ull, 0x9e8b5bf3dce9a9fbull, 0x744b05b1821a6f09ull,
+    0xcf2e25b26100e149ull, 0x18d5d4abd0f3c642ull, 0x96c769b8ff2ad1e1ull, 0x2bd93df38fc657bfull,
+    0x2f9bcd293eae3152ull, 0xf943615b1a88d37eull, 0xd2642fd8bbbe6144ull, 0x35c30ac3f3376e1full,
+    0x663ee6af28420f06ull, 0x2180400405278f58ull, 0xe52f99155e2d4ed0ull, 0x641ce1bd985e1e72ull,
+    0xb45c913f4b915f92ull, 0xf1dd940acf89b366ull, 0xdb597ba450ffad6full, 0x36a4deb7ed6e14c1ull,
+    0xa1a25273a55efdbcull, 0xeeb248fee97968b1ull, 0xcd46b4bd60ea522cull, 0x1b592e4b468d70d9ull,
+    0x2556b41ed7704203ull, 0x5b77f703f680054cull, 0x3e436b779674118eull, 0xb2bd08ea2fa67c69ull,
+    0x7f737cb375bf4c7eull, 0x8e42aff445e7b2a2ull, 0x081cfe8b72643537ull, 0xd2172fbe58ffba16ull,
+    0xf8dd52f864f35cc5ull, 0x78074a2e88632811ull, 0x4fc192329cf1d361ull, 0xafc65b9d5c887b7bull
+};
+
+/*
+    Length of the chunk that starts at data. len is how much data is
+    available; anything shorter than CDC_MAX_SIZE must be the end of the file.
+*/
+size_t cdc_next_cut(const uint8_t *data, size_t len)
+{
+    if (len <= CDC_MIN_SIZE)
+        return len;
+
+    size_t end = len < CDC_MAX_SIZE ? len : CDC_MAX_SIZE;
+    size_t normal = end < CDC_AVG_SIZE ? end : CDC_AVG_SIZE;
+    uint64_t h = 0;
+    size_t i = CDC_MIN_SIZE;
+
+    for (; i < normal; i++)
+    {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & CDC_MASK_S))
+            return i + 1;
+    }
+    for (; i < end; i++)
+    {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & CDC_MASK_L))
+            return i + 1;
+    }
+    return end;
+}
@@ -0,0 +1,20 @@
+/*
+ * uftp_cdc.h - content-defined chunking (FastCDC) for deduplicated uploads
+ *
+ * Chunk boundaries depend only on the bytes around them, so an edit in one
+ * place of a file leaves the chunks elsewhere untouched and they can be
+ * recognised by hash on the next upload.
+ */
+#ifndef UFTP_CDC_H
+#define UFTP_CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CDC_MIN_SIZE 2048   /* no cut before this many bytes */
+#define CDC_AVG_SIZE 8192   /* normal chunk size the masks aim for */
+#define CDC_MAX_SIZE 65536  /* forced cut */
+
+size_t cdc_next_cut(const uint8_t *data, size_t len);
+
+#endif
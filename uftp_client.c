@@ -10,10 +10,28 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "uftp_readahead.h"
+#include "uftp_proto.h"
+#include "uftp_sha256.h"
+#include "uftp_sync.h"
+#include "uftp_store.h"
+#include "uftp_batch.h"
+#include "uftp_multisrc.h"
 
 #define BUFSIZE 1024
 #define CHUNKSIZE 16000
+#define BENCH_DEFAULT_COUNT 1000
+#define DEDUP_UNSUPPORTED 1 /* send_file_dedup: server has no chunk store, use a plain put */
+
+int setup_status = 0; /* exit status if the client cannot start: 2 in batch mode */
 
 /*
  * error - wrapper for perror
@@ -21,70 +39,115 @@
 void error(char *msg)
 {
     perror(msg);
-    exit(0);
-}
-int initiate_operation_to_server(int sockfd, char *filename, char *op, struct sockaddr_in serveraddr, int serverlen);
-void exit_operation_to_server(int sockfd, struct sockaddr_in serveraddr, int serverlen);
-void ls_to_server(int sockfd, struct sockaddr_in serveraddr, int serverlen);
-void delete_file_from_server(int sockfd, char *buf, struct sockaddr_in serveraddr, int serverlen);
-void put_file_to_server(int sockfd, char *filename, struct sockaddr_in serveraddr, int serverlen);
-void get_file_from_server(int sockfd, char *filename, struct sockaddr_in serveraddr, int serverlen);
-void send_file_with_ack(char *filename, int sockfd, struct sockaddr_in *serveraddr);
-void receive_file_with_ack(int sockfd, char *filename, struct sockaddr_in *serveraddr);
-
-struct timeval set_timeout(int sockfd, int seconds)
-{
-    struct timeval timeout;
-    timeout.tv_sec = seconds;
-    timeout.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    return timeout;
-}
-
-void disable_timeout(struct timeval timeout, int sockfd)
-{
-    timeout.tv_sec = 0; // disable timeout
-    timeout.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    exit(setup_status);
 }
+int initiate_operation_to_server(char *filename, char *op);
+void exit_operation_to_server(struct uftp_conn *conn);
+void ls_to_server(struct uftp_conn *conn);
+void delete_file_from_server(struct uftp_conn *conn, char *filename);
+void put_file_to_server(struct uftp_conn *conn, char *filename);
+void get_file_from_server(struct uftp_conn *conn, char *filename);
+void get_range_from_server(struct uftp_conn *conn, char *filename, off_t offset, off_t length);
+int send_file_with_ack(struct uftp_conn *conn, char *cmd, char *filename, char *reply, int replylen);
+int send_file_dedup(struct uftp_conn *conn, char *filename, char *reply, int replylen);
+int receive_file_with_ack(struct uftp_conn *conn, char *cmd, char *filename);
+void bench_get_latency(struct uftp_conn *conn, char *filename, int count);
+void sync_dir_with_server(struct uftp_conn *conn, char *dirname);
+int open_paths(struct uftp_conn *conn, char *spec, struct sockaddr_in *serveraddr);
+int parse_sources(char *spec);
+int clone_conn(struct uftp_conn *to, const struct uftp_conn *from);
+int run_batch(struct uftp_conn *conn, char *jobfile, char **jobs, int njobs);
+void background_command(struct uftp_conn *conn, char *command, char *arg);
+int wait_background_jobs(void);
 
 time_t start_time, end_time;
 
+int readahead_depth = RA_DEFAULT_DEPTH; /* chunks prefetched ahead of the sender (-r) */
+int readahead_direct = 0;               /* read files with O_DIRECT (-d) */
+int sync_jobs = SYNC_DEFAULT_JOBS;      /* files sync transfers at once (-j) */
+int dedup_uploads = 0;                  /* put sends only chunks the server lacks (-D) */
+int batch_jobs = SYNC_DEFAULT_JOBS;     /* transfers a job queue runs at once (-j) */
+struct sockaddr_in sources[MSRC_MAX_SOURCES]; /* the server, then the replicas of -R */
+int nsources = 1;
+
 int main(int argc, char **argv)
 {
 
-    int sockfd, portno, n;
-    int serverlen;
+    int sockfd, portno;
     struct sockaddr_in serveraddr;
     struct hostent *server;
     char *hostname;
-    char buf[BUFSIZE];
-
-    char input[BUFSIZE];
+    struct uftp_conn conn;
+    char *multipath = NULL; /* -m: local addresses to send from, one path each */
+    char *jobfile = NULL;   /* -f: run the jobs listed in this file instead of the prompt */
+    char *keyfile = NULL;   /* -K: pre-shared key, packets are sealed with it */
+    char *replicas = NULL;  /* -R: more servers holding the same files, for get */
+    int cipher = 0;         /* -E, 0 for the best one this CPU has */
+
+    char input[UFTP_CMD_MAX];
     char command[16]; // keeping this small since its going to be anything from get/put/delete/ls/exit
-    char filename[256];
+    char filename[PATH_MAX];
+    int count; // number of requests for bench
 
     /* check command line arguments */
-    if (argc != 3)
+    int opt;
+    while ((opt = getopt(argc, argv, "r:dj:Dm:f:K:E:R:")) != -1)
     {
-        fprintf(stderr, "usage: %s <hostname> <port>\n", argv[0]);
-        exit(0);
+        switch (opt)
+        {
+        case 'r':
+            readahead_depth = atoi(optarg);
+            break;
+        case 'd':
+            readahead_direct = 1;
+            break;
+        case 'j':
+            sync_jobs = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            batch_jobs = sync_jobs;
+            break;
+        case 'D':
+            dedup_uploads = 1;
+            break;
+        case 'm':
+            multipath = optarg;
+            break;
+        case 'f':
+            jobfile = optarg;
+            break;
+        case 'K':
+            keyfile = optarg;
+            break;
+        case 'R':
+            replicas = optarg;
+            break;
+        case 'E':
+            if ((cipher = crypto_cipher_by_name(optarg)) < 0)
+                argc = 0;
+            break;
+        default:
+            argc = 0; // force the usage message below
+        }
     }
-    hostname = argv[1];
-    portno = atoi(argv[2]);
-
-    /* socket: create the socket */
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0)
-        error("ERROR opening socket");
+    // anything after the port is a list of jobs: get a.txt put "b c.txt" ...
+    if (argc - optind < 2 || (argc - optind) % 2 != 0)
+    {
+        fprintf(stderr, "usage: %s [-r readahead_chunks] [-d] [-j jobs] [-D] [-m local[@host:port],...] [-f jobfile] "
+                        "[-K keyfile] [-E aes|chacha] [-R host:port,...] <hostname> <port> [get|put|delete <file>]...\n",
+                argv[0]);
+        exit(argc - optind == 2 ? 0 : 2);
+    }
+    hostname = argv[optind];
+    portno = atoi(argv[optind + 1]);
+    // a pipeline running jobs has to see a client that never started as failed
+    if (jobfile || argc - optind > 2)
+        setup_status = 2;
 
     /* gethostbyname: get the server's DNS entry */
     server = gethostbyname(hostname);
     if (server == NULL)
     {
         fprintf(stderr, "ERROR, no such host as %s\n", hostname);
-        exit(0);
+        exit(setup_status);
     }
 
     /* build the server's Internet address */
@@ -93,16 +156,54 @@ int main(int argc, char **argv)
     bcopy((char *)server->h_addr,
           (char *)&serveraddr.sin_addr.s_addr, server->h_length);
     serveraddr.sin_port = htons(portno);
+    sources[0] = serveraddr;
+    if (replicas && parse_sources(replicas) < 0)
+        exit(setup_status);
+
+    bzero(&conn, sizeof(conn));
+    if (multipath)
+    {
+        if (open_paths(&conn, multipath, &serveraddr) < 0)
+            exit(setup_status);
+    }
+    else
+    {
+        /* socket: create the socket */
+        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd < 0)
+            error("ERROR opening socket");
+        uftp_set_buffers(sockfd);
+
+        conn.npaths = 1;
+        conn.paths[0].sockfd = sockfd;
+        conn.paths[0].peer = serveraddr;
+    }
+
+    static struct uftp_crypto keyed;
+    if (keyfile)
+    {
+        if (crypto_init(&keyed, keyfile, CRYPTO_CLIENT, cipher) < 0)
+            error("ERROR loading key file");
+        conn.crypto = &keyed;
+    }
+
+    // batch mode: no prompt, the exit status tells whether every job succeeded
+    if (jobfile || argc - optind > 2)
+        return run_batch(&conn, jobfile, argv + optind + 2, argc - optind - 2);
 
     /*-----------------------------------------------------------------------------------------*/
 
     while (1)
     {
         printf("Please enter your choice from the following: \n");
-        printf("get [filename]\n");
+        printf("get [-r offset length] [filename]\n");
         printf("put [filename]\n");
         printf("delete [filename]\n");
         printf("ls \n");
+        printf("sync [directory]\n");
+        printf("bench [-n count] [filename]\n");
+        printf("bg get|put|delete [filename]\n");
+        printf("jobs \n");
         printf("exit \n");
         printf("Input: ");
         if (fgets(input, sizeof(input), stdin) != NULL)
@@ -113,37 +214,89 @@ int main(int argc, char **argv)
             bzero(command, sizeof(command));
             bzero(filename, sizeof(filename));
 
-            sscanf(input, "%s %s", command, filename);
-            int status = initiate_operation_to_server(sockfd, filename, command, serveraddr, sizeof(serveraddr));
+            // everything after the command is the file name, so it may contain spaces
+            sscanf(input, "%15s", command);
+            char *arg = input + strspn(input, " \t");
+            arg += strcspn(arg, " \t");
+            arg += strspn(arg, " \t");
+            snprintf(filename, sizeof(filename), "%s", arg);
+            for (int end = strlen(filename); end > 0 && filename[end - 1] == ' '; end--)
+                filename[end - 1] = '\0';
+
+            // "bench -n <count> <file>" sets the number of requests, like get -r
+            count = 0;
+            if (!strcmp(command, "bench") && !strncmp(filename, "-n ", 3))
+            {
+                int skip = 0;
+                if (sscanf(filename + 3, "%d %n", &count, &skip) != 1 || count <= 0 || !filename[3 + skip])
+                {
+                    printf("Usage: bench -n <count> <file>\n");
+                    continue;
+                }
+                memmove(filename, filename + 3 + skip, strlen(filename + 3 + skip) + 1);
+            }
+            // "get -r <offset> <length> <file>" fetches just that part of the file
+            long long offset = -1, length = -1;
+            int skip = 0;
+            if (!strcmp(command, "get") && !strncmp(filename, "-r ", 3))
+            {
+                if (sscanf(filename + 3, "%lld %lld %n", &offset, &length, &skip) != 2 || offset < 0 ||
+                    length < 0 || !filename[3 + skip])
+                {
+                    printf("Usage: get -r <offset> <length> <file>\n");
+                    continue;
+                }
+                memmove(filename, filename + 3 + skip, strlen(filename + 3 + skip) + 1);
+            }
+            // background jobs run on their own thread and sockets, without blocking the prompt
+            if (!strcmp(command, "bg") || !strcmp(command, "jobs"))
+            {
+                background_command(&conn, command, filename);
+                continue;
+            }
+
+            int status = initiate_operation_to_server(filename, command);
 
             if (status)
             {
-                if (strcmp(command, "get") == 0)
+                if (strcmp(command, "get") == 0 && offset >= 0)
+                {
+                    get_range_from_server(&conn, filename, offset, length);
+                }
+                else if (strcmp(command, "get") == 0)
                 {
                     // printf("GET: %s %s\n", command, filename);
-                    get_file_from_server(sockfd, filename, serveraddr, sizeof(serveraddr));
+                    get_file_from_server(&conn, filename);
                 }
                 else if (strcmp(command, "put") == 0)
                 {
                     // printf("PUT: %s %s\n", command, filename);
-                    put_file_to_server(sockfd, filename, serveraddr, sizeof(serveraddr));
+                    put_file_to_server(&conn, filename);
                 }
                 else if (strcmp(command, "delete") == 0)
                 {
                     // printf("DELETE: %s %s\n", command, filename);
-                    delete_file_from_server(sockfd, filename, serveraddr, sizeof(serveraddr));
+                    delete_file_from_server(&conn, filename);
                 }
                 else if (strcmp(command, "ls") == 0)
                 {
                     // printf("LS: %s \n", command);
-                    ls_to_server(sockfd, serveraddr, sizeof(serveraddr));
+                    ls_to_server(&conn);
+                }
+                else if (strcmp(command, "sync") == 0)
+                {
+                    sync_dir_with_server(&conn, filename);
+                }
+                else if (strcmp(command, "bench") == 0)
+                {
+                    bench_get_latency(&conn, filename, count > 0 ? count : BENCH_DEFAULT_COUNT);
                 }
                 else if (strcmp(command, "exit") == 0)
                 {
                     // printf("EXIT: %s\n", command);
-                    exit_operation_to_server(sockfd, serveraddr, sizeof(serveraddr));
+                    exit_operation_to_server(&conn);
                     printf("Exiting from the connection with server \n");
-                    break;
+                    return wait_background_jobs() ? 1 : 0;
                 }
                 else
                 {
@@ -151,9 +304,13 @@ int main(int argc, char **argv)
                 }
             }
         }
+        else
+        {
+            break; // stdin closed
+        }
     }
 
-    return 0;
+    return wait_background_jobs() ? 1 : 0;
 }
 
 /*
@@ -164,24 +321,29 @@ int checkFileReq(char *op)
 {
     return (!strcmp(op, "get") ||
             !strcmp(op, "delete") ||
-            !strcmp(op, "put"));
+            !strcmp(op, "put") ||
+            !strcmp(op, "sync") ||
+            !strcmp(op, "bench"));
 }
 
-/* Validation to check if input command is valid and among (get/put/delete/ls/exit) */
+/* Validation to check if input command is valid and among (get/put/delete/ls/sync/bench/exit) */
 int checkInput(char *op)
 {
     return (!strcmp(op, "get") ||
             !strcmp(op, "delete") ||
             !strcmp(op, "put") ||
             !strcmp(op, "ls") ||
+            !strcmp(op, "sync") ||
+            !strcmp(op, "bench") ||
             !strcmp(op, "exit"));
 }
 
 /*
     This is the entry point for client.
-    Client sends the intended input to server and server gets ready for the next steps.
+    Validates the input before anything is sent; the command itself travels
+    in the first packet of the operation's session.
 */
-int initiate_operation_to_server(int sockfd, char *filename, char *op, struct sockaddr_in serveraddr, int serverlen)
+int initiate_operation_to_server(char *filename, char *op)
 {
 
     int is_valid_input = checkInput(op);
@@ -210,7 +372,6 @@ int initiate_operation_to_server(int sockfd, char *filename, char *op, struct so
     }
     if (!strcmp(op, "put"))
     {
-        FILE *file = fopen(filename, "r");
         if (!(access(filename, F_OK) == 0))
         {
             printf("Error opening file. File does not exist. Please enter valid command.\n");
@@ -220,52 +381,58 @@ int initiate_operation_to_server(int sockfd, char *filename, char *op, struct so
     }
 
     printf("Initiating %s command to the server.\n", op);
-    int n;
-
-    /* result = op(command) + filename e.g. get abc.txt */
-
-    char result[256];
-    bzero(result, sizeof(result));
-    sprintf(result, "%s %s", op, filename);
-
-    n = sendto(sockfd, result, strlen(result), 0, (struct sockaddr *)&serveraddr, serverlen);
-    if (n < 0)
-        error("ERROR in sendto");
-
     printf("--------------------------------------------------------------------------------\n");
     return 1;
 }
 
-void exit_operation_to_server(int sockfd, struct sockaddr_in serveraddr, int serverlen)
+void exit_operation_to_server(struct uftp_conn *conn)
 {
-    int n;
-
     char buffer1[BUFSIZE];
     bzero(buffer1, sizeof(buffer1));
 
-    n = recvfrom(sockfd, buffer1, BUFSIZE, 0, (struct sockaddr *)&serveraddr, &serverlen);
-
-    // if (n < 0)
-    //     printf("ERROR in recvfrom");
-
-    printf("Reply from server:\n%s\n", buffer1);
+    if (uftp_request(conn, "exit", buffer1, sizeof(buffer1)) == UFTP_ERR_TIMEOUT)
+        printf("No reply from server.\n");
+    else
+        printf("Reply from server:\n%s\n", buffer1);
 
     printf("--------------------------------------------------------------------------------\n");
 }
 
-void ls_to_server(int sockfd, struct sockaddr_in serveraddr, int serverlen)
+/*
+    The listing can be longer than one datagram, so it is streamed like a
+    file into a temporary file and printed from there.
+*/
+void ls_to_server(struct uftp_conn *conn)
 {
-    int n;
-
-    char buf[BUFSIZE];
-    bzero(buf, sizeof(buf));
+    FILE *fp = tmpfile();
+    if (!fp)
+    {
+        printf("Error creating temporary file for ls output\n");
+        return;
+    }
 
-    n = recvfrom(sockfd, buf, BUFSIZE, 0, (struct sockaddr *)&serveraddr, &serverlen);
+    char reason[BUFSIZE];
+    int status = uftp_recv_stream(conn, "ls", fileno(fp), reason, sizeof(reason));
 
-    // if (n < 0)
-    //     printf("ERROR in recvfrom");
+    if (status == UFTP_OK)
+    {
+        char buf[BUFSIZE];
+        size_t n;
 
-    printf("Reply from server:\n%s\n", buf);
+        printf("Reply from server:\n");
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+            fwrite(buf, 1, n, stdout);
+        printf("\n");
+    }
+    else if (status == UFTP_ERR_ABORTED)
+    {
+        printf("Reply from server:\n%s\n", reason);
+    }
+    else
+    {
+        printf("No reply from server.\n");
+    }
+    fclose(fp);
 
     printf("--------------------------------------------------------------------------------\n");
 }
@@ -273,203 +440,927 @@ void ls_to_server(int sockfd, struct sockaddr_in serveraddr, int serverlen)
 /*
     Receives a message from server, displaying success or failure
 */
-void delete_file_from_server(int sockfd, char *buf, struct sockaddr_in serveraddr, int serverlen)
+void delete_file_from_server(struct uftp_conn *conn, char *filename)
 {
-
-    int n;
+    char cmd[UFTP_CMD_MAX];
+    snprintf(cmd, sizeof(cmd), "delete %s", filename);
 
     char buffer1[BUFSIZE];
     bzero(buffer1, sizeof(buffer1));
 
-    n = recvfrom(sockfd, buffer1, BUFSIZE, 0, (struct sockaddr *)&serveraddr, &serverlen);
-
-    // if (n < 0)
-    //     printf("ERROR in recvfrom");
-
-    printf("Reply from server:\n%s\n", buffer1);
+    if (uftp_request(conn, cmd, buffer1, sizeof(buffer1)) == UFTP_ERR_TIMEOUT)
+        printf("No reply from server.\n");
+    else
+        printf("Reply from server:\n%s\n", buffer1);
     printf("--------------------------------------------------------------------------------\n");
 }
 
-void put_file_to_server(int sockfd, char *filename, struct sockaddr_in serveraddr, int serverlen)
+void put_file_to_server(struct uftp_conn *conn, char *filename)
 {
-    int n;
-    time(&start_time);
-    send_file_with_ack(filename, sockfd, &serveraddr);
+    char cmd[UFTP_CMD_MAX];
+    snprintf(cmd, sizeof(cmd), "put %s", filename);
 
     char buffer1[BUFSIZE];
     bzero(buffer1, sizeof(buffer1));
 
-    n = recvfrom(sockfd, buffer1, BUFSIZE, 0, (struct sockaddr *)&serveraddr, &serverlen);
-
-    // if (n < 0)
-    //     printf("ERROR in recvfrom");
-    time(&end_time);
-    printf("Reply from server:\n%s\n", buffer1);
-    printf("Put file from server took %.2f seconds.\n", difftime(end_time, start_time));
+    time(&start_time);
+    int status = DEDUP_UNSUPPORTED;
+    if (dedup_uploads)
+        status = send_file_dedup(conn, filename, buffer1, sizeof(buffer1));
+    if (status == DEDUP_UNSUPPORTED)
+        status = send_file_with_ack(conn, cmd, filename, buffer1, sizeof(buffer1));
+    if (status == UFTP_OK)
+    {
+        time(&end_time);
+        printf("Reply from server:\n%s\n", buffer1);
+        printf("Put file from server took %.2f seconds.\n", difftime(end_time, start_time));
+    }
 
     printf("--------------------------------------------------------------------------------\n");
 }
 
-void get_file_from_server(int sockfd, char *filename, struct sockaddr_in serveraddr, int serverlen)
+void get_file_from_server(struct uftp_conn *conn, char *filename)
 {
+    char cmd[UFTP_CMD_MAX];
+    snprintf(cmd, sizeof(cmd), "get %s", filename);
 
-    /*  this function is to have RECV TIMEOUT. It helps during packet loss. */
-    struct timeval timeout = set_timeout(sockfd, 2); // 2 seconds timeout
     time(&start_time);
-    receive_file_with_ack(sockfd, filename, &serveraddr);
+    // with replicas (-R) every server holding the file sends part of it
+    if (nsources > 1)
+        msrc_get(sources, nsources, conn->crypto, filename, filename);
+    else
+        receive_file_with_ack(conn, cmd, filename);
 
-    /*  this function is to disable RECV TIMEOUT. It helps during packet loss. */
-    disable_timeout(timeout, sockfd);
     time(&end_time);
     printf("Get file from server took %.2f seconds.\n", difftime(end_time, start_time));
 
     printf("--------------------------------------------------------------------------------\n");
 }
 
-void send_file_with_ack(char *filename, int sockfd, struct sockaddr_in *serveraddr)
+/*
+    Fetches `length` bytes from `offset` on into the same place of the local
+    file, which is created if needed but not truncated, so the missing part
+    of an interrupted download can be filled in.
+*/
+void get_range_from_server(struct uftp_conn *conn, char *filename, off_t offset, off_t length)
 {
-    int MAX_RETRIES = 5; // setting maximum number of tries in case of packet loss
+    char cmd[UFTP_CMD_MAX];
+    char reason[BUFSIZE];
+    snprintf(cmd, sizeof(cmd), "get -r %lld %lld %s", (long long)offset, (long long)length, filename);
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
+    sync_make_parents(filename);
+    int fd = open(filename, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        printf("Error opening file: %s\n", strerror(errno));
+        printf("--------------------------------------------------------------------------------\n");
+        return;
+    }
+
+    time(&start_time);
+    int status = uftp_recv_range(conn, cmd, fd, offset, reason, sizeof(reason));
+    close(fd);
+    time(&end_time);
+
+    if (status == UFTP_OK)
+        printf("Range received successfully.\n");
+    else if (status == UFTP_ERR_ABORTED)
+        printf("%s\n", reason);
+    else
+        printf("Range not received successfully. Please try again.\n");
+    printf("Get range from server took %.2f seconds.\n", difftime(end_time, start_time));
+
+    printf("--------------------------------------------------------------------------------\n");
+}
+
+/*
+    Sends the file as a windowed chunk stream (see uftp_proto.c); the first
+    chunk travels together with cmd. The server's reply lands in reply.
+    Returns UFTP_OK once the server has acknowledged every chunk.
+*/
+int send_file_with_ack(struct uftp_conn *conn, char *cmd, char *filename, char *reply, int replylen)
+{
+    /* chunks are prefetched by a reader thread so the disk never stalls the send loop */
+    struct readahead *ra = ra_open(filename, readahead_depth, readahead_direct);
+    if (!ra)
+    {
         printf("Error opening file. File does not exist.\n");
+        return UFTP_ERR_IO;
+    }
 
-    char buffer[CHUNKSIZE];
-    bzero(buffer, sizeof(buffer));
+    int status = uftp_send_stream(conn, cmd, ra, reply, replylen);
+    ra_close(ra);
 
-    socklen_t serverlen = sizeof(*serveraddr);
-    int bytes_read, seq_num = 0;
+    if (status == UFTP_OK)
+        printf("File sent successfully.\n");
+    else if (status == UFTP_ERR_ABORTED)
+        printf("Server aborted the transfer: %s\n", reply);
+    else if (status == UFTP_ERR_IO)
+        printf("Error reading file: %s\n", strerror(errno));
+    else
+        printf("File not sent successfully. Please try again.\n");
 
-    struct timeval timeout = set_timeout(sockfd, 2); // 2 seconds timeout
+    return status;
+}
 
-    while ((bytes_read = fread(buffer, 1, CHUNKSIZE, fp)) > 0)
+/* feeds the ring with just the chunks the server asked for, in the order it listed them */
+struct dedup_fill
+{
+    int fd;
+    struct recipe *r;
+    int *missing;
+    int nmissing;
+    int next;  /* next entry of missing to read */
+    off_t pos; /* file offset within the current chunk */
+    int left;  /* bytes of it still to read */
+};
+
+static int dedup_fill_read(void *ctx, char *buf, int want)
+{
+    struct dedup_fill *f = ctx;
+
+    while (f->left == 0)
     {
+        if (f->next == f->nmissing)
+            return 0;
+        struct recipe_chunk *ch = &f->r->chunks[f->missing[f->next++]];
+        f->pos = ch->offset;
+        f->left = ch->len;
+    }
 
-        /*
-            This is logic for sending packets in chunks. Appending an integer value (sequence number)
-            On server side it would be checked and ACK will be sent
-        */
-        char packet[CHUNKSIZE + sizeof(int)];
-        bzero(packet, sizeof(packet));
+    ssize_t n;
+    do
+        n = pread(f->fd, buf, want < f->left ? want : f->left, f->pos);
+    while (n < 0 && errno == EINTR);
 
-        memcpy(packet, &seq_num, sizeof(int));
-        memcpy(packet + sizeof(int), buffer, bytes_read);
+    if (n == 0)
+    {
+        errno = EIO; // the file shrank since it was chunked
+        return -1;
+    }
+    if (n > 0)
+    {
+        f->pos += n;
+        f->left -= n;
+    }
+    return n;
+}
 
-        int retries = 0;
-        while (retries < MAX_RETRIES) // Try sending packets MAX_RETRIWS times
+/*
+    Deduplicated put: the file is cut into content-defined chunks and only
+    those the server's store does not have yet are sent (see uftp_server.c
+    for the four steps). Returns UFTP_OK, one of the UFTP_ERR_ codes, or
+    DEDUP_UNSUPPORTED if the server has no chunk store.
+*/
+int send_file_dedup(struct uftp_conn *conn, char *filename, char *reply, int replylen)
+{
+    char cmd[UFTP_CMD_MAX];
+    char token[16];
+    struct recipe r;
+    struct stat st;
+
+    if (stat(filename, &st) < 0 || recipe_from_file(filename, &r) < 0)
+    {
+        printf("Error reading file: %s\n", strerror(errno));
+        return UFTP_ERR_IO;
+    }
+    snprintf(token, sizeof(token), "%08x", uftp_new_session());
+
+    // 1. the recipe travels like a file, through an unlinked temporary copy
+    char tmpname[] = "/tmp/uftp_recipe_XXXXXX";
+    int fd = mkstemp(tmpname);
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    int written = fp && recipe_write(fp, &r) == 0;
+    if (fp)
+        fclose(fp);
+    struct readahead *ra = written ? ra_open(tmpname, readahead_depth, 0) : NULL;
+    if (fd >= 0)
+        unlink(tmpname);
+    if (!ra)
+    {
+        printf("Error writing the recipe: %s\n", strerror(errno));
+        recipe_free(&r);
+        return UFTP_ERR_IO;
+    }
+
+    snprintf(cmd, sizeof(cmd), "dedup-recipe %s", token);
+    int status = uftp_send_stream(conn, cmd, ra, reply, replylen);
+    ra_close(ra);
+    if (status == UFTP_ERR_ABORTED)
+    {
+        printf("%s Sending the whole file.\n", reply);
+        recipe_free(&r);
+        return DEDUP_UNSUPPORTED;
+    }
+
+    // 2. which chunks the server lacks
+    int nmissing = 0;
+    int *missing = malloc((r.count + 1) * sizeof(*missing));
+    off_t missing_bytes = 0;
+    if (status == UFTP_OK)
+    {
+        FILE *list = tmpfile();
+        snprintf(cmd, sizeof(cmd), "dedup-missing %s", token);
+        status = list ? uftp_recv_stream(conn, cmd, fileno(list), reply, replylen) : UFTP_ERR_IO;
+
+        int i;
+        while (status == UFTP_OK && nmissing < r.count && fscanf(list, "%d", &i) == 1)
         {
-            if (sendto(sockfd, packet, bytes_read + sizeof(int), 0,
-                       (struct sockaddr *)serveraddr, serverlen) == -1)
-            {
-                // printf("sendto failed");
-            }
-            else
-            {
-                char ack[16];
-                bzero(ack, sizeof(ack));
-
-                /*  receive ACK from server.
-                    if its the same as current sequence number,
-                    then move to the next chunk
-                */
-                if (recvfrom(sockfd, ack, sizeof(ack), 0, (struct sockaddr *)serveraddr, &serverlen) > 0)
-                {
+            if (i < 0 || i >= r.count)
+                continue;
+            missing[nmissing++] = i;
+            missing_bytes += r.chunks[i].len;
+        }
+        if (list)
+            fclose(list);
+    }
 
-                    if (atoi(ack) == seq_num)
-                        break;
-                }
+    // 3. just those chunks, back to back
+    if (status == UFTP_OK && nmissing > 0)
+    {
+        struct dedup_fill *fill = calloc(1, sizeof(*fill));
+        fill->fd = open(filename, O_RDONLY);
+        fill->r = &r;
+        fill->missing = missing;
+        fill->nmissing = nmissing;
 
-                printf("Retrying sequence no. %d... Remaining tries (%d/%d)\n", seq_num, retries + 1, MAX_RETRIES);
-                retries++;
-            }
+        if (fill->fd < 0)
+        {
+            status = UFTP_ERR_IO;
         }
+        else
+        {
+            ra = ra_open_source(missing_bytes, readahead_depth, dedup_fill_read, NULL, fill);
+            snprintf(cmd, sizeof(cmd), "dedup-fill %s", token);
+            status = ra ? uftp_send_stream(conn, cmd, ra, reply, replylen) : UFTP_ERR_IO;
+            ra_close(ra);
+            close(fill->fd);
+        }
+        free(fill);
+    }
+
+    // 4. the server checks the chunks and puts the file in place
+    if (status == UFTP_OK)
+    {
+        snprintf(cmd, sizeof(cmd), "dedup-commit %s -t %lld %s", token,
+                 (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec, filename);
+        status = uftp_request(conn, cmd, reply, replylen);
+    }
+
+    if (status == UFTP_OK)
+        printf("File sent successfully: %d of %d chunks (%lld of %lld bytes) were new to the server.\n",
+               nmissing, r.count, (long long)missing_bytes, (long long)r.size);
+    else if (status == UFTP_ERR_ABORTED)
+        printf("Server aborted the transfer: %s\n", reply);
+    else if (status == UFTP_ERR_IO)
+        printf("Error reading file: %s\n", strerror(errno));
+    else
+        printf("File not sent successfully. Please try again.\n");
+
+    free(missing);
+    recipe_free(&r);
+    return status;
+}
+
+/*
+    Function to carry out receive file contents with acknowledgement
+    Handles packet loss
+*/
+int receive_file_with_ack(struct uftp_conn *conn, char *cmd, char *filename)
+{
+    sync_make_parents(filename);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Error creating file\n");
+        return UFTP_ERR_IO;
+    }
 
-        if (retries == MAX_RETRIES)
+    char reason[BUFSIZE];
+    int status = uftp_recv_stream(conn, cmd, fd, reason, sizeof(reason));
+    close(fd);
+
+    if (status == UFTP_OK)
+    {
+        printf("File received successfully.\n");
+        return status;
+    }
+
+    // if the server aborted (e.g. file does not exist), it tells us why
+    if (status == UFTP_ERR_ABORTED)
+        printf("%s\n", reason);
+    else
+        printf("File not received successfully. Please try again.\n");
+    remove(filename);
+    return status;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Latency at quantile q of the sorted samples (nearest rank) */
+static uint64_t percentile(uint64_t *sorted, int n, double q)
+{
+    int rank = (int)(q * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank - 1];
+}
+
+/*
+    Latency benchmark for small-file request/response traffic: gets filename
+    `count` times back to back, discarding the data, and reports the
+    distribution of request-to-completion times including the tail.
+*/
+void bench_get_latency(struct uftp_conn *conn, char *filename, int count)
+{
+    char cmd[UFTP_CMD_MAX];
+    snprintf(cmd, sizeof(cmd), "get %s", filename);
+
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0)
+    {
+        printf("Error opening /dev/null\n");
+        return;
+    }
+
+    uint64_t *samples = malloc(sizeof(*samples) * count);
+    char reason[BUFSIZE];
+    int ok = 0, failed = 0;
+    uint64_t bench_start = uftp_now_us();
+
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t t0 = uftp_now_us();
+        int status = uftp_recv_stream(conn, cmd, fd, reason, sizeof(reason));
+        uint64_t t1 = uftp_now_us();
+
+        if (status == UFTP_OK)
         {
-            printf("Maximum retries reached for sequence no. %d. Aborting...\n", seq_num);
-            sendto(sockfd, "FAIL", 4, 0, (struct sockaddr *)serveraddr, serverlen);
-            fclose(fp);
+            samples[ok++] = t1 - t0;
         }
+        else
+        {
+            failed++;
+            if (status == UFTP_ERR_ABORTED)
+            {
+                printf("%s\n", reason);
+                break;
+            }
+        }
+    }
+    uint64_t elapsed = uftp_now_us() - bench_start;
+    close(fd);
 
-        seq_num++;
+    if (ok == 0)
+    {
+        printf("No successful requests.\n");
+        free(samples);
+        printf("--------------------------------------------------------------------------------\n");
+        return;
     }
 
-    disable_timeout(timeout, sockfd);
+    qsort(samples, ok, sizeof(*samples), compare_u64);
 
-    // Sending EOF messgage to indicate end of file
-    sendto(sockfd, "EOF", 3, 0, (struct sockaddr *)serveraddr, serverlen);
-    fclose(fp);
+    uint64_t sum = 0;
+    for (int i = 0; i < ok; i++)
+        sum += samples[i];
+
+    printf("%d requests (%d failed) in %.3f seconds, %.0f requests/s\n",
+           ok + failed, failed, elapsed / 1e6, ok / (elapsed / 1e6));
+    printf("latency (us): min %llu  mean %llu  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+           (unsigned long long)samples[0],
+           (unsigned long long)(sum / ok),
+           (unsigned long long)percentile(samples, ok, 0.50),
+           (unsigned long long)percentile(samples, ok, 0.90),
+           (unsigned long long)percentile(samples, ok, 0.99),
+           (unsigned long long)percentile(samples, ok, 0.999),
+           (unsigned long long)samples[ok - 1]);
+    free(samples);
+
+    printf("--------------------------------------------------------------------------------\n");
+}
+
+/*------------------------------------ sync ------------------------------------*/
 
-    printf("File sent successfully.\n");
+/* what happened to one file during sync */
+#define SYNC_UNCHANGED 0
+#define SYNC_PUSHED 1
+#define SYNC_PULLED 2
+#define SYNC_FAILED 3
+
+/* a file that differs between the two sides, or exists on only one of them */
+struct sync_job
+{
+    char path[PATH_MAX];       /* directory/relative path, the same on both sides */
+    struct sync_entry *local;  /* NULL if the file only exists on the server */
+    struct sync_entry *remote; /* NULL if it only exists here */
+};
+
+/* shared by the sync workers */
+struct sync_run
+{
+    struct sync_job *jobs;
+    int count;
+    int next;                  /* next job to hand out */
+    const struct uftp_conn *conn; /* workers open the same paths */
+    pthread_mutex_t lock;
+    int results[4]; /* files per SYNC_ outcome */
+};
+
+static void set_mtime(int fd, int64_t mtime_ns)
+{
+    struct timespec times[2] = {{0, UTIME_NOW}, {mtime_ns / 1000000000, mtime_ns % 1000000000}};
+    futimens(fd, times);
+}
+
+static int sync_push(struct uftp_conn *conn, struct sync_job *job)
+{
+    char cmd[UFTP_CMD_MAX];
+    char reply[BUFSIZE];
+
+    struct readahead *ra = ra_open(job->path, readahead_depth, readahead_direct);
+    if (!ra)
+    {
+        printf("  push %s failed: %s\n", job->path, strerror(errno));
+        return SYNC_FAILED;
+    }
+
+    // the server gives the copy our modification time, so the next sync sees it unchanged
+    snprintf(cmd, sizeof(cmd), "put -t %lld %s", (long long)job->local->mtime_ns, job->path);
+    int status = uftp_send_stream(conn, cmd, ra, reply, sizeof(reply));
+    ra_close(ra);
+
+    if (status != UFTP_OK)
+    {
+        printf("  push %s failed: %s\n", job->path, status == UFTP_ERR_ABORTED ? reply : "no answer from server");
+        return SYNC_FAILED;
+    }
+    printf("  pushed %s\n", job->path);
+    return SYNC_PUSHED;
+}
+
+/* Downloads next to the local copy first, so a failed pull never destroys it */
+static int sync_pull(struct uftp_conn *conn, struct sync_job *job)
+{
+    char cmd[UFTP_CMD_MAX];
+    char tmpname[PATH_MAX + 16];
+    char reason[BUFSIZE];
+
+    snprintf(tmpname, sizeof(tmpname), "%s.uftp-part", job->path);
+    sync_make_parents(tmpname);
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("  pull %s failed: %s\n", job->path, strerror(errno));
+        return SYNC_FAILED;
+    }
+
+    snprintf(cmd, sizeof(cmd), "get %s", job->path);
+    int status = uftp_recv_stream(conn, cmd, fd, reason, sizeof(reason));
+    if (status == UFTP_OK)
+        set_mtime(fd, job->remote->mtime_ns);
+    close(fd);
+
+    if (status != UFTP_OK || rename(tmpname, job->path) < 0)
+    {
+        printf("  pull %s failed: %s\n", job->path,
+               status == UFTP_ERR_ABORTED ? reason : status == UFTP_OK ? strerror(errno) : "no answer from server");
+        remove(tmpname);
+        return SYNC_FAILED;
+    }
+    printf("  pulled %s\n", job->path);
+    return SYNC_PULLED;
 }
 
 /*
-    Function to carry out receive file contents with acknowledgement
-    Handles packet loss
+    Brings one file up to date. A file of the same size with a different
+    mtime has usually just been touched: the contents are hashed on both
+    sides before anything is transferred. Otherwise the newer copy wins.
 */
-void receive_file_with_ack(int sockfd, char *filename, struct sockaddr_in *serveraddr)
+static int sync_one_file(struct uftp_conn *conn, struct sync_job *job)
 {
-    FILE *fp = fopen(filename, "w");
-    if (!fp)
-        printf("Error creating file");
+    struct sync_entry *l = job->local, *r = job->remote;
 
-    /*
-        This is logic for receiving packets in chunks. Extracting an integer value (sequence number)
-        On server side it would be checked and ACK will be sent
-    */
-    char buffer[CHUNKSIZE + sizeof(int)];
-    bzero(buffer, sizeof(buffer));
+    if (l && r && l->size == r->size)
+    {
+        char cmd[UFTP_CMD_MAX];
+        char remote_hash[BUFSIZE];
+        char local_hash[SHA256_HEX_LEN];
 
-    socklen_t serverlen = sizeof(*serveraddr);
-    int expected_seq = 0;
+        snprintf(cmd, sizeof(cmd), "hash %s", job->path);
+        if (uftp_request(conn, cmd, remote_hash, sizeof(remote_hash)) == UFTP_OK &&
+            sha256_file(job->path, local_hash) == 0 && strcmp(local_hash, remote_hash) == 0)
+        {
+            // same contents: adopt the server's mtime so the next sync skips the hashing
+            int fd = open(job->path, O_WRONLY);
+            if (fd >= 0)
+            {
+                set_mtime(fd, r->mtime_ns);
+                close(fd);
+            }
+            return SYNC_UNCHANGED;
+        }
+    }
+
+    if (!r || (l && l->mtime_ns >= r->mtime_ns))
+        return sync_push(conn, job);
+    return sync_pull(conn, job);
+}
+
+/* Each worker has its own sockets, so its sessions never see another worker's packets */
+static void *sync_worker(void *arg)
+{
+    struct sync_run *run = arg;
+    struct uftp_conn conn;
+
+    if (clone_conn(&conn, run->conn) < 0)
+        return NULL; // the remaining workers pick up the files
 
     while (1)
     {
-        int bytes_received = recvfrom(sockfd, buffer, sizeof(buffer), 0,
-                                      (struct sockaddr *)serveraddr, &serverlen);
+        pthread_mutex_lock(&run->lock);
+        int i = run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (i >= run->count)
+            break;
+
+        int result = sync_one_file(&conn, &run->jobs[i]);
+
+        pthread_mutex_lock(&run->lock);
+        run->results[result]++;
+        pthread_mutex_unlock(&run->lock);
+    }
+
+    for (int i = 0; i < conn.npaths; i++)
+        close(conn.paths[i].sockfd);
+    crypto_free(conn.crypto);
+    return NULL;
+}
+
+/*
+    Two-way sync of a directory tree with the server's directory of the same
+    name. Both sides list their files (size, mtime); files missing on one
+    side are copied over, files that differ are replaced by the newer copy,
+    and up to sync_jobs files are transferred at the same time.
+    Deletions are not propagated.
+*/
+void sync_dir_with_server(struct uftp_conn *conn, char *dirname)
+{
+    for (int end = strlen(dirname); end > 1 && dirname[end - 1] == '/'; end--)
+        dirname[end - 1] = '\0';
+    if (!sync_safe_path(dirname))
+    {
+        printf("sync needs a relative directory path without '..'.\n");
+        printf("--------------------------------------------------------------------------------\n");
+        return;
+    }
 
-        if (bytes_received < 0)
-            printf("recvfrom failed\n");
+    uint64_t sync_start = uftp_now_us();
+    char cmd[UFTP_CMD_MAX];
+    char reason[BUFSIZE];
+
+    FILE *remote_fp = tmpfile();
+    FILE *local_fp = tmpfile();
+    if (!remote_fp || !local_fp)
+    {
+        printf("Error creating temporary files for the manifests\n");
+        if (remote_fp)
+            fclose(remote_fp);
+        if (local_fp)
+            fclose(local_fp);
+        return;
+    }
 
-        // if message is DNE -> The file does not exist on server
-        if (strncmp(buffer, "DNE", 3) == 0)
+    snprintf(cmd, sizeof(cmd), "manifest %s", dirname);
+    int status = uftp_recv_stream(conn, cmd, fileno(remote_fp), reason, sizeof(reason));
+    if (status != UFTP_OK || sync_write_manifest(local_fp, dirname, NULL) < 0)
+    {
+        if (status == UFTP_OK)
+            printf("Cannot read %s: %s\n", dirname, strerror(errno));
+        else
+            printf("Could not get the server's manifest: %s\n",
+                   status == UFTP_ERR_ABORTED ? reason : "no answer from server");
+        fclose(remote_fp);
+        fclose(local_fp);
+        printf("--------------------------------------------------------------------------------\n");
+        return;
+    }
+    rewind(local_fp);
+
+    struct sync_entry *local, *remote;
+    int nlocal = sync_load_manifest(local_fp, &local);
+    int nremote = sync_load_manifest(remote_fp, &remote);
+    fclose(local_fp);
+    fclose(remote_fp);
+
+    // both manifests are sorted by path, so one merge pass pairs them up
+    struct sync_run run;
+    bzero(&run, sizeof(run));
+    run.jobs = malloc((nlocal + nremote + 1) * sizeof(*run.jobs));
+    run.conn = conn;
+    pthread_mutex_init(&run.lock, NULL);
+
+    int unchanged = 0;
+    for (int i = 0, j = 0; i < nlocal || j < nremote;)
+    {
+        int cmp = i == nlocal ? 1 : j == nremote ? -1 : strcmp(local[i].path, remote[j].path);
+        struct sync_entry *l = cmp <= 0 ? &local[i++] : NULL;
+        struct sync_entry *r = cmp >= 0 ? &remote[j++] : NULL;
+
+        if (l && r && l->size == r->size && l->mtime_ns == r->mtime_ns)
         {
-            printf("File %s does not exists on server!\n", filename);
-            break;
+            unchanged++;
+            continue;
+        }
+
+        struct sync_job *job = &run.jobs[run.count++];
+        snprintf(job->path, sizeof(job->path), "%s/%s", dirname, l ? l->path : r->path);
+        job->local = l;
+        job->remote = r;
+    }
+
+    printf("Syncing %s: %d files here, %d on server, %d to check or transfer.\n",
+           dirname, nlocal, nremote, run.count);
+
+    int nworkers = run.count < sync_jobs ? run.count : sync_jobs;
+    pthread_t *tids = calloc(nworkers + 1, sizeof(*tids));
+    for (int i = 0; i < nworkers; i++)
+        pthread_create(&tids[i], NULL, sync_worker, &run);
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(tids[i], NULL);
+
+    int done = run.results[SYNC_UNCHANGED] + run.results[SYNC_PUSHED] +
+               run.results[SYNC_PULLED] + run.results[SYNC_FAILED];
+    printf("Sync of %s finished in %.2f seconds: %d pushed, %d pulled, %d unchanged, %d failed.\n",
+           dirname, (uftp_now_us() - sync_start) / 1e6, run.results[SYNC_PUSHED], run.results[SYNC_PULLED],
+           unchanged + run.results[SYNC_UNCHANGED], run.results[SYNC_FAILED] + run.count - done);
+
+    free(tids);
+    free(run.jobs);
+    pthread_mutex_destroy(&run.lock);
+    sync_free_manifest(local, nlocal);
+    sync_free_manifest(remote, nremote);
+
+    printf("--------------------------------------------------------------------------------\n");
+}
+
+/*------------------------------------ multipath ------------------------------------*/
+
+static int open_path_socket(struct uftp_conn *conn, struct sockaddr_in *local, struct sockaddr_in *peer)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        return -1;
+    uftp_set_buffers(sockfd);
+    if (bind(sockfd, (struct sockaddr *)local, sizeof(*local)) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    conn->paths[conn->npaths].sockfd = sockfd;
+    conn->paths[conn->npaths].peer = *peer;
+    conn->npaths++;
+    return 0;
+}
+
+/*
+    Opens one path per entry of spec, a comma separated list of
+    local_address[@host:port]. Each path's socket is bound to its local
+    address (so the kernel routes it out of that interface) and talks to the
+    server, or to host:port if given, e.g. a relay in front of the server.
+    Returns -1 after printing what was wrong.
+*/
+int open_paths(struct uftp_conn *conn, char *spec, struct sockaddr_in *serveraddr)
+{
+    for (char *entry = strtok(spec, ","); entry; entry = strtok(NULL, ","))
+    {
+        struct sockaddr_in local, peer = *serveraddr;
+        char *at = strchr(entry, '@');
+
+        if (conn->npaths == UFTP_MAX_PATHS)
+        {
+            fprintf(stderr, "At most %d paths are supported\n", UFTP_MAX_PATHS);
+            return -1;
+        }
+        if (at)
+        {
+            char *host = at + 1;
+            char *colon = strrchr(host, ':');
+            *at = '\0';
+            if (colon)
+                *colon = '\0';
+            if (!colon || inet_pton(AF_INET, host, &peer.sin_addr) != 1)
+            {
+                fprintf(stderr, "Bad endpoint for path %s, expected address:port\n", entry);
+                return -1;
+            }
+            peer.sin_port = htons(atoi(colon + 1));
         }
 
-        // if message is EOF -> indicates end of file that is being sent
-        if (strncmp(buffer, "EOF", 3) == 0)
+        bzero(&local, sizeof(local));
+        local.sin_family = AF_INET;
+        if (inet_pton(AF_INET, entry, &local.sin_addr) != 1)
         {
-            printf("File received successfully.\n");
-            break;
+            fprintf(stderr, "Bad local address %s\n", entry);
+            return -1;
         }
+        if (open_path_socket(conn, &local, &peer) < 0)
+        {
+            fprintf(stderr, "Cannot send from %s: %s\n", entry, strerror(errno));
+            return -1;
+        }
+    }
+    return conn->npaths > 0 ? 0 : -1;
+}
 
-        // if message is FAIL -> indicates file was not saved on server successfully
-        if (strncmp(buffer, "FAIL", 4) == 0)
+/*
+    Adds the servers of spec, a comma separated list of address:port, as
+    sources for get besides the one given on the command line. Returns -1
+    after printing what was wrong.
+*/
+int parse_sources(char *spec)
+{
+    for (char *entry = strtok(spec, ","); entry; entry = strtok(NULL, ","))
+    {
+        struct sockaddr_in peer = sources[0];
+        char *colon = strrchr(entry, ':');
+
+        if (nsources == MSRC_MAX_SOURCES)
         {
-            printf("File not received successfully. Please try again.\n");
-            remove(filename);
-            break;
+            fprintf(stderr, "At most %d sources are supported\n", MSRC_MAX_SOURCES);
+            return -1;
+        }
+        if (colon)
+            *colon = '\0';
+        if (!colon || inet_pton(AF_INET, entry, &peer.sin_addr) != 1)
+        {
+            fprintf(stderr, "Bad source %s, expected address:port\n", entry);
+            return -1;
         }
+        peer.sin_port = htons(atoi(colon + 1));
+        sources[nsources++] = peer;
+    }
+    return 0;
+}
 
-        int received_seq;
-        memcpy(&received_seq, buffer, sizeof(int));
+/* Opens fresh sockets on the same local addresses and endpoints (and key) as another connection */
+int clone_conn(struct uftp_conn *to, const struct uftp_conn *from)
+{
+    bzero(to, sizeof(*to));
+    if (from->crypto && !(to->crypto = crypto_clone(from->crypto)))
+        return -1;
+    for (int i = 0; i < from->npaths; i++)
+    {
+        struct sockaddr_in local;
+        socklen_t len = sizeof(local);
+        struct sockaddr_in peer = from->paths[i].peer;
 
-        // checking if sequence number is correct or packet loss occured
-        if (received_seq == expected_seq)
+        getsockname(from->paths[i].sockfd, (struct sockaddr *)&local, &len);
+        local.sin_port = 0;
+        if (open_path_socket(to, &local, &peer) < 0)
         {
-            // saving content into file, if there is no packet loss
-            fwrite(buffer + sizeof(int), 1, bytes_received - sizeof(int), fp);
-            expected_seq++;
+            for (int j = 0; j < to->npaths; j++)
+                close(to->paths[j].sockfd);
+            crypto_free(to->crypto);
+            return -1;
         }
+    }
+    return 0;
+}
 
-        char ack[16];
-        bzero(ack, sizeof(ack));
+/*------------------------------------ job queue ------------------------------------*/
 
-        // sending back ACK = received sequence number
-        sprintf(ack, "%d", received_seq);
-        sendto(sockfd, ack, strlen(ack), 0, (struct sockaddr *)serveraddr, serverlen);
+/*
+    Batch mode: runs the jobs from jobfile ("-" for stdin), one "<op> <file>"
+    per line, then those given on the command line, up to batch_jobs at a
+    time over one event loop. Live progress goes to stderr, one line per
+    finished job to stdout. Returns the exit status: 0 if every job
+    succeeded, 1 if any failed, 2 if the job list itself was bad.
+*/
+int run_batch(struct uftp_conn *conn, char *jobfile, char **jobs, int njobs)
+{
+    struct batch b;
+    char line[UFTP_CMD_MAX];
+
+    if (batch_init(&b, conn, batch_jobs) < 0)
+    {
+        perror("ERROR creating the job queue");
+        return 2;
     }
-    fclose(fp);
+    b.ra_depth = readahead_depth;
+    b.ra_direct = readahead_direct;
+    b.progress = 1;
+
+    if (jobfile)
+    {
+        FILE *fp = strcmp(jobfile, "-") ? fopen(jobfile, "r") : stdin;
+        if (!fp)
+        {
+            fprintf(stderr, "Cannot open %s: %s\n", jobfile, strerror(errno));
+            return 2;
+        }
+        for (int lineno = 1; fgets(line, sizeof(line), fp); lineno++)
+        {
+            if (batch_add_line(&b, line) < 0)
+            {
+                fprintf(stderr, "%s:%d: expected get, put or delete and a file name\n", jobfile, lineno);
+                return 2;
+            }
+        }
+        if (fp != stdin)
+            fclose(fp);
+    }
+    for (int i = 0; i + 1 < njobs; i += 2)
+    {
+        snprintf(line, sizeof(line), "%s %s", jobs[i], jobs[i + 1]);
+        if (batch_add_line(&b, line) < 0)
+        {
+            fprintf(stderr, "Bad job: %s\n", line);
+            return 2;
+        }
+    }
+
+    uint64_t start = uftp_now_us();
+    int failed = batch_run(&b, 1);
+    printf("%d jobs, %d failed, in %.2f seconds.\n", b.count, failed, (uftp_now_us() - start) / 1e6);
+    batch_free(&b);
+    return failed ? 1 : 0;
+}
+
+/* the queue behind `bg`, started on first use */
+static struct batch background;
+static struct uftp_conn background_conn;
+static pthread_t background_thread;
+static int background_started = 0;
+
+static void *background_loop(void *arg)
+{
+    batch_run(arg, 0);
+    return NULL;
+}
+
+/* `bg <op> <file>` queues a transfer that runs while the prompt stays usable; `jobs` lists them */
+void background_command(struct uftp_conn *conn, char *command, char *arg)
+{
+    if (!strcmp(command, "jobs"))
+    {
+        if (background_started)
+            batch_print_jobs(&background, stdout);
+        else
+            printf("No background jobs.\n");
+        printf("--------------------------------------------------------------------------------\n");
+        return;
+    }
+
+    if (!background_started)
+    {
+        // own sockets, so background sessions never reach the foreground commands
+        if (clone_conn(&background_conn, conn) < 0 || batch_init(&background, &background_conn, batch_jobs) < 0)
+        {
+            printf("Cannot start background jobs: %s\n", strerror(errno));
+            return;
+        }
+        background.ra_depth = readahead_depth;
+        background.ra_direct = readahead_direct;
+        background.tag = "[bg] ";
+        if (pthread_create(&background_thread, NULL, background_loop, &background) != 0)
+        {
+            printf("Cannot start background jobs.\n");
+            return;
+        }
+        background_started = 1;
+    }
+
+    int number = batch_add_line(&background, arg);
+    if (number <= 0)
+        printf("Usage: bg get|put|delete [filename]\n");
+    else
+        printf("Queued job %d: %s\n", number, arg);
+    printf("--------------------------------------------------------------------------------\n");
+}
+
+/* Lets queued background jobs finish before the client exits; returns how many failed */
+int wait_background_jobs(void)
+{
+    if (!background_started)
+        return 0;
+
+    pthread_mutex_lock(&background.lock);
+    int left = background.count - background.succeeded - background.failed;
+    pthread_mutex_unlock(&background.lock);
+    if (left)
+        printf("Waiting for %d background job(s) to finish...\n", left);
+
+    batch_stop(&background);
+    pthread_join(background_thread, NULL);
+    int failed = background.failed;
+    background_started = 0;
+    return failed;
 }
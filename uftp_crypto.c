@@ -0,0 +1,394 @@
+/*
+ * uftp_crypto.c - sealing and opening datagrams, session keys and replay checks
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+
+#include "uftp_proto.h"
+#include "uftp_crypto.h"
+#include "uftp_sha256.h"
+
+#define KEYFILE_MAX 4096
+
+struct trailer
+{
+    uint8_t cipher;
+    uint8_t reserved[3];
+    uint32_t time; /* seconds since the epoch when sealed */
+    uint64_t salt;
+    uint64_t pn;
+} __attribute__((packed));
+
+static void hmac_sha256(const uint8_t key[32], const uint8_t *msg, int len, uint8_t out[SHA256_LEN])
+{
+    uint8_t pad[64];
+    struct sha256_ctx c;
+
+    memset(pad, 0x36, sizeof(pad));
+    for (int i = 0; i < 32; i++)
+        pad[i] ^= key[i];
+    sha256_init(&c);
+    sha256_update(&c, pad, sizeof(pad));
+    sha256_update(&c, msg, len);
+    sha256_final(&c, out);
+
+    memset(pad, 0x5c, sizeof(pad));
+    for (int i = 0; i < 32; i++)
+        pad[i] ^= key[i];
+    sha256_init(&c);
+    sha256_update(&c, pad, sizeof(pad));
+    sha256_update(&c, out, SHA256_LEN);
+    sha256_final(&c, out);
+}
+
+/* The key one side (role) seals session with, for a given cipher and salt */
+static int derive_key(const struct uftp_crypto *cr, int role, int cipher, uint32_t session, uint64_t salt,
+                      struct aead_key *key)
+{
+    uint8_t info[32], secret[SHA256_LEN];
+    int n = snprintf((char *)info, sizeof(info), "uftp %s", role == CRYPTO_SERVER ? "server" : "client");
+
+    info[n++] = cipher;
+    session = htonl(session);
+    memcpy(info + n, &session, 4);
+    salt = htobe64(salt);
+    memcpy(info + n + 4, &salt, 8);
+
+    hmac_sha256(cr->master, info, n + 12, secret);
+    return aead_init(key, cipher, secret);
+}
+
+/* Hashes the key file into the master key; returns -1 if it cannot be read or is empty */
+int crypto_init(struct uftp_crypto *cr, const char *keyfile, int role, int cipher)
+{
+    char buf[KEYFILE_MAX];
+    int fd, n;
+
+    memset(cr, 0, sizeof(*cr));
+    cr->role = role;
+    cr->cipher = cipher ? cipher : aead_default_cipher();
+    if (!aead_supported(cr->cipher))
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if ((fd = open(keyfile, O_RDONLY)) < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n <= 0)
+    {
+        if (n == 0)
+            errno = ENODATA;
+        return -1;
+    }
+    if (n < 16)
+        fprintf(stderr, "Warning: key file %s holds only %d bytes\n", keyfile, n);
+
+    struct sha256_ctx c;
+    sha256_init(&c);
+    sha256_update(&c, buf, n);
+    sha256_final(&c, cr->master);
+    memset(buf, 0, sizeof(buf));
+    return 0;
+}
+
+/* A context with the same key and no sessions, for another thread or socket */
+struct uftp_crypto *crypto_clone(const struct uftp_crypto *cr)
+{
+    struct uftp_crypto *copy = calloc(1, sizeof(*copy));
+
+    if (!copy)
+        return NULL;
+    memcpy(copy->master, cr->master, sizeof(copy->master));
+    copy->role = cr->role;
+    copy->cipher = cr->cipher;
+    return copy;
+}
+
+/* Releases a context from crypto_clone */
+void crypto_free(struct uftp_crypto *cr)
+{
+    if (!cr)
+        return;
+    for (int i = 0; i < CRYPTO_BUCKETS; i++)
+    {
+        while (cr->tx[i])
+        {
+            struct crypto_tx *t = cr->tx[i];
+            cr->tx[i] = t->next;
+            free(t);
+        }
+        while (cr->rx[i])
+        {
+            struct crypto_rx *r = cr->rx[i];
+            cr->rx[i] = r->next;
+            free(r);
+        }
+    }
+    memset(cr, 0, sizeof(*cr));
+    free(cr);
+}
+
+/* Cipher for -E: "aes", "chacha" or "auto" (0, the best this CPU has) */
+int crypto_cipher_by_name(const char *name)
+{
+    if (!strcasecmp(name, "aes") || !strcasecmp(name, aead_name(AEAD_AES128_GCM)))
+        return AEAD_AES128_GCM;
+    if (!strcasecmp(name, "chacha") || !strcasecmp(name, aead_name(AEAD_CHACHA20_POLY1305)))
+        return AEAD_CHACHA20_POLY1305;
+    if (!strcasecmp(name, "auto"))
+        return 0;
+    return -1;
+}
+
+static unsigned bucket(uint32_t session, uint64_t salt)
+{
+    return (session * 2654435761u ^ (uint32_t)salt) % CRYPTO_BUCKETS;
+}
+
+/* Drops the keys of sessions idle long enough that none of their packets would pass the time check */
+static void sweep(struct uftp_crypto *cr, uint64_t now)
+{
+    uint64_t idle = 2ull * CRYPTO_FRESH_S * 1000000;
+
+    for (int i = 0; i < CRYPTO_BUCKETS; i++)
+    {
+        for (struct crypto_tx **pt = &cr->tx[i]; *pt;)
+        {
+            struct crypto_tx *t = *pt;
+            if (now - t->used_us > idle)
+            {
+                *pt = t->next;
+                free(t);
+            }
+            else
+                pt = &t->next;
+        }
+        for (struct crypto_rx **pr = &cr->rx[i]; *pr;)
+        {
+            struct crypto_rx *r = *pr;
+            if (now - r->used_us > idle)
+            {
+                *pr = r->next;
+                free(r);
+            }
+            else
+                pr = &r->next;
+        }
+    }
+    cr->sweep_us = now + CRYPTO_SWEEP_US;
+}
+
+/* Our key for a session, created with a fresh salt the first time */
+static struct crypto_tx *tx_key(struct uftp_crypto *cr, uint32_t session, int cipher)
+{
+    struct crypto_tx **head = &cr->tx[bucket(session, 0)];
+
+    for (struct crypto_tx *t = *head; t; t = t->next)
+    {
+        if (t->session == session)
+            return t;
+    }
+
+    struct crypto_tx *t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    t->session = session;
+    t->used_us = uftp_now_us();
+    if (getrandom(&t->salt, sizeof(t->salt), 0) != sizeof(t->salt))
+        t->salt = (uint64_t)rand() << 32 ^ uftp_now_us();
+    if (!aead_supported(cipher))
+        cipher = cr->cipher;
+    if (derive_key(cr, cr->role, cipher, session, t->salt, &t->key) < 0)
+    {
+        free(t);
+        return NULL;
+    }
+    t->next = *head;
+    *head = t;
+    return t;
+}
+
+static void nonce_for(uint64_t pn, uint8_t nonce[AEAD_NONCE_LEN])
+{
+    memset(nonce, 0, 4);
+    pn = htobe64(pn);
+    memcpy(nonce + 4, &pn, 8);
+}
+
+/*
+    Seals the packet in iov (iov[0] being the uftp header) into out, which
+    must hold UFTP_MAX_PACKET bytes. Returns its length, or -1.
+*/
+int crypto_seal(struct uftp_crypto *cr, const struct iovec *iov, int iovcnt, char *out)
+{
+    struct uftp_hdr hdr;
+    uint64_t now = uftp_now_us();
+
+    if (now >= cr->sweep_us)
+        sweep(cr, now);
+
+    memcpy(&hdr, iov[0].iov_base, sizeof(hdr));
+    hdr.flags |= UFTP_F_SEALED;
+    struct crypto_tx *t = tx_key(cr, ntohl(hdr.session), cr->cipher);
+    if (!t)
+        return -1;
+    t->used_us = now;
+
+    // the payload is encrypted straight from the caller's buffer when it is in one piece
+    uint8_t *payload = (uint8_t *)out + sizeof(hdr);
+    const uint8_t *plain = payload;
+    int len = 0;
+    if (iovcnt == 2)
+    {
+        plain = iov[1].iov_base;
+        len = iov[1].iov_len;
+    }
+    else
+    {
+        for (int i = 1; i < iovcnt; i++)
+        {
+            memcpy(payload + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+    }
+
+    struct trailer tr = {t->key.cipher, {0}, htonl(time(NULL)), htobe64(t->salt), htobe64(t->pn)};
+    uint8_t aad[sizeof(hdr) + sizeof(tr)], nonce[AEAD_NONCE_LEN];
+    memcpy(aad, &hdr, sizeof(hdr));
+    memcpy(aad + sizeof(hdr), &tr, sizeof(tr));
+    nonce_for(t->pn++, nonce);
+
+    memcpy(out, &hdr, sizeof(hdr));
+    aead_seal(&t->key, nonce, aad, sizeof(aad), plain, payload, len, payload + len + sizeof(tr));
+    memcpy(payload + len, &tr, sizeof(tr));
+    return sizeof(hdr) + len + UFTP_SEAL_OVERHEAD;
+}
+
+static int replayed(const struct crypto_rx *r, uint64_t pn)
+{
+    if (pn > r->top)
+        return 0;
+    uint64_t back = r->top - pn;
+    if (back >= CRYPTO_REPLAY_WINDOW)
+        return 1;
+    return r->seen[back / 64] >> (back % 64) & 1;
+}
+
+static void mark_seen(struct crypto_rx *r, uint64_t pn)
+{
+    if (pn > r->top)
+    {
+        uint64_t shift = pn - r->top;
+        if (shift >= 128)
+            r->seen[1] = r->seen[0] = 0;
+        else if (shift >= 64)
+        {
+            r->seen[1] = r->seen[0] << (shift - 64);
+            r->seen[0] = 0;
+        }
+        else
+        {
+            r->seen[1] = r->seen[1] << shift | r->seen[0] >> (64 - shift);
+            r->seen[0] <<= shift;
+        }
+        r->top = pn;
+    }
+    uint64_t back = r->top - pn;
+    r->seen[back / 64] |= 1ull << (back % 64);
+}
+
+/*
+    Opens a sealed datagram in place. Returns the length of the plain
+    packet, or -1 if it must be dropped: sealed when we have no key (or the
+    other way round), forged, stale or replayed. Without a key, cr is NULL.
+*/
+int crypto_unseal(struct uftp_crypto *cr, char *buf, int len)
+{
+    struct uftp_hdr hdr;
+    struct trailer tr;
+
+    if (len < (int)sizeof(hdr))
+        return len; // uftp_parse rejects it
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (!cr)
+        return hdr.flags & UFTP_F_SEALED ? -1 : len;
+    if (!(hdr.flags & UFTP_F_SEALED) || len < (int)sizeof(hdr) + UFTP_SEAL_OVERHEAD)
+        goto reject;
+
+    int plen = len - sizeof(hdr) - UFTP_SEAL_OVERHEAD;
+    uint8_t *payload = (uint8_t *)buf + sizeof(hdr);
+    memcpy(&tr, payload + plen, sizeof(tr));
+    uint32_t session = ntohl(hdr.session);
+    uint64_t salt = be64toh(tr.salt), pn = be64toh(tr.pn);
+
+    int32_t age = (int32_t)((uint32_t)time(NULL) - ntohl(tr.time));
+    if (age > CRYPTO_FRESH_S || age < -CRYPTO_FRESH_S)
+        goto reject;
+
+    uint64_t now = uftp_now_us();
+    if (now >= cr->sweep_us)
+        sweep(cr, now);
+
+    struct crypto_rx **head = &cr->rx[bucket(session, salt)], *r;
+    for (r = *head; r; r = r->next)
+    {
+        if (r->session == session && r->salt == salt && r->cipher == tr.cipher)
+            break;
+    }
+    int fresh = !r;
+    if (fresh)
+    {
+        // keys are only kept for packets that prove to be genuine
+        if (!(r = calloc(1, sizeof(*r))))
+            goto reject;
+        r->session = session;
+        r->salt = salt;
+        r->cipher = tr.cipher;
+        if (derive_key(cr, !cr->role, tr.cipher, session, salt, &r->key) < 0)
+        {
+            free(r);
+            goto reject;
+        }
+    }
+    else if (replayed(r, pn))
+        goto reject;
+
+    uint8_t aad[sizeof(hdr) + sizeof(tr)], nonce[AEAD_NONCE_LEN];
+    memcpy(aad, &hdr, sizeof(hdr));
+    memcpy(aad + sizeof(hdr), &tr, sizeof(tr));
+    nonce_for(pn, nonce);
+    if (aead_open(&r->key, nonce, aad, sizeof(aad), payload, plen, payload + plen + sizeof(tr)) < 0)
+    {
+        if (fresh)
+            free(r);
+        goto reject;
+    }
+
+    if (fresh)
+    {
+        r->next = *head;
+        *head = r;
+        // answer in the cipher the peer picked
+        tx_key(cr, session, tr.cipher);
+    }
+    mark_seen(r, pn);
+    r->used_us = now;
+    return sizeof(hdr) + plen;
+
+reject:
+    cr->rejected++;
+    return -1;
+}
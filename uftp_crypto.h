@@ -0,0 +1,81 @@
+/*
+ * uftp_crypto.h - sealed datagrams under a pre-shared key
+ *
+ * With a key file given to both ends, every datagram is encrypted and
+ * authenticated (see uftp_aead.h). The uftp header stays in the clear,
+ * since relays and session routing read it, but is covered by the tag;
+ * the payload is encrypted and a trailer says how to open it:
+ *
+ *     uftp header | ciphertext | cipher, 0, 0, 0, time, salt, number | tag
+ *
+ * Each end seals a session under its own key, derived from the pre-shared
+ * key, its role, the session id and a random salt, and numbers its packets
+ * from 0: the number is the nonce, and a retransmission is a new packet
+ * with a new number, so no nonce is ever used twice. The receiver drops
+ * packets stamped more than CRYPTO_FRESH_S seconds off its own clock and
+ * packet numbers it has seen before (or that fell behind a window of
+ * CRYPTO_REPLAY_WINDOW), so a captured datagram cannot be played back.
+ * The server answers each session with the cipher the client chose.
+ */
+#ifndef UFTP_CRYPTO_H
+#define UFTP_CRYPTO_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "uftp_aead.h"
+
+#define CRYPTO_TRAILER_LEN 24
+#define UFTP_SEAL_OVERHEAD (CRYPTO_TRAILER_LEN + AEAD_TAG_LEN)
+
+#define CRYPTO_CLIENT 0
+#define CRYPTO_SERVER 1
+
+#define CRYPTO_FRESH_S 60         /* largest clock difference (and packet age) accepted */
+#define CRYPTO_REPLAY_WINDOW 128  /* packet numbers remembered per sender */
+#define CRYPTO_BUCKETS 1024
+#define CRYPTO_SWEEP_US 10000000 /* how often idle keys are dropped */
+
+/* our key for one session */
+struct crypto_tx
+{
+    uint32_t session;
+    uint64_t salt;
+    uint64_t pn; /* next packet number */
+    uint64_t used_us;
+    struct aead_key key;
+    struct crypto_tx *next;
+};
+
+/* a peer's key for one session, with the packet numbers already accepted */
+struct crypto_rx
+{
+    uint32_t session;
+    uint64_t salt;
+    int cipher;
+    uint64_t top;     /* highest packet number accepted */
+    uint64_t seen[2]; /* bit i: top - i was accepted */
+    uint64_t used_us;
+    struct aead_key key;
+    struct crypto_rx *next;
+};
+
+struct uftp_crypto
+{
+    uint8_t master[32]; /* SHA-256 of the key file */
+    int role;
+    int cipher; /* what sessions we open are sealed with */
+    struct crypto_tx *tx[CRYPTO_BUCKETS];
+    struct crypto_rx *rx[CRYPTO_BUCKETS];
+    uint64_t sweep_us;
+    uint64_t rejected; /* datagrams that failed to open */
+};
+
+int crypto_init(struct uftp_crypto *cr, const char *keyfile, int role, int cipher);
+struct uftp_crypto *crypto_clone(const struct uftp_crypto *cr);
+void crypto_free(struct uftp_crypto *cr);
+int crypto_cipher_by_name(const char *name);
+int crypto_seal(struct uftp_crypto *cr, const struct iovec *iov, int iovcnt, char *out);
+int crypto_unseal(struct uftp_crypto *cr, char *buf, int len);
+
+#endif
@@ -0,0 +1,466 @@
+/*
+ * uftp_multisrc.c - one download from several servers holding the same file
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "uftp_multisrc.h"
+#include "uftp_sync.h"
+
+static void wake_by(uint64_t *wake, uint64_t t)
+{
+    if (t && t < *wake)
+        *wake = t;
+}
+
+static void copy_text(const struct uftp_pkt *p, char *text, int textlen)
+{
+    int n = p->len < textlen - 1 ? p->len : textlen - 1;
+    memcpy(text, p->data, n);
+    text[n] = '\0';
+}
+
+/*------------------------------------ requests ------------------------------------*/
+
+static void send_request(struct msrc_source *s, const char *cmd, uint64_t now)
+{
+    s->req.session = uftp_new_session();
+    snprintf(s->req.cmd, sizeof(s->req.cmd), "%s", cmd);
+    s->req.tries = 0;
+    s->req.rto_us = UFTP_RTO_INIT_US;
+    s->req.deadline_us = now + s->req.rto_us;
+    s->req.give_up_us = 0;
+    uftp_conn_send_text(&s->conn, 0, UFTP_CMD, s->req.session, s->req.cmd);
+}
+
+/* Retransmits the pending command when due; -1 once the source has had its chances */
+static int retry_request(struct msrc_source *s, uint64_t now, uint64_t *wake)
+{
+    if (now >= s->req.deadline_us)
+    {
+        if (s->req.give_up_us ? now >= s->req.give_up_us : ++s->req.tries > UFTP_MAX_RETRIES)
+            return -1;
+        uftp_conn_send_text(&s->conn, 0, UFTP_CMD, s->req.session, s->req.cmd);
+        s->req.rto_us = s->req.rto_us * 2 > UFTP_RTO_MAX_US ? UFTP_RTO_MAX_US : s->req.rto_us * 2;
+        s->req.deadline_us = now + s->req.rto_us;
+    }
+    wake_by(wake, s->req.deadline_us);
+    return 0;
+}
+
+/*------------------------------------ ranges ------------------------------------*/
+
+static void push_pending(struct msrc *m, off_t offset, off_t length)
+{
+    if (length <= 0)
+        return;
+    if (m->npending == m->cap)
+    {
+        m->cap = m->cap ? m->cap * 2 : 64;
+        m->pending = realloc(m->pending, m->cap * sizeof(*m->pending));
+    }
+    m->pending[m->npending++] = (struct msrc_range){offset, length};
+}
+
+/* Cuts the file into a few ranges per source, each a whole number of chunks */
+static void plan_ranges(struct msrc *m)
+{
+    off_t each = m->size / ((off_t)m->nsources * MSRC_RANGES_PER_SOURCE);
+    each = (each + CHUNKSIZE - 1) / CHUNKSIZE * CHUNKSIZE;
+    if (each < MSRC_MIN_RANGE)
+        each = MSRC_MIN_RANGE;
+
+    for (off_t offset = 0; offset < m->size; offset += each)
+        push_pending(m, offset, m->size - offset < each ? m->size - offset : each);
+}
+
+/* Bytes of a source's range that have arrived in order */
+static off_t range_done(struct msrc_source *s)
+{
+    off_t done = s->started ? (off_t)s->rx.cum * CHUNKSIZE : 0;
+    return done < s->range.length ? done : s->range.length;
+}
+
+static void fetch_range(struct msrc *m, struct msrc_source *s, struct msrc_range r, uint64_t now)
+{
+    char cmd[UFTP_CMD_MAX];
+
+    s->state = MSRC_BUSY;
+    s->range = r;
+    s->started = 0;
+    s->busy_since_us = now;
+    s->ranges++;
+    snprintf(cmd, sizeof(cmd), "get -r %lld %lld %s", (long long)r.offset, (long long)r.length, m->remote);
+    send_request(s, cmd, now);
+    receiver_init(&s->rx, m->fd, s->req.session, NULL);
+    s->rx.base = r.offset;
+}
+
+/*
+    Gives an idle source the back half of the range with the most left to
+    fetch. The other source keeps what it has already received plus the
+    front half, and stops once it has that. Returns 0 if nothing was worth
+    splitting.
+*/
+static int steal_range(struct msrc *m, struct msrc_source *thief, uint64_t now)
+{
+    struct msrc_source *victim = NULL;
+    off_t most = 0;
+
+    for (int i = 0; i < m->nsources; i++)
+    {
+        struct msrc_source *s = &m->src[i];
+        if (s->state == MSRC_BUSY && s->range.length - range_done(s) > most)
+        {
+            victim = s;
+            most = s->range.length - range_done(s);
+        }
+    }
+    if (!victim || most < 2 * MSRC_MIN_STEAL)
+        return 0;
+
+    off_t keep = range_done(victim) + (most / 2 + CHUNKSIZE - 1) / CHUNKSIZE * CHUNKSIZE;
+    struct msrc_range r = {victim->range.offset + keep, victim->range.length - keep};
+    victim->range.length = keep;
+    fetch_range(m, thief, r, now);
+    thief->stolen++;
+    return 1;
+}
+
+/* The source has everything of its (possibly shortened) range */
+static void finish_range(struct msrc_source *s, uint64_t now)
+{
+    s->bytes += s->range.length;
+    s->busy_us += now - s->busy_since_us;
+    s->state = MSRC_IDLE;
+    if (s->rx.done)
+    {
+        // keep the final ACK state around in case the server retransmits the last chunk
+        s->last_rx = s->rx;
+        s->last_rx.fd = -1;
+    }
+    else
+    {
+        // the rest was taken over by another source: stop this one sending it
+        uftp_conn_send_text(&s->conn, 0, UFTP_FAIL, s->rx.session, "Range taken over by another source.");
+    }
+}
+
+/* Drops a source; whatever it had not delivered yet goes back to the others */
+static void drop_source(struct msrc *m, struct msrc_source *s, const char *why, uint64_t now)
+{
+    printf("Source %s dropped: %s\n", s->name, why);
+    if (s->state == MSRC_BUSY)
+    {
+        off_t done = range_done(s);
+        push_pending(m, s->range.offset + done, s->range.length - done);
+        s->bytes += done;
+        s->busy_us += now - s->busy_since_us;
+        uftp_conn_send_text(&s->conn, 0, UFTP_FAIL, s->rx.session, why);
+    }
+    if (s->state == MSRC_HASHING)
+        m->hash_asked = 0;
+    if (s->state != MSRC_DEAD)
+        m->alive--;
+    s->state = MSRC_DEAD;
+    snprintf(m->reason, sizeof(m->reason), "%s: %s", s->name, why);
+}
+
+/*------------------------------------ event loop ------------------------------------*/
+
+/* Finds work for an idle source: the next range, the file's hash, or part of a slower source's range */
+static void assign(struct msrc *m, struct msrc_source *s, uint64_t now)
+{
+    char cmd[UFTP_CMD_MAX];
+
+    if (m->npending)
+    {
+        struct msrc_range r = m->pending[0];
+        memmove(m->pending, m->pending + 1, --m->npending * sizeof(*m->pending));
+        fetch_range(m, s, r, now);
+    }
+    else if (!m->hash_asked && !m->hash[0])
+    {
+        // the answer waits for the server to read the whole file, so ask a source with nothing else left to fetch
+        snprintf(cmd, sizeof(cmd), "hash %s", m->remote);
+        send_request(s, cmd, now);
+        s->req.give_up_us = now + (uint64_t)UFTP_MAX_RETRIES * UFTP_RTO_MAX_US + m->size / MSRC_HASH_RATE * 1000000;
+        s->state = MSRC_HASHING;
+        m->hash_asked = 1;
+    }
+    else
+    {
+        steal_range(m, s, now);
+    }
+}
+
+/* Timers of one source: command retransmission, delayed ACKs, silence */
+static void drive_source(struct msrc *m, struct msrc_source *s, uint64_t now, uint64_t *wake)
+{
+    if (s->state == MSRC_STAT || s->state == MSRC_HASHING || (s->state == MSRC_BUSY && !s->started))
+    {
+        if (retry_request(s, now, wake) < 0)
+            drop_source(m, s, "no answer", now);
+        return;
+    }
+    if (s->state != MSRC_BUSY)
+        return;
+
+    receiver_on_timer(&s->rx, now, uftp_conn_send, &s->conn);
+    uint64_t silent_until = s->last_heard_us + (uint64_t)UFTP_MAX_RETRIES * UFTP_RTO_MAX_US;
+    if (now >= silent_until)
+    {
+        drop_source(m, s, "stopped sending", now);
+        return;
+    }
+    wake_by(wake, s->rx.ack_due_us);
+    wake_by(wake, silent_until);
+}
+
+/* Handles one packet from a source */
+static void dispatch(struct msrc *m, struct msrc_source *s, struct uftp_pkt *p, uint64_t now)
+{
+    char text[UFTP_REPLY_MAX];
+
+    if (p->type == UFTP_DATA && s->last_rx.done && p->session == s->last_rx.session)
+    {
+        receiver_on_data(&s->last_rx, p, now, uftp_conn_send, &s->conn);
+        return;
+    }
+    if (s->state == MSRC_DEAD || p->session != s->req.session)
+        return;
+
+    if (p->type == UFTP_FAIL)
+    {
+        copy_text(p, text, sizeof(text));
+        drop_source(m, s, text, now);
+        return;
+    }
+
+    if (s->state == MSRC_STAT && p->type == UFTP_REPLY)
+    {
+        long long size;
+        copy_text(p, text, sizeof(text));
+        if (sscanf(text, "%lld", &size) != 1)
+        {
+            drop_source(m, s, "bad stat reply", now);
+            return;
+        }
+        if (m->size < 0)
+        {
+            m->size = size; // the first answer decides
+            plan_ranges(m);
+        }
+        if (size != m->size)
+        {
+            drop_source(m, s, "file size differs from the other sources", now);
+            return;
+        }
+        s->state = MSRC_IDLE;
+    }
+    else if (s->state == MSRC_HASHING && p->type == UFTP_REPLY)
+    {
+        copy_text(p, text, sizeof(text));
+        if (!sha256_is_hex(text))
+        {
+            drop_source(m, s, "bad hash reply", now);
+            return;
+        }
+        memcpy(m->hash, text, SHA256_HEX_LEN);
+        s->state = MSRC_IDLE;
+    }
+    else if (s->state == MSRC_BUSY && p->type == UFTP_DATA)
+    {
+        s->started = 1;
+        s->last_heard_us = now;
+        receiver_on_data(&s->rx, p, now, uftp_conn_send, &s->conn);
+        if (s->rx.failed)
+        {
+            uftp_conn_send_text(&s->conn, 0, UFTP_FAIL, s->rx.session, "Error writing file on the receiving side.");
+            snprintf(m->reason, sizeof(m->reason), "%s", strerror(EIO));
+        }
+        else if (s->rx.done || range_done(s) >= s->range.length)
+        {
+            finish_range(s, now);
+        }
+    }
+}
+
+static void print_sources(struct msrc *m)
+{
+    for (int i = 0; i < m->nsources; i++)
+    {
+        struct msrc_source *s = &m->src[i];
+        double secs = s->busy_us / 1e6;
+
+        printf("  %-21s %10lld bytes in %d ranges (%d taken over), %.1f MB/s%s\n", s->name, (long long)s->bytes,
+               s->ranges, s->stolen, secs > 0 ? s->bytes / secs / 1e6 : 0.0, s->state == MSRC_DEAD ? ", dropped" : "");
+    }
+}
+
+/* Runs the download; returns UFTP_OK once every range is in and the hash is known */
+static int run(struct msrc *m)
+{
+    struct pollfd pfd[MSRC_MAX_SOURCES];
+    char buf[UFTP_MAX_PACKET];
+    struct uftp_pkt p;
+    char cmd[UFTP_CMD_MAX];
+    uint64_t now = uftp_now_us();
+
+    snprintf(cmd, sizeof(cmd), "stat %s", m->remote);
+    for (int i = 0; i < m->nsources; i++)
+        send_request(&m->src[i], cmd, now);
+
+    while (1)
+    {
+        uint64_t wake = now + UFTP_RTO_MAX_US;
+        int busy = 0;
+
+        if (m->alive == 0)
+            return UFTP_ERR_ABORTED;
+        for (int i = 0; i < m->nsources; i++)
+        {
+            struct msrc_source *s = &m->src[i];
+            if (s->state == MSRC_IDLE)
+                assign(m, s, now);
+            drive_source(m, s, now, &wake);
+            if (s->state == MSRC_BUSY && s->rx.failed)
+                return UFTP_ERR_IO;
+            busy |= s->state == MSRC_BUSY || s->state == MSRC_HASHING;
+        }
+        if (m->size >= 0 && !m->npending && !busy && m->hash[0])
+            return UFTP_OK;
+
+        for (int i = 0; i < m->nsources; i++)
+            pfd[i] = (struct pollfd){m->src[i].conn.paths[0].sockfd, POLLIN, 0};
+        now = uftp_now_us();
+        poll(pfd, m->nsources, wake > now ? (wake - now + 999) / 1000 : 0);
+
+        for (int i = 0; i < m->nsources; i++)
+        {
+            struct msrc_source *s = &m->src[i];
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            int n;
+
+            if (!(pfd[i].revents & POLLIN))
+                continue;
+            while ((n = recvfrom(s->conn.paths[0].sockfd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from,
+                                 &fromlen)) >= 0)
+            {
+                fromlen = sizeof(from);
+                if (from.sin_addr.s_addr != s->conn.paths[0].peer.sin_addr.s_addr ||
+                    from.sin_port != s->conn.paths[0].peer.sin_port)
+                    continue;
+                if ((n = crypto_unseal(s->conn.crypto, buf, n)) >= 0 && uftp_parse(buf, n, &p) == 0)
+                    dispatch(m, s, &p, uftp_now_us());
+            }
+        }
+        now = uftp_now_us();
+    }
+}
+
+/*
+    Downloads remote into local from every source in peers at once (see
+    uftp_multisrc.h), writing to <local>.uftp-part and renaming it once the
+    SHA-256 matches. Prints what each source contributed. Returns UFTP_OK
+    or one of the UFTP_ERR_ codes.
+*/
+int msrc_get(const struct sockaddr_in *peers, int npeers, struct uftp_crypto *cr, const char *remote,
+             const char *local)
+{
+    struct msrc *m = calloc(1, sizeof(*m));
+    char partname[PATH_MAX + 16];
+    int status = UFTP_ERR_IO;
+
+    m->remote = remote;
+    m->size = -1;
+    m->nsources = npeers < MSRC_MAX_SOURCES ? npeers : MSRC_MAX_SOURCES;
+    for (int i = 0; i < m->nsources; i++)
+    {
+        struct msrc_source *s = &m->src[i];
+        char addr[INET_ADDRSTRLEN];
+
+        s->conn.paths[0].sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (s->conn.paths[0].sockfd < 0)
+        {
+            perror("ERROR opening socket");
+            m->nsources = i;
+            goto out;
+        }
+        uftp_set_buffers(s->conn.paths[0].sockfd);
+        s->conn.paths[0].peer = peers[i];
+        s->conn.npaths = 1;
+        s->conn.crypto = cr;
+        inet_ntop(AF_INET, &peers[i].sin_addr, addr, sizeof(addr));
+        snprintf(s->name, sizeof(s->name), "%s:%d", addr, ntohs(peers[i].sin_port));
+        m->alive++;
+    }
+
+    snprintf(partname, sizeof(partname), "%s.uftp-part", local);
+    sync_make_parents(partname);
+    m->fd = open(partname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (m->fd < 0)
+    {
+        printf("Error creating file\n");
+        goto out;
+    }
+
+    status = run(m);
+    close(m->fd);
+
+    if (status == UFTP_OK)
+    {
+        char hex[SHA256_HEX_LEN];
+
+        if (sha256_file(partname, hex) < 0)
+        {
+            printf("Error reading back %s: %s\n", partname, strerror(errno));
+            status = UFTP_ERR_IO;
+        }
+        else if (strcmp(hex, m->hash) != 0)
+        {
+            printf("SHA-256 mismatch: got %s, sources say %s. The sources do not hold the same file.\n", hex, m->hash);
+            status = UFTP_ERR_IO;
+        }
+        else if (rename(partname, local) < 0)
+        {
+            printf("Error renaming %s: %s\n", partname, strerror(errno));
+            status = UFTP_ERR_IO;
+        }
+        else
+        {
+            int used = 0;
+            for (int i = 0; i < m->nsources; i++)
+                used += m->src[i].bytes > 0;
+            printf("File received successfully: %lld bytes from %d sources, SHA-256 verified.\n", (long long)m->size,
+                   used);
+        }
+    }
+    else if (status == UFTP_ERR_IO)
+    {
+        printf("Error writing file: %s\n", m->reason);
+    }
+    else
+    {
+        printf("File not received: no source left (%s)\n", m->reason);
+    }
+    if (status != UFTP_OK)
+        remove(partname);
+    print_sources(m);
+
+out:
+    for (int i = 0; i < m->nsources; i++)
+        close(m->src[i].conn.paths[0].sockfd);
+    free(m->pending);
+    free(m);
+    return status;
+}
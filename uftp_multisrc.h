@@ -0,0 +1,88 @@
+/*
+ * uftp_multisrc.h - one download from several servers holding the same file
+ *
+ * Every source is asked for the file's size first; one that disagrees with
+ * the first answer is dropped. The file is then cut into ranges, a few per
+ * source, and each source fetches one range at a time with "get -r". A
+ * source that runs out of ranges takes over the back half of whatever the
+ * slowest-looking source still has left, so a slow or stalled server holds
+ * up only the part it has not sent yet; a source that goes silent gives its
+ * remainder back to the others. The first source to run out of work is
+ * asked for the file's SHA-256, and the download is kept only if it
+ * matches.
+ */
+#ifndef UFTP_MULTISRC_H
+#define UFTP_MULTISRC_H
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#include "uftp_proto.h"
+#include "uftp_sha256.h"
+
+#define MSRC_MAX_SOURCES 16
+#define MSRC_RANGES_PER_SOURCE 4         /* ranges the file is cut into per source */
+#define MSRC_MIN_RANGE (64 * CHUNKSIZE)  /* smallest range handed out up front */
+#define MSRC_MIN_STEAL (16 * CHUNKSIZE)  /* smallest piece worth taking over from another source */
+#define MSRC_HASH_RATE 50000000          /* bytes/s a server hashes at least, for the hash timeout */
+
+/* source states */
+#define MSRC_STAT 0    /* asked for the file's size */
+#define MSRC_IDLE 1    /* waiting for work */
+#define MSRC_BUSY 2    /* fetching a range */
+#define MSRC_HASHING 3 /* asked for the file's hash */
+#define MSRC_DEAD 4
+
+struct msrc_range
+{
+    off_t offset, length;
+};
+
+/* a command retransmitted until the source answers */
+struct msrc_request
+{
+    uint32_t session;
+    char cmd[UFTP_CMD_MAX];
+    int tries;
+    uint64_t rto_us, deadline_us;
+    uint64_t give_up_us; /* a hash may take long to compute; other commands give up after UFTP_MAX_RETRIES */
+};
+
+struct msrc_source
+{
+    struct uftp_conn conn; /* one path, to this source only */
+    char name[32];         /* address:port */
+    int state;
+    struct msrc_request req; /* stat, hash, or the get of a range until its first chunk */
+
+    struct msrc_range range; /* MSRC_BUSY; shrinks when another source takes over its end */
+    int started;
+    uint64_t last_heard_us;
+    struct uftp_receiver rx;
+    struct uftp_receiver last_rx; /* finished range, re-ACKed if the source missed our final ACK */
+
+    off_t bytes;        /* delivered in finished ranges */
+    int ranges, stolen; /* ranges fetched, and how many of them were taken over from another source */
+    uint64_t busy_us, busy_since_us;
+};
+
+struct msrc
+{
+    struct msrc_source src[MSRC_MAX_SOURCES];
+    int nsources, alive;
+    const char *remote;
+    int fd;
+    off_t size; /* -1 until a source has told us */
+
+    struct msrc_range *pending; /* ranges nobody is fetching, in file order unless given back */
+    int npending, cap;
+
+    int hash_asked;
+    char hash[SHA256_HEX_LEN]; /* empty until a source has answered */
+    char reason[UFTP_REPLY_MAX];
+};
+
+int msrc_get(const struct sockaddr_in *peers, int npeers, struct uftp_crypto *cr, const char *remote,
+             const char *local);
+
+#endif
@@ -0,0 +1,1054 @@
+/*
+ * uftp_proto.c - reliable chunk stream shared by the client and server
+ *
+ * The sender keeps up to UFTP_WINDOW chunks in flight straight out of the
+ * read-ahead ring. Losses are detected RACK-style: a chunk still missing
+ * when a chunk sent after it has been (selectively) acknowledged is
+ * retransmitted at once; anything else waits for the retransmission timer,
+ * which follows the measured RTT (RFC 6298) between UFTP_RTO_MIN_US and
+ * UFTP_RTO_MAX_US. Both run per path when a transfer has several: each
+ * chunk remembers the path it went out on, and a path that times out is
+ * taken off the schedule and probed until it answers again.
+ *
+ * The receiver writes chunks at their final offset as they arrive, so
+ * out-of-order data needs no buffering. In-order chunks are acknowledged
+ * every UFTP_ACK_EVERY packets or after UFTP_ACK_DELAY_US at the latest;
+ * gaps, duplicates and the end of the stream are acknowledged immediately.
+ *
+ * The sender/receiver state machines never touch a socket themselves; the
+ * server drives many of them from its event loop, while the client uses
+ * the blocking drivers at the bottom of this file.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "uftp_proto.h"
+
+uint64_t uftp_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+    Sizes the socket buffers for a full window in flight; the default
+    receive buffer holds only a handful of 16KB chunks.
+*/
+void uftp_set_buffers(int sockfd)
+{
+    int size = UFTP_SOCKBUF;
+
+    // the *FORCE variants ignore the rmem_max/wmem_max caps when we're privileged
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+/* Random non-zero session id, so a restarted client never collides with its old sessions */
+uint32_t uftp_new_session(void)
+{
+    uint32_t id = 0;
+
+    while (id == 0)
+    {
+        if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+            id = (uint32_t)rand() ^ (uint32_t)uftp_now_us();
+    }
+    return id;
+}
+
+static void fill_hdr(struct uftp_hdr *hdr, int type, int flags, int path, uint32_t session, uint32_t seq,
+                     uint32_t ts)
+{
+    hdr->type = type;
+    hdr->flags = flags;
+    hdr->path = htons(path);
+    hdr->session = htonl(session);
+    hdr->seq = htonl(seq);
+    hdr->ts = htonl(ts);
+}
+
+/* Splits a datagram into header fields and payload; returns -1 if it is malformed */
+int uftp_parse(const char *buf, int len, struct uftp_pkt *p)
+{
+    struct uftp_hdr hdr;
+
+    if (len < (int)sizeof(hdr))
+        return -1;
+    memcpy(&hdr, buf, sizeof(hdr));
+
+    p->type = hdr.type;
+    p->flags = hdr.flags;
+    p->path = ntohs(hdr.path);
+    p->session = ntohl(hdr.session);
+    p->seq = ntohl(hdr.seq);
+    p->ts = ntohl(hdr.ts);
+    p->cmd = NULL;
+    p->data = buf + sizeof(hdr);
+    p->len = len - sizeof(hdr);
+
+    if (p->type == UFTP_CMD)
+    {
+        const char *nul = memchr(p->data, '\0', p->len);
+        if (!nul)
+            return -1;
+        p->cmd = p->data;
+        p->len -= nul + 1 - p->data;
+        p->data = nul + 1;
+    }
+    return 0;
+}
+
+/*------------------------------------ sender ------------------------------------*/
+
+void sender_init(struct uftp_sender *s, struct readahead *ra, uint32_t session, const char *cmd)
+{
+    memset(s, 0, sizeof(*s));
+    s->ra = ra;
+    s->session = session;
+    s->cmd = cmd;
+    s->last_seq = -1;
+
+    /* in-flight chunks live in the ring, so leave the reader room to work ahead */
+    s->window = ra->depth / 2;
+    if (s->window > UFTP_WINDOW)
+        s->window = UFTP_WINDOW;
+    if (s->window < 1)
+        s->window = 1;
+}
+
+/* Lets the sender use a path; nothing is sent until at least one has been added */
+void sender_add_path(struct uftp_sender *s, int path)
+{
+    if (path < 0 || path >= UFTP_MAX_PATHS || s->paths[path].usable)
+        return;
+    s->paths[path].usable = 1;
+    s->paths[path].rto_us = UFTP_RTO_INIT_US;
+}
+
+static int healthy_paths(struct uftp_sender *s)
+{
+    int n = 0;
+    for (int i = 0; i < UFTP_MAX_PATHS; i++)
+        n += s->paths[i].usable && s->paths[i].backoffs == 0;
+    return n;
+}
+
+/*
+    Whether chunks may be scheduled on a path. Once a path times out it is
+    left to probes as long as some other path still answers; with none left,
+    every path that has not given up keeps retransmitting as a single path would.
+*/
+static int schedulable(struct uftp_sender *s, int path)
+{
+    struct uftp_path *pa = &s->paths[path];
+    return pa->usable && !pa->dead && (pa->backoffs == 0 || healthy_paths(s) == 0);
+}
+
+/*
+    Picks the path expected to deliver one more chunk first: its RTT plus
+    the time to drain what is already queued on it at its delivery rate.
+    Until a rate is measured, a window per RTT is assumed.
+*/
+static int pick_path(struct uftp_sender *s)
+{
+    int best = -1;
+    uint64_t best_cost = 0;
+
+    for (int i = 0; i < UFTP_MAX_PATHS; i++)
+    {
+        struct uftp_path *pa = &s->paths[i];
+        if (!schedulable(s, i))
+            continue;
+
+        uint64_t srtt = pa->srtt_us ? pa->srtt_us : UFTP_RTO_MIN_US;
+        uint64_t per_chunk = pa->rate ? (uint64_t)CHUNKSIZE * 1000000 / pa->rate : srtt / UFTP_WINDOW;
+        uint64_t cost = srtt + (pa->inflight + 1) * per_chunk + (uint64_t)pa->backoffs * pa->rto_us;
+
+        if (best < 0 || cost < best_cost)
+        {
+            best = i;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+/* Earliest time any path needs the timer: a retransmission timeout or a probe */
+static void update_deadline(struct uftp_sender *s)
+{
+    s->rto_deadline_us = 0;
+    for (int i = 0; i < UFTP_MAX_PATHS; i++)
+    {
+        struct uftp_path *pa = &s->paths[i];
+        uint64_t t = pa->rto_deadline_us;
+
+        if (pa->usable && pa->probe_us && s->base != s->next && !schedulable(s, i) && (!t || pa->probe_us < t))
+            t = pa->probe_us;
+        if (t && (!s->rto_deadline_us || t < s->rto_deadline_us))
+            s->rto_deadline_us = t;
+    }
+}
+
+static void transmit(struct uftp_sender *s, uint32_t seq, int path, uint64_t now, uftp_send_fn send, void *ctx)
+{
+    struct uftp_chunk *c = &s->chunks[seq % UFTP_WINDOW];
+    struct uftp_hdr hdr;
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    // chunk 0 of a put rides along with the command that opens the session
+    int is_cmd = (seq == 0 && s->cmd);
+
+    fill_hdr(&hdr, is_cmd ? UFTP_CMD : UFTP_DATA, c->last ? UFTP_F_LAST : 0, path, s->session, seq, now);
+    iov[iovcnt++] = (struct iovec){&hdr, sizeof(hdr)};
+    if (is_cmd)
+        iov[iovcnt++] = (struct iovec){(void *)s->cmd, strlen(s->cmd) + 1};
+    iov[iovcnt++] = (struct iovec){c->data, c->len};
+    send(ctx, path, iov, iovcnt);
+}
+
+static void send_chunk(struct uftp_sender *s, uint32_t seq, int path, uint64_t now, uftp_send_fn send, void *ctx)
+{
+    struct uftp_chunk *c = &s->chunks[seq % UFTP_WINDOW];
+    struct uftp_path *pa = &s->paths[path];
+
+    transmit(s, seq, path, now, send, ctx);
+
+    // a path that was idle starts a new delivery rate sample
+    if (pa->inflight == 0)
+    {
+        pa->rate_start_us = now;
+        pa->rate_bytes = 0;
+    }
+    c->sent_us = now;
+    c->path = path;
+    c->in_flight = 1;
+    pa->inflight++;
+    if (!pa->rto_deadline_us)
+        pa->rto_deadline_us = now + pa->rto_us;
+}
+
+/* The chunk no longer counts against its path: delivered, or given up on there */
+static void leave_flight(struct uftp_sender *s, struct uftp_chunk *c)
+{
+    if (!c->in_flight)
+        return;
+    c->in_flight = 0;
+    s->paths[c->path].inflight--;
+}
+
+/*
+    Sends every chunk marked lost, then new chunks while the window has room,
+    each on the path pick_path() chooses. Paths taken off the schedule get a
+    copy of the oldest outstanding chunk as a probe when one is due.
+    Returns the number of packets sent.
+*/
+int sender_pump(struct uftp_sender *s, uint64_t now, uftp_send_fn send, void *ctx)
+{
+    return sender_pump_max(s, now, INT_MAX, send, ctx);
+}
+
+/* Like sender_pump, but stops after `max` packets (the server's scheduler hands out turns) */
+int sender_pump_max(struct uftp_sender *s, uint64_t now, int max, uftp_send_fn send, void *ctx)
+{
+    int sent = 0;
+
+    if (s->done || s->failed)
+        return 0;
+
+    for (int i = 0; i < UFTP_MAX_PATHS; i++)
+    {
+        struct uftp_path *pa = &s->paths[i];
+        if (pa->probe_due && s->base != s->next)
+        {
+            if (sent == max)
+                continue; // keep it due for the next turn
+            transmit(s, s->base, i, now, send, ctx);
+            sent++;
+        }
+        pa->probe_due = 0;
+    }
+
+    if (s->nlost)
+    {
+        int left = 0;
+        int path = 0;
+
+        for (uint32_t seq = s->base; seq != s->next; seq++)
+        {
+            struct uftp_chunk *c = &s->chunks[seq % UFTP_WINDOW];
+            if (!c->lost || c->acked)
+                continue;
+            if (sent == max || path < 0 || (path = pick_path(s)) < 0)
+            {
+                left++; // no turn or no path left: stays marked for the next pump
+                continue;
+            }
+            c->lost = 0;
+            send_chunk(s, seq, path, now, send, ctx);
+            s->retransmits++;
+            sent++;
+        }
+        s->nlost = left;
+    }
+
+    while (!s->eof && s->next - s->base < (uint32_t)s->window && sent < max)
+    {
+        char *data = NULL;
+        int last = 0;
+        int path = pick_path(s);
+
+        if (path < 0)
+            break;
+        int n = ra_try_next(s->ra, &data, &last);
+
+        if (n < 0)
+        {
+            if (errno != EAGAIN)
+                s->failed = UFTP_ERR_IO;
+            break; // reader hasn't caught up yet, try again on the next pump
+        }
+        if (n == 0)
+        {
+            if (s->next != 0)
+            {
+                s->failed = UFTP_ERR_IO;
+                break;
+            }
+            last = 1; // empty file: a single empty final chunk
+        }
+
+        struct uftp_chunk *c = &s->chunks[s->next % UFTP_WINDOW];
+        c->data = data;
+        c->len = n;
+        c->last = last;
+        c->acked = 0;
+        c->lost = 0;
+        c->in_flight = 0;
+        if (last)
+        {
+            s->eof = 1;
+            s->last_seq = s->next;
+        }
+
+        send_chunk(s, s->next, path, now, send, ctx);
+        s->next++;
+        sent++;
+    }
+
+    update_deadline(s);
+    return sent;
+}
+
+static void update_rtt(struct uftp_path *pa, uint64_t rtt)
+{
+    if (pa->srtt_us == 0)
+    {
+        pa->srtt_us = rtt;
+        pa->rttvar_us = rtt / 2;
+    }
+    else
+    {
+        uint64_t delta = rtt > pa->srtt_us ? rtt - pa->srtt_us : pa->srtt_us - rtt;
+        pa->rttvar_us = (3 * pa->rttvar_us + delta) / 4;
+        pa->srtt_us = (7 * pa->srtt_us + rtt) / 8;
+    }
+
+    pa->rto_us = pa->srtt_us + 4 * pa->rttvar_us;
+    if (pa->rto_us < UFTP_RTO_MIN_US)
+        pa->rto_us = UFTP_RTO_MIN_US;
+    if (pa->rto_us > UFTP_RTO_MAX_US)
+        pa->rto_us = UFTP_RTO_MAX_US;
+}
+
+/* Credits a delivered chunk to the path that carried it */
+static void delivered(struct uftp_sender *s, struct uftp_chunk *c, unsigned *paths_hit)
+{
+    struct uftp_path *pa = &s->paths[c->path];
+
+    if (c->sent_us > pa->rack_us)
+        pa->rack_us = c->sent_us;
+    pa->rate_bytes += c->len;
+    *paths_hit |= 1u << c->path;
+    leave_flight(s, c);
+}
+
+static void sample_rate(struct uftp_path *pa, uint64_t now)
+{
+    uint64_t interval = pa->srtt_us > 10000 ? pa->srtt_us : 10000;
+    uint64_t elapsed = now - pa->rate_start_us;
+
+    if (elapsed < interval)
+        return;
+    uint64_t rate = pa->rate_bytes * 1000000 / elapsed;
+    pa->rate = pa->rate ? (3 * pa->rate + rate) / 4 : rate;
+    pa->rate_start_us = now;
+    pa->rate_bytes = 0;
+}
+
+void sender_on_ack(struct uftp_sender *s, const struct uftp_pkt *p, uint64_t now)
+{
+    uint64_t sack;
+
+    if (p->type != UFTP_ACK || p->len < (int)sizeof(sack) || s->done || s->failed)
+        return;
+    memcpy(&sack, p->data, sizeof(sack));
+    sack = be64toh(sack);
+
+    uint32_t cum = p->seq;
+
+    // ignore stale ACKs and anything acknowledging chunks we never sent
+    if ((int32_t)(cum - s->base) < 0 || cum - s->base > s->next - s->base)
+        return;
+
+    // the ACK came back over this path, so the path works again if it had stopped
+    struct uftp_path *echo = p->path < UFTP_MAX_PATHS && s->paths[p->path].usable ? &s->paths[p->path] : NULL;
+    if (echo && (echo->backoffs || echo->dead))
+    {
+        if (echo->dead)
+            printf("Path %d is answering again.\n", p->path);
+        echo->backoffs = 0;
+        echo->dead = 0;
+        echo->probe_us = 0;
+    }
+
+    int progress = 0;
+    unsigned paths_hit = 0;
+
+    for (; s->base != cum; s->base++)
+    {
+        struct uftp_chunk *c = &s->chunks[s->base % UFTP_WINDOW];
+        if (!c->acked)
+            delivered(s, c, &paths_hit);
+        if (c->data)
+            ra_release(s->ra, 1);
+        c->data = NULL;
+        progress = 1;
+    }
+
+    for (int i = 0; i < 64 && sack; i++, sack >>= 1)
+    {
+        uint32_t seq = cum + 1 + i;
+        if (!(sack & 1) || seq - s->base >= s->next - s->base)
+            continue;
+
+        struct uftp_chunk *c = &s->chunks[seq % UFTP_WINDOW];
+        if (!c->acked)
+        {
+            c->acked = 1;
+            delivered(s, c, &paths_hit);
+            progress = 1;
+        }
+    }
+
+    if (!progress)
+    {
+        update_deadline(s);
+        return;
+    }
+
+    uint32_t rtt = (uint32_t)now - p->ts;
+    if (echo && rtt < UFTP_RTO_MAX_US * 10)
+        update_rtt(echo, rtt);
+
+    // anything sent on a path before its newest delivered chunk (plus some reordering slack) is lost
+    for (uint32_t seq = s->base; seq != s->next; seq++)
+    {
+        struct uftp_chunk *c = &s->chunks[seq % UFTP_WINDOW];
+        struct uftp_path *pa = &s->paths[c->path];
+        if (c->in_flight && !c->acked && c->sent_us + pa->srtt_us / 4 < pa->rack_us)
+        {
+            c->lost = 1;
+            s->nlost++;
+            leave_flight(s, c);
+        }
+    }
+
+    for (int i = 0; i < UFTP_MAX_PATHS; i++)
+    {
+        struct uftp_path *pa = &s->paths[i];
+        if (paths_hit & (1u << i))
+        {
+            sample_rate(pa, now);
+            if (!pa->dead)
+                pa->backoffs = 0;
+            pa->rto_deadline_us = pa->inflight ? now + pa->rto_us : 0;
+        }
+        else if (!pa->inflight)
+        {
+            pa->rto_deadline_us = 0;
+        }
+    }
+    update_deadline(s);
+
+    if (s->last_seq >= 0 && s->base > (uint32_t)s->last_seq)
+    {
+        s->done = 1;
+
+        // the final ACK may carry the receiver's closing words (e.g. "Put x successful!")
+        int n = p->len - sizeof(sack);
+        if (n >= UFTP_REPLY_MAX)
+            n = UFTP_REPLY_MAX - 1;
+        memcpy(s->final_text, p->data + sizeof(sack), n);
+        s->final_text[n] = '\0';
+    }
+}
+
+static int usable_paths(struct uftp_sender *s)
+{
+    int n = 0;
+    for (int i = 0; i < UFTP_MAX_PATHS; i++)
+        n += s->paths[i].usable;
+    return n;
+}
+
+/* One more unanswered timeout or probe on a path; returns 1 if it is dead now */
+static int back_off(struct uftp_sender *s, int path)
+{
+    struct uftp_path *pa = &s->paths[path];
+
+    pa->backoffs++;
+    pa->rto_us *= 2;
+    if (pa->rto_us > UFTP_RTO_MAX_US)
+        pa->rto_us = UFTP_RTO_MAX_US;
+
+    if (pa->backoffs > UFTP_MAX_RETRIES)
+    {
+        pa->dead = 1;
+        if (usable_paths(s) > 1)
+            printf("Path %d stopped answering; moving its chunks to the other paths.\n", path);
+        return 1;
+    }
+    if (usable_paths(s) > 1)
+        printf("Retrying sequence no. %u on path %d... Remaining tries (%d/%d)\n", s->base, path, pa->backoffs,
+               UFTP_MAX_RETRIES);
+    else
+        printf("Retrying sequence no. %u... Remaining tries (%d/%d)\n", s->base, pa->backoffs, UFTP_MAX_RETRIES);
+    return 0;
+}
+
+/*
+    Retransmission timeouts, per path: whatever is still unacknowledged on
+    a path that timed out is resent, on another path if one still answers.
+    The transfer fails once every path has given up.
+*/
+void sender_on_timer(struct uftp_sender *s, uint64_t now)
+{
+    if (s->done || s->failed || !s->rto_deadline_us || now < s->rto_deadline_us)
+        return;
+
+    for (int i = 0; i < UFTP_MAX_PATHS; i++)
+    {
+        struct uftp_path *pa = &s->paths[i];
+        if (!pa->usable)
+            continue;
+
+        if (pa->rto_deadline_us && now >= pa->rto_deadline_us)
+        {
+            pa->rto_deadline_us = 0; // re-armed by the retransmissions
+            if (!pa->inflight)
+                continue;
+
+            for (uint32_t seq = s->base; seq != s->next; seq++)
+            {
+                struct uftp_chunk *c = &s->chunks[seq % UFTP_WINDOW];
+                if (c->in_flight && c->path == i && !c->acked)
+                {
+                    c->lost = 1;
+                    s->nlost++;
+                    leave_flight(s, c);
+                }
+            }
+            back_off(s, i);
+            pa->probe_us = now + pa->rto_us;
+        }
+        else if (!schedulable(s, i) && pa->probe_us && now >= pa->probe_us && s->base != s->next)
+        {
+            // the last probe went unanswered too
+            if (!pa->dead)
+                back_off(s, i);
+            pa->probe_due = 1;
+            pa->probe_us = now + (pa->dead ? UFTP_RTO_MAX_US : pa->rto_us);
+        }
+    }
+
+    int alive = 0;
+    for (int i = 0; i < UFTP_MAX_PATHS; i++)
+        alive += s->paths[i].usable && !s->paths[i].dead;
+    if (!alive)
+    {
+        printf("Maximum retries reached for sequence no. %u. Aborting...\n", s->base);
+        s->failed = UFTP_ERR_TIMEOUT;
+        return;
+    }
+    update_deadline(s);
+}
+
+/*------------------------------------ receiver ------------------------------------*/
+
+void receiver_init(struct uftp_receiver *r, int fd, uint32_t session, const char *final_text)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->session = session;
+    r->final_text = final_text;
+    r->last_seq = -1;
+}
+
+static void send_ack(struct uftp_receiver *r, uftp_send_fn send, void *ctx)
+{
+    struct uftp_hdr hdr;
+    uint64_t sack = htobe64(r->sack);
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    fill_hdr(&hdr, UFTP_ACK, r->done ? UFTP_F_LAST : 0, r->path_echo, r->session, r->cum, r->ts_echo);
+    iov[iovcnt++] = (struct iovec){&hdr, sizeof(hdr)};
+    iov[iovcnt++] = (struct iovec){&sack, sizeof(sack)};
+    if (r->done && r->final_text)
+        iov[iovcnt++] = (struct iovec){(void *)r->final_text, strlen(r->final_text)};
+    send(ctx, r->path_echo, iov, iovcnt); // back over the path the newest chunk came in on
+
+    r->pending = 0;
+    r->ack_due_us = 0;
+}
+
+static int write_chunk(int fd, const char *data, int len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Takes a DATA chunk (or the chunk riding on a put's CMD) and acknowledges as needed */
+void receiver_on_data(struct uftp_receiver *r, const struct uftp_pkt *p, uint64_t now,
+                      uftp_send_fn send, void *ctx)
+{
+    if ((p->type != UFTP_DATA && p->type != UFTP_CMD) || r->failed)
+        return;
+
+    uint32_t seq = p->seq;
+    uint32_t off = seq - r->cum;
+    int immediate = 0;
+
+    r->ts_echo = p->ts;
+    r->path_echo = p->path < UFTP_MAX_PATHS ? p->path : 0;
+
+    if ((int32_t)off < 0 || (off > 0 && off <= 64 && (r->sack >> (off - 1)) & 1))
+    {
+        immediate = 1; // duplicate: our ACK was probably lost
+    }
+    else if (off > 64)
+    {
+        return; // beyond anything the bitmap can describe
+    }
+    else
+    {
+        if (write_chunk(r->fd, p->data, p->len, r->base + (off_t)seq * CHUNKSIZE) < 0)
+        {
+            r->failed = UFTP_ERR_IO;
+            return;
+        }
+        r->bytes += p->len;
+        if (p->flags & UFTP_F_LAST)
+            r->last_seq = seq;
+
+        if (off == 0)
+        {
+            uint32_t before = r->cum;
+
+            // slide past every chunk that had already arrived out of order
+            r->cum++;
+            while (r->sack & 1)
+            {
+                r->sack >>= 1;
+                r->cum++;
+            }
+            r->sack >>= 1;
+
+            if (r->cum - before > 1 || r->sack)
+                immediate = 1; // filled a hole, or holes remain
+        }
+        else
+        {
+            r->sack |= 1ULL << (off - 1);
+            immediate = 1; // gap detected
+        }
+    }
+
+    if (r->last_seq >= 0 && r->cum > (uint32_t)r->last_seq)
+    {
+        r->done = 1;
+        immediate = 1;
+    }
+
+    r->pending++;
+    if (immediate || r->pending >= UFTP_ACK_EVERY)
+        send_ack(r, send, ctx);
+    else if (!r->ack_due_us)
+        r->ack_due_us = now + UFTP_ACK_DELAY_US;
+}
+
+/* Flushes a delayed ACK once its deadline has passed */
+void receiver_on_timer(struct uftp_receiver *r, uint64_t now, uftp_send_fn send, void *ctx)
+{
+    if (r->ack_due_us && now >= r->ack_due_us)
+        send_ack(r, send, ctx);
+}
+
+/*------------------------------------ socket drivers ------------------------------------*/
+
+/*
+    Sends one packet, sealed first when the connection has a key. Sealing
+    needs a copy anyway, so the ciphertext is written straight into it.
+*/
+int uftp_sendv(struct uftp_crypto *cr, int sockfd, struct sockaddr_in *peer, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    char sealed[UFTP_MAX_PACKET];
+    struct iovec one;
+
+    if (cr)
+    {
+        int n = crypto_seal(cr, iov, iovcnt, sealed);
+        if (n < 0)
+            return -1;
+        one = (struct iovec){sealed, n};
+        iov = &one;
+        iovcnt = 1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = peer;
+    msg.msg_namelen = sizeof(*peer);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    return sendmsg(sockfd, &msg, 0);
+}
+
+/* uftp_send_fn for the client: each path has its own socket */
+int uftp_conn_send(void *ctx, int path, struct iovec *iov, int iovcnt)
+{
+    struct uftp_conn *c = ctx;
+
+    if (path < 0 || path >= c->npaths)
+        path = 0;
+    return uftp_sendv(c->crypto, c->paths[path].sockfd, &c->paths[path].peer, iov, iovcnt);
+}
+
+static int send_text(uftp_send_fn send, void *ctx, int path, int type, uint32_t session, const char *text)
+{
+    struct uftp_hdr hdr;
+
+    fill_hdr(&hdr, type, 0, path, session, 0, uftp_now_us());
+
+    // a CMD keeps its terminating NUL so the server can find where the command ends
+    struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {(void *)text, strlen(text) + (type == UFTP_CMD)}};
+    return send(ctx, path, iov, 2);
+}
+
+/* Sends a FAIL, REPLY or text-only CMD packet through send on path 0 */
+int uftp_send_text(uftp_send_fn send, void *ctx, int type, uint32_t session, const char *text)
+{
+    return send_text(send, ctx, 0, type, session, text);
+}
+
+/* Sends a text-only packet on one of the connection's paths */
+int uftp_conn_send_text(struct uftp_conn *c, int path, int type, uint32_t session, const char *text)
+{
+    return send_text(uftp_conn_send, c, path, type, session, text);
+}
+
+static int wait_readable(struct uftp_conn *c, uint64_t timeout_us)
+{
+    struct pollfd pfd[UFTP_MAX_PATHS];
+
+    for (int i = 0; i < c->npaths; i++)
+        pfd[i] = (struct pollfd){c->paths[i].sockfd, POLLIN, 0};
+    return poll(pfd, c->npaths, (timeout_us + 999) / 1000);
+}
+
+/*
+    Non-blocking receive of the next packet from the server, on any path.
+    Returns 1 for a packet of `session`, 0 for anything else (which is dealt
+    with here), and -1 once every socket is drained.
+*/
+static int next_packet(struct uftp_conn *c, uint32_t session, char *buf, int size, struct uftp_pkt *p)
+{
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    int n = -1, path;
+
+    for (path = 0; path < c->npaths; path++)
+    {
+        n = recvfrom(c->paths[path].sockfd, buf, size, MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+        if (n >= 0)
+            break;
+    }
+    if (n < 0)
+        return -1;
+
+    struct sockaddr_in *peer = &c->paths[path].peer;
+    if (from.sin_addr.s_addr != peer->sin_addr.s_addr || from.sin_port != peer->sin_port)
+        return 0;
+    if ((n = crypto_unseal(c->crypto, buf, n)) < 0 || uftp_parse(buf, n, p) < 0)
+        return 0;
+    if (p->session == session)
+        return 1;
+
+    // the server is still retransmitting the end of our last download: it missed our final ACK
+    if (p->type == UFTP_DATA && c->last_rx.done && p->session == c->last_rx.session)
+        receiver_on_data(&c->last_rx, p, uftp_now_us(), uftp_conn_send, c);
+    return 0;
+}
+
+static void copy_text(const struct uftp_pkt *p, char *text, int textlen)
+{
+    int n = p->len;
+    if (!text || textlen <= 0)
+        return;
+    if (n >= textlen)
+        n = textlen - 1;
+    memcpy(text, p->data, n);
+    text[n] = '\0';
+}
+
+/*
+    Sends a command that moves no file data (delete, exit) and waits for the
+    server's REPLY, retransmitting the command until one arrives. Each
+    retransmission goes out on the next path, so one dead path cannot stall it.
+    Returns UFTP_OK, UFTP_ERR_ABORTED (reply holds the reason) or UFTP_ERR_TIMEOUT.
+*/
+int uftp_request(struct uftp_conn *c, const char *cmd, char *reply, int replylen)
+{
+    uint32_t session = uftp_new_session();
+    uint64_t rto = UFTP_RTO_INIT_US;
+    uint64_t deadline = uftp_now_us() + rto;
+    char buf[UFTP_MAX_PACKET];
+    struct uftp_pkt p;
+    int tries = 0;
+
+    uftp_conn_send_text(c, 0, UFTP_CMD, session, cmd);
+
+    while (1)
+    {
+        uint64_t now = uftp_now_us();
+        if (wait_readable(c, deadline > now ? deadline - now : 0) > 0)
+        {
+            int got;
+            while ((got = next_packet(c, session, buf, sizeof(buf), &p)) >= 0)
+            {
+                if (got && p.type == UFTP_REPLY)
+                {
+                    copy_text(&p, reply, replylen);
+                    return UFTP_OK;
+                }
+                if (got && p.type == UFTP_FAIL)
+                {
+                    copy_text(&p, reply, replylen);
+                    return UFTP_ERR_ABORTED;
+                }
+            }
+        }
+
+        if (uftp_now_us() >= deadline)
+        {
+            if (++tries > UFTP_MAX_RETRIES)
+                return UFTP_ERR_TIMEOUT;
+            printf("Retrying command... Remaining tries (%d/%d)\n", tries, UFTP_MAX_RETRIES);
+            uftp_conn_send_text(c, tries % c->npaths, UFTP_CMD, session, cmd);
+            rto = rto * 2 > UFTP_RTO_MAX_US ? UFTP_RTO_MAX_US : rto * 2;
+            deadline = uftp_now_us() + rto;
+        }
+    }
+}
+
+/* Tells the server about the end of a session on every path, so a dead one cannot swallow it */
+static void conn_send_fail(struct uftp_conn *c, uint32_t session, const char *why)
+{
+    for (int i = 0; i < c->npaths; i++)
+        uftp_conn_send_text(c, i, UFTP_FAIL, session, why);
+}
+
+/*
+    Opens a session with cmd (e.g. "put abc.txt") and sends everything the
+    reader produces over all of the connection's paths, the first chunk
+    riding on the command itself. Waits until all of it is acknowledged;
+    the server's closing text (or its reason for aborting) ends up in reply.
+    Returns UFTP_OK or one of the UFTP_ERR_ codes.
+*/
+int uftp_send_stream(struct uftp_conn *c, const char *cmd, struct readahead *ra, char *reply, int replylen)
+{
+    struct uftp_sender s;
+    char buf[UFTP_MAX_PACKET];
+    struct uftp_pkt p;
+
+    sender_init(&s, ra, uftp_new_session(), cmd);
+    for (int i = 0; i < c->npaths; i++)
+        sender_add_path(&s, i);
+
+    while (!s.done && !s.failed)
+    {
+        uint64_t now = uftp_now_us();
+        sender_pump(&s, now, uftp_conn_send, c);
+        if (s.done || s.failed)
+            break;
+
+        // wake up for the retransmission timer, or soon if the reader is behind
+        uint64_t wait = 1000;
+        if (s.rto_deadline_us)
+            wait = s.rto_deadline_us > now ? s.rto_deadline_us - now : 0;
+
+        if (wait_readable(c, wait) > 0)
+        {
+            int got;
+            while ((got = next_packet(c, s.session, buf, sizeof(buf), &p)) >= 0)
+            {
+                if (!got)
+                    continue;
+                if (p.type == UFTP_ACK)
+                {
+                    sender_on_ack(&s, &p, uftp_now_us());
+                }
+                else if (p.type == UFTP_FAIL)
+                {
+                    copy_text(&p, reply, replylen);
+                    s.failed = UFTP_ERR_ABORTED;
+                    break;
+                }
+            }
+        }
+
+        sender_on_timer(&s, uftp_now_us());
+    }
+
+    if (s.failed == UFTP_ERR_IO)
+        conn_send_fail(c, s.session, "Error reading file on the sending side.");
+    else if (s.failed == UFTP_ERR_TIMEOUT)
+        conn_send_fail(c, s.session, "Sender gave up after maximum retries.");
+
+    if (s.done && reply && replylen > 0)
+        snprintf(reply, replylen, "%s", s.final_text);
+
+    return s.done ? UFTP_OK : s.failed;
+}
+
+/* The command of a download goes out on every path, which is how the server learns them */
+static void send_cmd_all(struct uftp_conn *c, uint32_t session, const char *cmd)
+{
+    for (int i = 0; i < c->npaths; i++)
+        uftp_conn_send_text(c, i, UFTP_CMD, session, cmd);
+}
+
+/*
+    Opens a session with cmd (e.g. "get abc.txt") and receives the stream the
+    server answers with into fd. The command is retransmitted until the first
+    chunk arrives. On UFTP_ERR_ABORTED the server's reason is copied into
+    reason. Returns UFTP_OK or one of the UFTP_ERR_ codes.
+*/
+int uftp_recv_stream(struct uftp_conn *c, const char *cmd, int fd, char *reason, int reasonlen)
+{
+    return uftp_recv_range(c, cmd, fd, 0, reason, reasonlen);
+}
+
+/* Like uftp_recv_stream, but writes the stream into fd from offset `base` on (for "get -r") */
+int uftp_recv_range(struct uftp_conn *c, const char *cmd, int fd, off_t base, char *reason, int reasonlen)
+{
+    struct uftp_receiver r;
+    char buf[UFTP_MAX_PACKET];
+    struct uftp_pkt p;
+    int started = 0, idle = 0, tries = 0;
+    uint64_t rto = UFTP_RTO_INIT_US;
+    uint64_t cmd_deadline = uftp_now_us() + rto;
+
+    receiver_init(&r, fd, uftp_new_session(), NULL);
+    r.base = base;
+    send_cmd_all(c, r.session, cmd);
+
+    while (!r.done && !r.failed)
+    {
+        uint64_t now = uftp_now_us();
+        uint64_t wait = UFTP_RTO_MAX_US;
+        if (!started)
+            wait = cmd_deadline > now ? cmd_deadline - now : 0;
+        else if (r.ack_due_us)
+            wait = r.ack_due_us > now ? r.ack_due_us - now : 0;
+
+        if (wait_readable(c, wait) > 0)
+        {
+            int got;
+            while ((got = next_packet(c, r.session, buf, sizeof(buf), &p)) >= 0)
+            {
+                if (!got)
+                    continue;
+                started = 1; // anything from our session acknowledges the command
+                idle = 0;
+                if (p.type == UFTP_DATA)
+                {
+                    receiver_on_data(&r, &p, uftp_now_us(), uftp_conn_send, c);
+                }
+                else if (p.type == UFTP_FAIL)
+                {
+                    copy_text(&p, reason, reasonlen);
+                    r.failed = UFTP_ERR_ABORTED;
+                    break;
+                }
+            }
+        }
+        else if (started && !r.ack_due_us && ++idle >= UFTP_MAX_RETRIES)
+        {
+            r.failed = UFTP_ERR_TIMEOUT;
+        }
+
+        if (!started && uftp_now_us() >= cmd_deadline)
+        {
+            if (++tries > UFTP_MAX_RETRIES)
+            {
+                r.failed = UFTP_ERR_TIMEOUT;
+                break;
+            }
+            printf("Retrying command... Remaining tries (%d/%d)\n", tries, UFTP_MAX_RETRIES);
+            send_cmd_all(c, r.session, cmd);
+            rto = rto * 2 > UFTP_RTO_MAX_US ? UFTP_RTO_MAX_US : rto * 2;
+            cmd_deadline = uftp_now_us() + rto;
+        }
+
+        receiver_on_timer(&r, uftp_now_us(), uftp_conn_send, c);
+    }
+
+    if (r.failed == UFTP_ERR_IO)
+        conn_send_fail(c, r.session, "Error writing file on the receiving side.");
+    if (!r.done)
+        return r.failed;
+
+    // keep the final ACK state around in case the server retransmits the last chunk
+    c->last_rx = r;
+    c->last_rx.fd = -1;
+    return UFTP_OK;
+}
@@ -0,0 +1,205 @@
+/*
+ * uftp_proto.h - wire format and reliable chunk stream shared by the
+ * client and server
+ *
+ * Every operation is a session identified by a random 32-bit id chosen by
+ * the client. It starts with a CMD packet that is retransmitted until the
+ * server answers: a `put` carries the first chunk of the file in the CMD
+ * itself, and the first DATA chunk of a `get` doubles as the CMD's
+ * acknowledgement, so small files complete in a single round trip.
+ *
+ * A file travels as a stream of numbered DATA chunks. The receiver answers
+ * with ACKs carrying the cumulative sequence (next chunk it expects) plus a
+ * 64-bit selective-ACK bitmap of the chunks it already holds past that
+ * point, so the sender only retransmits what is actually missing.
+ *
+ * A transfer may spread over several paths (e.g. one socket per local
+ * uplink). Every DATA packet names the path it was sent on and every ACK
+ * echoes the path of the packet it answers, so the sender keeps RTT, RTO
+ * and delivery rate per path and schedules each chunk on the path expected
+ * to deliver it first. A path that stops answering is declared dead and its
+ * chunks move to the others.
+ */
+#ifndef UFTP_PROTO_H
+#define UFTP_PROTO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "uftp_readahead.h"
+#include "uftp_crypto.h"
+
+/* packet types */
+#define UFTP_DATA 1
+#define UFTP_ACK 2
+#define UFTP_FAIL 3  /* transfer aborted, payload is a reason string */
+#define UFTP_CMD 4   /* opens a session: command text, NUL, then (put) chunk 0 */
+#define UFTP_REPLY 5 /* text answer to a command that moves no file data */
+
+/* packet flags */
+#define UFTP_F_LAST 0x01   /* DATA/CMD: final chunk of the file, ACK: stream complete */
+#define UFTP_F_SEALED 0x02 /* payload encrypted, see uftp_crypto.h */
+
+#define UFTP_WINDOW 64          /* chunks in flight; the SACK bitmap covers this many */
+#define UFTP_ACK_EVERY 8        /* in-order chunks coalesced into one ACK */
+#define UFTP_ACK_DELAY_US 1000  /* longest an ACK is held back */
+#define UFTP_RTO_INIT_US 250000 /* also paces CMD retransmissions */
+#define UFTP_RTO_MIN_US 50000
+#define UFTP_RTO_MAX_US 2000000 /* the old fixed 2 second timeout is now the ceiling */
+#define UFTP_MAX_RETRIES 5      /* consecutive timeouts before giving up */
+#define UFTP_SESSION_TTL_US 10000000 /* finished sessions still answer retransmissions */
+#define UFTP_SOCKBUF (4 << 20)  /* socket buffers sized for a full window */
+#define UFTP_MAX_PATHS 8        /* paths one transfer can use */
+
+#define UFTP_CMD_MAX 4352   /* command text: op plus a path of up to PATH_MAX */
+#define UFTP_REPLY_MAX 1024 /* text carried by REPLY, FAIL and the final ACK */
+
+/* result codes of the stream drivers */
+#define UFTP_OK 0
+#define UFTP_ERR_TIMEOUT -1 /* peer stopped responding */
+#define UFTP_ERR_ABORTED -2 /* peer sent FAIL */
+#define UFTP_ERR_IO -3      /* local read/write failed */
+
+struct uftp_hdr
+{
+    uint8_t type;
+    uint8_t flags;
+    uint16_t path; /* DATA/CMD: path it was sent on, ACK: path of the packet it answers */
+    uint32_t session;
+    uint32_t seq; /* DATA/CMD: chunk number, ACK: cumulative (next expected) */
+    uint32_t ts;  /* DATA/CMD: send time in us, ACK: echo of the newest DATA ts */
+} __attribute__((packed));
+
+#define UFTP_MAX_PACKET (sizeof(struct uftp_hdr) + UFTP_CMD_MAX + CHUNKSIZE + UFTP_SEAL_OVERHEAD)
+
+/* a received packet with its header in host order */
+struct uftp_pkt
+{
+    int type;
+    int flags;
+    int path;
+    uint32_t session;
+    uint32_t seq;
+    uint32_t ts;
+    const char *cmd;  /* CMD only: NUL-terminated command text */
+    const char *data; /* payload (for CMD: whatever follows the command) */
+    int len;
+};
+
+/* transmits one packet assembled from iov on the given path; returns bytes sent or -1 */
+typedef int (*uftp_send_fn)(void *ctx, int path, struct iovec *iov, int iovcnt);
+
+struct uftp_chunk
+{
+    char *data;
+    int len;
+    int last;
+    uint64_t sent_us; /* time of the latest (re)transmission */
+    int path;         /* path of the latest (re)transmission */
+    int in_flight;    /* counted in that path's inflight */
+    int acked;        /* covered by a SACK bit */
+    int lost;         /* due for retransmission */
+};
+
+/* what the sender knows about one path */
+struct uftp_path
+{
+    int usable; /* the sender may use it (on the server: the client has shown it) */
+    int dead;   /* stopped answering; only probed now and then */
+    uint64_t srtt_us, rttvar_us, rto_us;
+    uint64_t rto_deadline_us; /* 0 while nothing is in flight on this path */
+    int backoffs;
+    int inflight;
+    uint64_t rack_us;       /* send time of the newest chunk known delivered over it */
+    uint64_t rate;          /* delivery rate in bytes/s, 0 until measured */
+    uint64_t rate_bytes;    /* delivered since rate_start_us */
+    uint64_t rate_start_us;
+    uint64_t probe_us; /* path taken off the schedule: when to probe it next */
+    int probe_due;     /* send it a probe on the next pump */
+};
+
+struct uftp_sender
+{
+    struct readahead *ra;
+    uint32_t session;
+    const char *cmd; /* if set, chunk 0 goes out as a CMD carrying this text */
+    uint32_t base;   /* oldest chunk not cumulatively acked */
+    uint32_t next;   /* next new chunk to send */
+    int window;
+    int eof;          /* every chunk has been taken from the reader */
+    int nlost;        /* chunks marked lost (an upper bound), so pumps skip the scan when there are none */
+    int64_t last_seq; /* -1 until the final chunk is known */
+    struct uftp_chunk chunks[UFTP_WINDOW];
+
+    struct uftp_path paths[UFTP_MAX_PATHS];
+    uint64_t rto_deadline_us; /* earliest timer of any path, 0 if none is armed */
+
+    int done;
+    int failed; /* one of the UFTP_ERR_ codes */
+    long retransmits;
+    char final_text[UFTP_REPLY_MAX]; /* text the receiver attached to its final ACK */
+};
+
+struct uftp_receiver
+{
+    int fd;
+    off_t base; /* file offset chunk 0 is written at (a ranged get), 0 by default */
+    uint32_t session;
+    const char *final_text; /* attached to the ACK that completes the stream */
+    uint32_t cum;           /* next chunk expected in order */
+    uint64_t sack;          /* bit i set: chunk cum+1+i already written */
+    int64_t last_seq;
+    int pending;         /* chunks received since the last ACK */
+    uint64_t ack_due_us; /* deadline of a delayed ACK, 0 if none */
+    uint32_t ts_echo;
+    int path_echo; /* path of the newest chunk, the one the next ACK answers */
+    off_t bytes;
+    int done;
+    int failed;
+};
+
+/* one way of reaching the server: a socket (bound to some local address) and where it sends */
+struct uftp_conn_path
+{
+    int sockfd;
+    struct sockaddr_in peer;
+};
+
+/* client side of the conversation with one server */
+struct uftp_conn
+{
+    int npaths;
+    struct uftp_conn_path paths[UFTP_MAX_PATHS]; /* paths[0] also carries text-only requests */
+    struct uftp_receiver last_rx;                /* finished download, re-ACKed if the server missed its final ACK */
+    struct uftp_crypto *crypto;                  /* NULL: packets travel in the clear */
+};
+
+uint64_t uftp_now_us(void);
+void uftp_set_buffers(int sockfd);
+uint32_t uftp_new_session(void);
+int uftp_parse(const char *buf, int len, struct uftp_pkt *p);
+int uftp_sendv(struct uftp_crypto *cr, int sockfd, struct sockaddr_in *peer, struct iovec *iov, int iovcnt);
+int uftp_send_text(uftp_send_fn send, void *ctx, int type, uint32_t session, const char *text);
+int uftp_conn_send(void *ctx, int path, struct iovec *iov, int iovcnt);
+int uftp_conn_send_text(struct uftp_conn *c, int path, int type, uint32_t session, const char *text);
+
+void sender_init(struct uftp_sender *s, struct readahead *ra, uint32_t session, const char *cmd);
+void sender_add_path(struct uftp_sender *s, int path);
+int sender_pump(struct uftp_sender *s, uint64_t now, uftp_send_fn send, void *ctx);
+int sender_pump_max(struct uftp_sender *s, uint64_t now, int max, uftp_send_fn send, void *ctx);
+void sender_on_ack(struct uftp_sender *s, const struct uftp_pkt *p, uint64_t now);
+void sender_on_timer(struct uftp_sender *s, uint64_t now);
+
+void receiver_init(struct uftp_receiver *r, int fd, uint32_t session, const char *final_text);
+void receiver_on_data(struct uftp_receiver *r, const struct uftp_pkt *p, uint64_t now,
+                      uftp_send_fn send, void *ctx);
+void receiver_on_timer(struct uftp_receiver *r, uint64_t now, uftp_send_fn send, void *ctx);
+
+int uftp_request(struct uftp_conn *c, const char *cmd, char *reply, int replylen);
+int uftp_send_stream(struct uftp_conn *c, const char *cmd, struct readahead *ra, char *reply, int replylen);
+int uftp_recv_stream(struct uftp_conn *c, const char *cmd, int fd, char *reason, int reasonlen);
+int uftp_recv_range(struct uftp_conn *c, const char *cmd, int fd, off_t base, char *reason, int reasonlen);
+
+#endif
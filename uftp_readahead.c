@@ -0,0 +1,420 @@
+/*
+ * uftp_readahead.c - prefetching file reader shared by the client and server
+ *
+ * The reader thread keeps up to `depth` chunks filled ahead of the sender.
+ * Buffered reads tell the kernel the access pattern up front
+ * (posix_fadvise SEQUENTIAL) and keep a readahead() window in front of the
+ * reader. With O_DIRECT the page cache is bypassed entirely: the file is
+ * read in aligned RA_DIRECT_BLOCK pieces and copied out into the slots.
+ * A callback source is simply read in order.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "uftp_readahead.h"
+
+/* Reads `want` bytes at ra->offset straight from the file */
+static int fill_buffered(struct readahead *ra, char *dst, int want)
+{
+    int got = 0;
+
+    /* keep the kernel's readahead one ring-length in front of us */
+    off_t window = (off_t)ra->depth * CHUNKSIZE;
+    if (ra->offset + window / 2 >= ra->hint_offset)
+    {
+        readahead(ra->fd, ra->hint_offset, window);
+        ra->hint_offset += window;
+    }
+
+    while (got < want)
+    {
+        ssize_t n = pread(ra->fd, dst + got, want - got, ra->offset + got);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/* Reads `want` bytes from the callback source, which has no notion of offsets */
+static int fill_source(struct readahead *ra, char *dst, int want)
+{
+    int got = 0;
+
+    while (got < want)
+    {
+        int n = ra->source(ra->source_ctx, dst + got, want - got);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/* Reads `want` bytes at ra->offset through the aligned O_DIRECT staging buffer */
+static int fill_direct(struct readahead *ra, char *dst, int want)
+{
+    int got = 0;
+
+    while (got < want)
+    {
+        if (ra->stage_pos == ra->stage_len)
+        {
+            /* every block but the last is full, so this offset stays aligned */
+            ssize_t n = pread(ra->fd, ra->stage, RA_DIRECT_BLOCK, ra->offset + got);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (n == 0)
+                break;
+            ra->stage_len = n;
+            ra->stage_pos = 0;
+        }
+
+        size_t take = ra->stage_len - ra->stage_pos;
+        if (take > (size_t)(want - got))
+            take = want - got;
+        memcpy(dst + got, ra->stage + ra->stage_pos, take);
+        ra->stage_pos += take;
+        got += take;
+    }
+    return got;
+}
+
+static int fill(struct readahead *ra, char *dst, int want)
+{
+    if (ra->source)
+        return fill_source(ra, dst, want);
+    return ra->direct ? fill_direct(ra, dst, want) : fill_buffered(ra, dst, want);
+}
+
+static void *reader_thread(void *arg)
+{
+    struct readahead *ra = arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&ra->lock);
+        while (!ra->stop && ra->produced - ra->released >= ra->depth)
+            pthread_cond_wait(&ra->cond_space, &ra->lock);
+        if (ra->stop)
+        {
+            pthread_mutex_unlock(&ra->lock);
+            break;
+        }
+        pthread_mutex_unlock(&ra->lock);
+
+        /* the slot is ours until `produced` is bumped below */
+        struct ra_slot *slot = &ra->slots[ra->produced % ra->depth];
+
+        off_t remaining = ra->size - ra->offset;
+        int want = remaining < CHUNKSIZE ? (int)remaining : CHUNKSIZE;
+        int got = fill(ra, slot->data, want);
+
+        pthread_mutex_lock(&ra->lock);
+        if (got < 0)
+        {
+            ra->err = errno;
+            ra->done = 1;
+            pthread_cond_broadcast(&ra->cond_data);
+            pthread_mutex_unlock(&ra->lock);
+            break;
+        }
+
+        ra->offset += got;
+        slot->len = got;
+        /* a short read means the file shrank under us; stop there */
+        slot->last = (ra->offset >= ra->size || got < want);
+        ra->produced++;
+        if (slot->last)
+            ra->done = 1;
+        pthread_cond_broadcast(&ra->cond_data);
+        pthread_mutex_unlock(&ra->lock);
+
+        if (slot->last)
+            break;
+    }
+    return NULL;
+}
+
+/* Sets up the ring for bytes start..end of fd (or source) and starts the reader; NULL (errno set) on failure */
+static struct readahead *ra_start(int fd, off_t start, off_t end, int depth, int direct, ra_read_fn source,
+                                  void (*source_close)(void *ctx), void *ctx)
+{
+    if (depth < 2 || end - start <= CHUNKSIZE)
+        depth = 2; /* a single-chunk file never needs more than one slot */
+
+    struct readahead *ra = calloc(1, sizeof(*ra));
+    if (!ra)
+        return NULL;
+    ra->fd = fd;
+    ra->depth = depth;
+    ra->direct = direct;
+    ra->start = ra->offset = ra->hint_offset = start;
+    ra->size = end;
+    ra->source = source;
+    ra->source_close = source_close;
+    ra->source_ctx = ctx;
+    ra->slots = calloc(depth, sizeof(*ra->slots));
+
+    char *pool = malloc((size_t)depth * CHUNKSIZE);
+    if (!ra->slots || !pool)
+    {
+        free(pool);
+        free(ra->slots);
+        free(ra);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (int i = 0; i < depth; i++)
+        ra->slots[i].data = pool + (size_t)i * CHUNKSIZE;
+
+    if (direct)
+    {
+        if (posix_memalign((void **)&ra->stage, RA_DIRECT_ALIGN, RA_DIRECT_BLOCK) != 0)
+        {
+            free(pool);
+            free(ra->slots);
+            free(ra);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    else if (fd >= 0)
+    {
+        posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+    }
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond_data, NULL);
+    pthread_cond_init(&ra->cond_space, NULL);
+
+    if (end == start)
+    {
+        ra->done = 1; /* nothing to read, don't bother with a thread */
+    }
+    else if (end - start <= CHUNKSIZE)
+    {
+        /*
+         * a single chunk is read right here: handing it to a thread would only
+         * add a wakeup to the latency of small request/response transfers
+         */
+        struct ra_slot *slot = &ra->slots[0];
+        int got = fill(ra, slot->data, end - start);
+        if (got < 0)
+        {
+            ra->err = errno;
+        }
+        else
+        {
+            ra->offset += got;
+            slot->len = got;
+            slot->last = 1;
+            ra->produced = 1;
+        }
+        ra->done = 1;
+    }
+    else
+    {
+        int err = pthread_create(&ra->thread, NULL, reader_thread, ra);
+        if (err != 0)
+        {
+            // the caller closes fd or the source, as for the failures above
+            pthread_mutex_destroy(&ra->lock);
+            pthread_cond_destroy(&ra->cond_data);
+            pthread_cond_destroy(&ra->cond_space);
+            free(ra->stage);
+            free(pool);
+            free(ra->slots);
+            free(ra);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    return ra;
+}
+
+/*
+    Opens filename and starts prefetching it into a ring of `depth` chunks.
+    Returns NULL (with errno set) if the file cannot be read.
+*/
+struct readahead *ra_open(const char *filename, int depth, int direct)
+{
+    return ra_open_range(filename, 0, -1, depth, direct);
+}
+
+/*
+    Like ra_open, but streams only `length` bytes from `offset` on (up to
+    the end of the file; a negative length means all of it). An offset past
+    the end fails with ERANGE.
+*/
+struct readahead *ra_open_range(const char *filename, off_t offset, off_t length, int depth, int direct)
+{
+    int fd = -1;
+
+    // O_DIRECT reads whole aligned blocks from where the range starts
+    if (direct && offset % RA_DIRECT_ALIGN)
+        direct = 0;
+    if (direct)
+    {
+        fd = open(filename, O_RDONLY | O_DIRECT);
+        if (fd < 0 && errno == EINVAL)
+        {
+            printf("O_DIRECT not supported for %s, using buffered reads.\n", filename);
+            direct = 0;
+        }
+    }
+    if (fd < 0)
+        fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        close(fd);
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        return NULL;
+    }
+    if (offset < 0 || offset > st.st_size)
+    {
+        close(fd);
+        errno = ERANGE;
+        return NULL;
+    }
+
+    off_t end = length < 0 || length > st.st_size - offset ? st.st_size : offset + length;
+    struct readahead *ra = ra_start(fd, offset, end, depth, direct, NULL, NULL, NULL);
+    if (!ra)
+        close(fd);
+    return ra;
+}
+
+/*
+    Like ra_open, but the `size` bytes come from calling source, which the
+    reader thread does in order. source_close (if set) is called on ctx
+    when the reader is closed, or right away if it cannot be opened.
+*/
+struct readahead *ra_open_source(off_t size, int depth, ra_read_fn source,
+                                 void (*source_close)(void *ctx), void *ctx)
+{
+    struct readahead *ra = ra_start(-1, 0, size, depth, 0, source, source_close, ctx);
+
+    if (!ra && source_close)
+        source_close(ctx);
+    return ra;
+}
+
+static int ra_get(struct readahead *ra, char **data, int *last, int wait)
+{
+    int n;
+
+    pthread_mutex_lock(&ra->lock);
+    while (wait && ra->consumed == ra->produced && !ra->done)
+        pthread_cond_wait(&ra->cond_data, &ra->lock);
+
+    if (ra->consumed < ra->produced)
+    {
+        struct ra_slot *slot = &ra->slots[ra->consumed % ra->depth];
+        *data = slot->data;
+        if (last)
+            *last = slot->last;
+        n = slot->len;
+        ra->consumed++;
+    }
+    else if (ra->err)
+    {
+        errno = ra->err;
+        n = -1;
+    }
+    else if (!ra->done)
+    {
+        errno = EAGAIN;
+        n = -1;
+    }
+    else
+    {
+        n = 0;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return n;
+}
+
+/*
+    Hands out the next chunk in file order, waiting for the reader if needed.
+    Returns the chunk length, 0 once the whole file has been handed out,
+    or -1 (with errno set) if reading failed.
+    The chunk stays valid until it is given back with ra_release.
+*/
+int ra_next(struct readahead *ra, char **data, int *last)
+{
+    return ra_get(ra, data, last, 1);
+}
+
+/* Like ra_next, but fails with EAGAIN instead of waiting for the reader */
+int ra_try_next(struct readahead *ra, char **data, int *last)
+{
+    return ra_get(ra, data, last, 0);
+}
+
+/* Gives the oldest `count` handed-out chunks back to the reader */
+void ra_release(struct readahead *ra, int count)
+{
+    pthread_mutex_lock(&ra->lock);
+    ra->released += count;
+    if (ra->released > ra->consumed)
+        ra->released = ra->consumed;
+    pthread_cond_signal(&ra->cond_space);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void ra_close(struct readahead *ra)
+{
+    if (!ra)
+        return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->cond_space);
+    pthread_mutex_unlock(&ra->lock);
+
+    if (ra->size - ra->start > CHUNKSIZE)
+        pthread_join(ra->thread, NULL);
+
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->cond_data);
+    pthread_cond_destroy(&ra->cond_space);
+
+    free(ra->slots[0].data);
+    free(ra->slots);
+    free(ra->stage);
+    if (ra->fd >= 0)
+        close(ra->fd);
+    if (ra->source_close)
+        ra->source_close(ra->source_ctx);
+    free(ra);
+}
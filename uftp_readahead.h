@@ -0,0 +1,74 @@
+/*
+ * uftp_readahead.h - prefetching file reader shared by the client and server
+ *
+ * A background thread reads the file into a ring of CHUNKSIZE slots so the
+ * send loop never waits on the disk while the network is idle. Instead of
+ * a file, the ring can also be fed from a callback (ra_open_source), e.g.
+ * to stream a file reassembled from deduplicated chunks.
+ */
+#ifndef UFTP_READAHEAD_H
+#define UFTP_READAHEAD_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#ifndef CHUNKSIZE
+#define CHUNKSIZE 16000
+#endif
+
+#define RA_DEFAULT_DEPTH 128       /* chunks in the ring: sender window plus prefetch */
+#define RA_DIRECT_ALIGN 4096       /* O_DIRECT buffer/offset alignment */
+#define RA_DIRECT_BLOCK (1 << 20)  /* size of one O_DIRECT read */
+
+/* fills buf with the next `want` bytes; returns how many, 0 at the end, -1 (errno set) on error */
+typedef int (*ra_read_fn)(void *ctx, char *buf, int want);
+
+struct ra_slot
+{
+    char *data;
+    int len;
+    int last; /* set on the final chunk of the file */
+};
+
+struct readahead
+{
+    int fd;     /* -1 when reading from a callback */
+    ra_read_fn source;
+    void (*source_close)(void *ctx);
+    void *source_ctx;
+    int depth;  /* number of slots in the ring */
+    int direct; /* file was opened with O_DIRECT */
+    off_t start; /* where reading began: 0, or the start of a range */
+    off_t size;  /* where it stops: the file size when it was opened, or the end of the range */
+    off_t offset;
+    off_t hint_offset; /* how far readahead() has been asked to go */
+
+    struct ra_slot *slots;
+    long produced; /* chunks filled by the reader thread */
+    long consumed; /* chunks handed out by ra_next */
+    long released; /* chunks given back by ra_release */
+    int done;      /* reader thread reached the end of the file */
+    int err;       /* errno of a failed read, 0 otherwise */
+    int stop;
+
+    /* O_DIRECT: one aligned RA_DIRECT_BLOCK read from the file, copied out into the slots */
+    char *stage;
+    size_t stage_len; /* bytes the last read put in it */
+    size_t stage_pos; /* bytes of those already copied out */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond_data;
+    pthread_cond_t cond_space;
+    pthread_t thread;
+};
+
+struct readahead *ra_open(const char *filename, int depth, int direct);
+struct readahead *ra_open_range(const char *filename, off_t offset, off_t length, int depth, int direct);
+struct readahead *ra_open_source(off_t size, int depth, ra_read_fn source,
+                                 void (*source_close)(void *ctx), void *ctx);
+int ra_next(struct readahead *ra, char **data, int *last);
+int ra_try_next(struct readahead *ra, char **data, int *last);
+void ra_release(struct readahead *ra, int count);
+void ra_close(struct readahead *ra);
+
+#endif
@@ -0,0 +1,242 @@
+/*
+ * uftp_relay.c - impairment relay for trying out multipath transfers
+ * usage: uftp_relay [-l loss_percent] [-d delay_ms] [-b mbit_per_s] [-k kill_after_s]
+ *                   <listen_port> <server_host> <server_port>
+ *
+ * Forwards datagrams between clients and a server, optionally dropping a
+ * share of them, delaying them, limiting the bandwidth in each direction,
+ * or going silent altogether some seconds after the first packet (a link
+ * that dies mid-transfer). Each client
+ * address gets its own upstream socket, so the server sees one address per
+ * relayed path. Run one relay per path and point the client's -m entries
+ * at them, e.g.
+ *
+ *     uftp_relay -d 5 -b 100 9001 127.0.0.1 9000 &
+ *     uftp_relay -d 20 -b 50 -k 2 9002 127.0.0.1 9000 &
+ *     uftp_client -m 127.0.0.2@127.0.0.1:9001,127.0.0.3@127.0.0.1:9002 127.0.0.1 9000
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "uftp_proto.h"
+
+#define RELAY_MAX_CLIENTS 64
+
+/* a datagram waiting out its delay */
+struct held
+{
+    uint64_t due_us;
+    int sockfd;
+    struct sockaddr_in to;
+    int len;
+    struct held *next;
+    char data[];
+};
+
+struct client
+{
+    struct sockaddr_in addr;
+    int sockfd; /* upstream socket towards the server */
+};
+
+int loss_percent = 0;
+uint64_t delay_us = 0;
+uint64_t bits_per_s = 0;    /* 0: unlimited */
+uint64_t kill_after_us = 0; /* 0: never */
+uint64_t first_packet_us = 0;
+
+/* one link per direction (0: to the server, 1: to a client) */
+uint64_t link_free_us[2]; /* when the link has sent everything queued on it */
+struct held *queue_head[2], *queue_tail[2];
+
+void error(char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+static void send_now(int sockfd, struct sockaddr_in *to, const char *data, int len)
+{
+    sendto(sockfd, data, len, 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+/* Drops, delays or forwards one datagram in direction dir according to the impairments */
+static void relay(int dir, int sockfd, struct sockaddr_in *to, const char *data, int len)
+{
+    uint64_t now = uftp_now_us();
+
+    if (!first_packet_us)
+        first_packet_us = now;
+    if (kill_after_us && now - first_packet_us >= kill_after_us)
+        return;
+    if (loss_percent && rand() % 100 < loss_percent)
+        return;
+
+    if (!delay_us && !bits_per_s)
+    {
+        send_now(sockfd, to, data, len);
+        return;
+    }
+
+    // the packet leaves once the link has sent what is ahead of it
+    uint64_t due = now;
+    if (bits_per_s)
+    {
+        if (link_free_us[dir] > due)
+            due = link_free_us[dir];
+        due += (uint64_t)len * 8 * 1000000 / bits_per_s;
+        link_free_us[dir] = due;
+    }
+
+    // departures only move forward and the delay is fixed, so the queue stays in order
+    struct held *h = malloc(sizeof(*h) + len);
+    h->due_us = due + delay_us;
+    h->sockfd = sockfd;
+    h->to = *to;
+    h->len = len;
+    h->next = NULL;
+    memcpy(h->data, data, len);
+    if (queue_tail[dir])
+        queue_tail[dir]->next = h;
+    else
+        queue_head[dir] = h;
+    queue_tail[dir] = h;
+}
+
+/* Sends whatever is due; returns how many ms until the next packet is, -1 if none is waiting */
+static int flush_queues(uint64_t now)
+{
+    int timeout = -1;
+
+    for (int dir = 0; dir < 2; dir++)
+    {
+        while (queue_head[dir] && queue_head[dir]->due_us <= now)
+        {
+            struct held *h = queue_head[dir];
+            send_now(h->sockfd, &h->to, h->data, h->len);
+            queue_head[dir] = h->next;
+            if (!queue_head[dir])
+                queue_tail[dir] = NULL;
+            free(h);
+        }
+        if (queue_head[dir])
+        {
+            int ms = (queue_head[dir]->due_us - now + 999) / 1000;
+            if (timeout < 0 || ms < timeout)
+                timeout = ms;
+        }
+    }
+    return timeout;
+}
+
+int main(int argc, char **argv)
+{
+    struct client clients[RELAY_MAX_CLIENTS];
+    struct pollfd pfd[RELAY_MAX_CLIENTS + 1];
+    struct sockaddr_in listenaddr, serveraddr;
+    char buf[UFTP_MAX_PACKET];
+    int nclients = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:d:b:k:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            loss_percent = atoi(optarg);
+            break;
+        case 'd':
+            delay_us = (uint64_t)atoi(optarg) * 1000;
+            break;
+        case 'b':
+            bits_per_s = (uint64_t)atoi(optarg) * 1000000;
+            break;
+        case 'k':
+            kill_after_us = (uint64_t)atoi(optarg) * 1000000;
+            break;
+        default:
+            argc = 0; // force the usage message below
+        }
+    }
+    if (argc - optind != 3)
+    {
+        fprintf(stderr, "usage: %s [-l loss_percent] [-d delay_ms] [-b mbit_per_s] [-k kill_after_s] "
+                        "<listen_port> <server_host> <server_port>\n",
+                argv[0]);
+        exit(1);
+    }
+
+    struct hostent *server = gethostbyname(argv[optind + 1]);
+    if (server == NULL)
+    {
+        fprintf(stderr, "ERROR, no such host as %s\n", argv[optind + 1]);
+        exit(1);
+    }
+    bzero(&serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    memcpy(&serveraddr.sin_addr.s_addr, server->h_addr, server->h_length);
+    serveraddr.sin_port = htons(atoi(argv[optind + 2]));
+
+    int listenfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (listenfd < 0)
+        error("ERROR opening socket");
+    uftp_set_buffers(listenfd);
+    bzero(&listenaddr, sizeof(listenaddr));
+    listenaddr.sin_family = AF_INET;
+    listenaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    listenaddr.sin_port = htons(atoi(argv[optind]));
+    if (bind(listenfd, (struct sockaddr *)&listenaddr, sizeof(listenaddr)) < 0)
+        error("ERROR on binding");
+
+    pfd[0] = (struct pollfd){listenfd, POLLIN, 0};
+    int timeout = -1;
+
+    while (1)
+    {
+        poll(pfd, nclients + 1, timeout);
+
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        int n;
+
+        // client -> server, through the client's own upstream socket
+        while ((n = recvfrom(listenfd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen)) >= 0)
+        {
+            int i;
+            for (i = 0; i < nclients; i++)
+            {
+                if (clients[i].addr.sin_addr.s_addr == from.sin_addr.s_addr &&
+                    clients[i].addr.sin_port == from.sin_port)
+                    break;
+            }
+            if (i == nclients)
+            {
+                int fd = nclients < RELAY_MAX_CLIENTS ? socket(AF_INET, SOCK_DGRAM, 0) : -1;
+                if (fd < 0)
+                    continue;
+                uftp_set_buffers(fd);
+                clients[i] = (struct client){from, fd};
+                pfd[i + 1] = (struct pollfd){fd, POLLIN, 0};
+                nclients++;
+            }
+            relay(0, clients[i].sockfd, &serveraddr, buf, n);
+            fromlen = sizeof(from);
+        }
+
+        // server -> client
+        for (int i = 0; i < nclients; i++)
+        {
+            while ((n = recv(clients[i].sockfd, buf, sizeof(buf), MSG_DONTWAIT)) >= 0)
+                relay(1, listenfd, &clients[i].addr, buf, n);
+        }
+
+        timeout = flush_queues(uftp_now_us());
+    }
+}
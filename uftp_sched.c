@@ -0,0 +1,274 @@
+/*
+ * uftp_sched.c - weighted fair sharing of the server's output among sessions
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "uftp_sched.h"
+#include "uftp_proto.h"
+
+/*------------------------------------ token buckets ------------------------------------*/
+
+/* tokens are kept in byte-microseconds so that refills never lose a fraction of a byte */
+#define US_PER_S 1000000
+
+static void bucket_init(struct sched_bucket *b, uint64_t rate)
+{
+    int64_t least = 2 * (int64_t)UFTP_MAX_PACKET * US_PER_S; // always room for a chunk or two
+
+    b->rate = rate;
+    b->depth = (int64_t)rate * SCHED_BURST_US;
+    if (b->depth < least)
+        b->depth = least;
+    b->refill_us = 0; // starts full on first use
+}
+
+static void bucket_refill(struct sched_bucket *b, uint64_t now)
+{
+    if (!b->refill_us)
+        b->tokens = b->depth;
+    else if (now > b->refill_us)
+        b->tokens += (int64_t)(now - b->refill_us) * b->rate;
+    if (b->tokens > b->depth)
+        b->tokens = b->depth;
+    b->refill_us = now;
+}
+
+/* When the bucket has tokens again */
+static uint64_t bucket_ready(struct sched_bucket *b, uint64_t now)
+{
+    return b->tokens > 0 ? now : now + (uint64_t)(-b->tokens) / b->rate + 1;
+}
+
+/*------------------------------------ rules ------------------------------------*/
+
+static int parse_rule(struct sched_rule *r, char *text)
+{
+    char *eq = strchr(text, '=');
+    char *at;
+    unsigned bits = 32;
+
+    if (!eq)
+        return -1;
+    *eq = '\0';
+    at = strchr(eq + 1, '@');
+    if (at)
+        *at = '\0';
+
+    memset(r, 0, sizeof(*r));
+    r->weight = atoi(eq + 1);
+    if (r->weight < 1 || r->weight > SCHED_MAX_WEIGHT)
+        return -1;
+    if (at)
+    {
+        double mbit = atof(at + 1);
+        if (mbit <= 0)
+            return -1;
+        r->rate = (uint64_t)(mbit * 1e6 / 8);
+    }
+
+    if (!strcmp(text, "*"))
+        return 0;
+    if (!strcmp(text, "small"))
+    {
+        r->class = SCHED_SMALL;
+        return 0;
+    }
+    if (!strcmp(text, "bulk"))
+    {
+        r->class = SCHED_BULK;
+        return 0;
+    }
+
+    char *slash = strchr(text, '/');
+    struct in_addr in;
+    if (slash)
+    {
+        *slash = '\0';
+        bits = atoi(slash + 1);
+        if (bits > 32)
+            return -1;
+    }
+    if (inet_pton(AF_INET, text, &in) != 1)
+        return -1;
+    r->mask = bits ? 0xffffffffu << (32 - bits) : 0;
+    r->addr = ntohl(in.s_addr) & r->mask;
+    return 0;
+}
+
+/*
+    Adds the rules of spec, a comma separated list of match=weight[@mbit]:
+    match is a client address (a.b.c.d[/bits]), "small", "bulk" or "*", and
+    the optional rate caps each matching session in Mbit/s. The first rule
+    a session matches decides; sessions matching none get weight 1 and no
+    cap. Returns -1 after printing what was wrong.
+*/
+int sched_add_rules(struct sched *sc, char *spec)
+{
+    for (char *entry = strtok(spec, ","); entry; entry = strtok(NULL, ","))
+    {
+        char text[64];
+
+        snprintf(text, sizeof(text), "%s", entry);
+        if (sc->nrules == SCHED_MAX_RULES)
+        {
+            fprintf(stderr, "At most %d scheduling rules are supported\n", SCHED_MAX_RULES);
+            return -1;
+        }
+        if (parse_rule(&sc->rules[sc->nrules], text) < 0)
+        {
+            fprintf(stderr, "Bad scheduling rule %s, expected address[/bits]|small|bulk|*=weight[@mbit]\n", entry);
+            return -1;
+        }
+        sc->nrules++;
+    }
+    return 0;
+}
+
+/* Paces the total output to rate bytes/s; 0 leaves it unpaced */
+void sched_set_link(struct sched *sc, uint64_t rate)
+{
+    bucket_init(&sc->link, rate);
+}
+
+/* Gives a session the weight and cap of the first rule it matches; addr in network order */
+void sched_flow_init(struct sched *sc, struct sched_flow *f, uint32_t addr, off_t size)
+{
+    int class = size > (off_t)UFTP_WINDOW * CHUNKSIZE ? SCHED_BULK : SCHED_SMALL;
+
+    memset(f, 0, sizeof(*f));
+    f->weight = 1;
+    addr = ntohl(addr);
+    for (int i = 0; i < sc->nrules; i++)
+    {
+        struct sched_rule *r = &sc->rules[i];
+        if ((r->class == SCHED_ANY || r->class == class) && (addr & r->mask) == r->addr)
+        {
+            f->weight = r->weight;
+            if (r->rate)
+                bucket_init(&f->cap, r->rate);
+            break;
+        }
+    }
+}
+
+/*------------------------------------ the ring ------------------------------------*/
+
+/* A session has something to send: it joins the end of the round */
+void sched_activate(struct sched *sc, struct sched_flow *f)
+{
+    if (f->active)
+        return;
+    f->active = 1;
+    f->deficit = 0;
+    f->wake_us = 0;
+    if (!sc->head)
+    {
+        f->prev = f->next = f;
+        sc->head = f;
+    }
+    else
+    {
+        f->next = sc->head;
+        f->prev = sc->head->prev;
+        f->prev->next = f;
+        sc->head->prev = f;
+    }
+    sc->nactive++;
+}
+
+void sched_deactivate(struct sched *sc, struct sched_flow *f)
+{
+    if (!f->active)
+        return;
+    f->active = 0;
+    f->turn = 0;
+    if (f->next == f)
+    {
+        sc->head = NULL;
+    }
+    else
+    {
+        f->prev->next = f->next;
+        f->next->prev = f->prev;
+        if (sc->head == f)
+            sc->head = f->next;
+    }
+    sc->nactive--;
+}
+
+/*
+    Picks the session whose turn it is; a new turn adds its quantum to its
+    credit. *allow is how many bytes it may send now. A session over its
+    rate cap gets 0 and leaves the ring, with wake_us saying when it may
+    come back. Returns NULL when nobody is waiting or the link is out of
+    tokens.
+*/
+struct sched_flow *sched_next(struct sched *sc, uint64_t now, int64_t *allow)
+{
+    struct sched_flow *f = sc->head;
+
+    if (!f)
+        return NULL;
+    if (sc->link.rate)
+    {
+        bucket_refill(&sc->link, now);
+        if (sc->link.tokens <= 0)
+            return NULL;
+    }
+    if (!f->turn)
+    {
+        f->turn = 1;
+        f->deficit += (int64_t)f->weight * SCHED_QUANTUM;
+    }
+    *allow = f->deficit;
+
+    if (f->cap.rate)
+    {
+        bucket_refill(&f->cap, now);
+        if (f->cap.tokens <= 0)
+        {
+            sched_deactivate(sc, f);
+            f->wake_us = bucket_ready(&f->cap, now);
+            *allow = 0;
+            return f;
+        }
+        if (f->cap.tokens / US_PER_S < *allow)
+            *allow = f->cap.tokens / US_PER_S + 1;
+    }
+    if (sc->link.rate && sc->link.tokens / US_PER_S < *allow)
+        *allow = sc->link.tokens / US_PER_S + 1;
+    return f;
+}
+
+/*
+    Books what a session just sent against its credit, its cap and the
+    link. Once its credit is spent the turn passes to the next session; an
+    overshoot is paid back out of its next turn.
+*/
+void sched_charge(struct sched *sc, struct sched_flow *f, int64_t bytes)
+{
+    f->deficit -= bytes;
+    if (f->cap.rate)
+        f->cap.tokens -= bytes * US_PER_S;
+    if (sc->link.rate)
+        sc->link.tokens -= bytes * US_PER_S;
+    if (f->active && f->deficit <= 0)
+    {
+        f->turn = 0;
+        sc->head = f->next;
+    }
+}
+
+/* When the scheduler next has something to do: now if sessions can send, later if the link is paced */
+uint64_t sched_wakeup(struct sched *sc, uint64_t now)
+{
+    if (!sc->head)
+        return UINT64_MAX;
+    if (!sc->link.rate)
+        return now;
+    bucket_refill(&sc->link, now);
+    return bucket_ready(&sc->link, now);
+}
@@ -0,0 +1,80 @@
+/*
+ * uftp_sched.h - weighted fair sharing of the server's output among sessions
+ *
+ * Sessions with something to send wait in a ring and are served deficit
+ * round robin: each visit adds weight * SCHED_QUANTUM bytes of credit, and
+ * the session sends chunks while its credit lasts. A greedy bulk get thus
+ * gets one turn per round like everybody else, and a small request waits
+ * at most one round for its chunk; picking the next session is O(1),
+ * however many there are. Weights and optional per-session rate caps come
+ * from rules matched against the client's address or the size of the
+ * transfer. With a link rate set, the total output is paced to it, which
+ * keeps the queue in the server where the shares are enforced rather than
+ * in a device queue further down; without one, every session may send
+ * what its window allows and the scheduler only decides the order.
+ */
+#ifndef UFTP_SCHED_H
+#define UFTP_SCHED_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "uftp_readahead.h"
+
+#define SCHED_QUANTUM CHUNKSIZE /* credit per visit at weight 1 */
+#define SCHED_BURST_US 2000     /* token buckets hold this much time's worth of sending */
+#define SCHED_MAX_RULES 32
+#define SCHED_MAX_WEIGHT 1000
+
+/* what a rule matches besides addresses */
+#define SCHED_ANY 0
+#define SCHED_SMALL 1 /* transfers that fit in one window */
+#define SCHED_BULK 2  /* everything bigger */
+
+/* address/bits, small, bulk or * = weight[@Mbit/s] */
+struct sched_rule
+{
+    uint32_t addr, mask; /* host order; mask 0 matches every client */
+    int class;
+    int weight;
+    uint64_t rate; /* bytes/s, 0 for no cap */
+};
+
+struct sched_bucket
+{
+    uint64_t rate; /* bytes/s, 0 for unlimited */
+    int64_t tokens, depth;
+    uint64_t refill_us;
+};
+
+/* one session's place in the schedule */
+struct sched_flow
+{
+    struct sched_flow *prev, *next; /* in the ring while active */
+    int active;
+    int turn; /* it is being served: its quantum has been added */
+    int weight;
+    int64_t deficit;         /* bytes it may still send this turn; negative after overshooting */
+    struct sched_bucket cap; /* rate 0: uncapped */
+    uint64_t wake_us;        /* over its cap: when it may send again, 0 if not waiting */
+};
+
+struct sched
+{
+    struct sched_flow *head; /* next to be served */
+    int nactive;
+    struct sched_bucket link;
+    struct sched_rule rules[SCHED_MAX_RULES];
+    int nrules;
+};
+
+int sched_add_rules(struct sched *sc, char *spec);
+void sched_set_link(struct sched *sc, uint64_t rate);
+void sched_flow_init(struct sched *sc, struct sched_flow *f, uint32_t addr, off_t size);
+void sched_activate(struct sched *sc, struct sched_flow *f);
+void sched_deactivate(struct sched *sc, struct sched_flow *f);
+struct sched_flow *sched_next(struct sched *sc, uint64_t now, int64_t *allow);
+void sched_charge(struct sched *sc, struct sched_flow *f, int64_t bytes);
+uint64_t sched_wakeup(struct sched *sc, uint64_t now);
+
+#endif
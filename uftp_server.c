@@ -3,6 +3,7 @@
  * usage: udpserver <port>
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -12,6 +13,24 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+#include "uftp_readahead.h"
+#include "uftp_proto.h"
+#include "uftp_sha256.h"
+#include "uftp_sync.h"
+#include "uftp_store.h"
+#include "uftp_cdc.h"
+#include "uftp_sched.h"
+#include "uftp_xsk.h"
 
 #define BUFSIZE 1024
 #define CHUNKSIZE 16000
@@ -25,53 +44,260 @@ void error(char *msg)
     exit(1);
 }
 
-void exit_operation_to_server(int sockfd, struct sockaddr_in clientaddr, int clientlen);
-void ls_to_server(int sockfd, struct sockaddr_in clientaddr, int clientlen);
-void delete_file_from_server(int sockfd, char *filename, struct sockaddr_in clientaddr, int clientlen);
-void put_file_to_server(int sockfd, char *filename, struct sockaddr_in *clientaddr, int clientlen);
-void get_file_from_server(int sockfd, char *filename, struct sockaddr_in clientaddr, int clientlen);
-void receive_file_with_ack(int sockfd, char *filename, struct sockaddr_in *clientaddr);
-void send_file_with_ack(char *filename, int sockfd, struct sockaddr_in *clientaddr);
+#define SESSION_BUCKETS 4096
 
-struct timeval set_timeout(int sockfd, int seconds)
-{
-    struct timeval timeout;
-    timeout.tv_sec = seconds;
-    timeout.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#define BUSY_SPIN_US 200     /* default time spent spinning on recvfrom before sleeping */
+#define BUSY_POLL_BUDGET 64  /* packets the kernel may process per busy-poll round */
 
-    return timeout;
-}
+/* older libc headers predate the newer busy-poll socket options */
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+/* what a session is doing */
+#define S_SEND 1 /* streaming a file (get, ls) to the client */
+#define S_RECV 2 /* receiving a file (put) from the client */
+#define S_DONE 3 /* finished; kept around to answer retransmissions */
+#define S_WORK 4 /* a worker thread hashes or stores a file (hash, dedup-commit); the answer follows */
+
+#define WORK_POLL_US 1000 /* how often an S_WORK session looks in on its worker */
 
-void disable_timeout(struct timeval timeout, int sockfd)
+/*
+    One client operation. Sessions are keyed by the session id the client
+    picked, since a multipath client reaches us from several addresses, and
+    all of them are driven from one event loop.
+*/
+struct session
 {
-    timeout.tv_sec = 0; // disable timeout
-    timeout.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-}
+    uint32_t id;
+    struct sockaddr_in addr;                        /* where the latest packet came from; text replies go here */
+    struct sockaddr_in path_addr[UFTP_MAX_PATHS]; /* client address of each path it has used */
+    struct server *srv;
+    int state;
+    char filename[PATH_MAX];
+
+    struct readahead *ra; /* S_SEND */
+    struct uftp_sender sender;
+    struct sched_flow flow; /* its turn in the server's output */
+    uint64_t retry_us;      /* the reader was behind (or S_WORK: the worker is busy): look again then, 0 if not waiting */
+    uint64_t sent_bytes;    /* everything session_send has put on the wire */
+    off_t range_offset, range_length; /* get -r: the part of the file to send (length -1: to the end) */
+
+    int fd; /* S_RECV */
+    struct uftp_receiver receiver;
+    int64_t mtime_ns; /* put -t: modification time to give the file, 0 to leave it */
+
+    char token[16]; /* dedup-commit: the upload being committed */
+    int work_type;  /* S_WORK: set (atomically) once the worker has left its answer in reply */
+
+    int reply_type;               /* UFTP_REPLY/UFTP_FAIL for sessions answered with text only */
+    char reply[UFTP_REPLY_MAX];   /* that text, or the closing words of a put */
+    uint64_t last_heard_us;       /* when the client last sent us anything */
+    uint64_t expires_us;          /* S_DONE sessions are dropped after this */
+    uint64_t due_us;              /* when its timers next need running */
+    int timer_index;              /* place in srv->timers, -1 if no timer is armed */
+
+    struct session *hash_next;
+};
+
+struct server
+{
+    int sockfd;
+    int index;     /* thread number in busy-poll mode */
+    int busy_poll; /* spin on the socket before sleeping */
+    struct session *buckets[SESSION_BUCKETS];
+    struct session **timers; /* min-heap of sessions on due_us */
+    int ntimers, timers_cap;
+    struct sched sched;         /* which session sends next */
+    struct uftp_crypto *crypto; /* NULL: packets travel in the clear */
+    struct uftp_xsk *xsk;       /* AF_XDP socket (-X), NULL: the UDP socket carries everything */
+};
+
+int open_server_socket(int portno, int reuseport);
+void enable_busy_poll(int sockfd);
+void *server_thread(void *arg);
+void server_loop(struct server *srv);
+void handle_packet(struct server *srv, char *buf, int n, struct sockaddr_in *clientaddr);
+void service_sessions(struct server *srv, uint64_t now);
+uint64_t next_wakeup(struct server *srv, uint64_t now);
+
+void exit_operation_to_server(struct session *s);
+void ls_to_server(struct session *s);
+void delete_file_from_server(struct session *s, char *filename);
+void manifest_to_server(struct session *s, char *dirname);
+void hash_file_on_server(struct session *s, char *filename);
+void stat_file_on_server(struct session *s, char *filename);
+void dedup_recipe_to_server(struct session *s, char *token, struct uftp_pkt *first);
+void dedup_missing_to_server(struct session *s, char *token);
+void dedup_fill_to_server(struct session *s, char *token, struct uftp_pkt *first);
+void dedup_commit_on_server(struct session *s, char *token, char *filename);
+void put_file_to_server(struct session *s, char *filename, struct uftp_pkt *first);
+void get_file_from_server(struct session *s, char *filename);
+int receive_file_with_ack(struct session *s, char *filename, struct uftp_pkt *first);
+void send_file_with_ack(struct session *s, char *filename);
+
+int readahead_depth = RA_DEFAULT_DEPTH; /* chunks prefetched ahead of the sender (-r) */
+int readahead_direct = 0;               /* read files with O_DIRECT (-d) */
+int busy_spin_us = BUSY_SPIN_US;        /* busy-poll spin budget (-s) */
+struct store *store = NULL;             /* deduplicating chunk store (-S), NULL if disabled */
 
 int main(int argc, char **argv)
 {
-    int sockfd;                    /* socket */
-    int portno;                    /* port to listen on */
-    int clientlen;                 /* byte size of client's address */
-    struct sockaddr_in serveraddr; /* server's addr */
-    struct sockaddr_in clientaddr; /* client addr */
-    struct hostent *hostp;         /* client host info */
-    char buf[BUFSIZE];             /* message buf */
-    char *hostaddrp;               /* dotted decimal host addr string */
-    int optval;                    /* flag value for setsockopt */
-    int n;                         /* message byte size */
+    int portno;      /* port to listen on */
+    int threads = 0; /* busy-poll threads (-b), 0 for the plain event loop */
+    const char *keyfile = NULL; /* pre-shared key (-K), NULL for cleartext */
+    int cipher = 0;             /* -E, 0 for the best one this CPU has */
+    double link_mbit = 0;       /* -B: total sending rate to pace to, 0 for unpaced */
+    static struct sched policy; /* -W: weights and caps every thread schedules by */
+    char *xdp_ifname = NULL;    /* -X: interface to attach the AF_XDP backend to, NULL for none */
+    int xdp_queue = 0;          /* -X: its queue */
+    int xdp_generic = 0;        /* -G: generic XDP even if the driver has its own */
+    char *colon;
 
     /*
      * check command line arguments
      */
-    if (argc != 2)
+    int opt;
+    static struct store dedup_store;
+    while ((opt = getopt(argc, argv, "r:db:s:S:K:E:B:W:X:G")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            readahead_depth = atoi(optarg);
+            break;
+        case 'd':
+            readahead_direct = 1;
+            break;
+        case 'b':
+            threads = atoi(optarg);
+            break;
+        case 's':
+            busy_spin_us = atoi(optarg);
+            break;
+        case 'S':
+            if (store_open(&dedup_store, optarg) < 0)
+                error("ERROR opening chunk store");
+            store = &dedup_store;
+            break;
+        case 'K':
+            keyfile = optarg;
+            break;
+        case 'E':
+            if ((cipher = crypto_cipher_by_name(optarg)) < 0)
+                argc = 0;
+            break;
+        case 'B':
+            link_mbit = atof(optarg);
+            break;
+        case 'W':
+            if (sched_add_rules(&policy, optarg) < 0)
+                exit(1);
+            break;
+        case 'X':
+            xdp_ifname = optarg;
+            if ((colon = strchr(optarg, ':')))
+            {
+                *colon = '\0';
+                xdp_queue = atoi(colon + 1);
+            }
+            break;
+        case 'G':
+            xdp_generic = 1;
+            break;
+        default:
+            argc = 0; // force the usage message below
+        }
+    }
+    if (argc - optind != 1)
+    {
+        fprintf(stderr, "usage: %s [-r readahead_chunks] [-d] [-b busy_poll_threads] [-s spin_us] [-S store_dir] [-K keyfile] [-E aes|chacha] [-B mbit] [-W match=weight[@mbit],...] [-X ifname[:queue]] [-G] <port>\n", argv[0]);
+        exit(1);
+    }
+    portno = atoi(argv[optind]);
+    if (xdp_ifname && threads > 1)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        fprintf(stderr, "-X serves one queue from one thread; use it without -b or with -b 1\n");
         exit(1);
     }
-    portno = atoi(argv[1]);
+
+    static struct uftp_xsk xsk;
+    if (xdp_ifname && xsk_open(&xsk, xdp_ifname, xdp_queue, portno, xdp_generic) < 0)
+    {
+        printf("AF_XDP is not available, serving through the UDP socket only.\n");
+        xdp_ifname = NULL;
+    }
+
+    static struct uftp_crypto keyed;
+    if (keyfile)
+    {
+        if (crypto_init(&keyed, keyfile, CRYPTO_SERVER, cipher) < 0)
+            error("ERROR loading key file");
+        printf("Encrypting with %s\n", aead_name(keyed.cipher));
+    }
+
+    if (threads <= 0)
+    {
+        static struct server srv;
+        srv.sockfd = open_server_socket(portno, 0);
+        srv.crypto = keyfile ? &keyed : NULL;
+        srv.sched = policy;
+        sched_set_link(&srv.sched, (uint64_t)(link_mbit * 1e6 / 8));
+        srv.xsk = xdp_ifname ? &xsk : NULL;
+        server_loop(&srv);
+    }
+
+    /*
+     * busy-poll mode: one SO_REUSEPORT socket per thread, each thread pinned
+     * to its own CPU. The kernel hashes a client's address to one socket, so
+     * every session lives entirely on one thread and nothing is shared.
+     */
+    struct server *servers = calloc(threads, sizeof(*servers));
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 0; i < threads; i++)
+    {
+        servers[i].index = i;
+        servers[i].busy_poll = 1;
+        servers[i].crypto = keyfile ? crypto_clone(&keyed) : NULL;
+        servers[i].sched = policy;
+        sched_set_link(&servers[i].sched, (uint64_t)(link_mbit * 1e6 / 8 / threads)); // each gets its share
+        servers[i].sockfd = open_server_socket(portno, 1);
+        enable_busy_poll(servers[i].sockfd);
+        if (xdp_ifname)
+        {
+            servers[i].xsk = &xsk;
+            enable_busy_poll(xsk.fd);
+        }
+
+        pthread_create(&tids[i], NULL, server_thread, &servers[i]);
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % ncpu, &cpus);
+        if (pthread_setaffinity_np(tids[i], sizeof(cpus), &cpus) != 0)
+            printf("Could not pin thread %d to CPU %ld\n", i, i % ncpu);
+    }
+    printf("Busy-poll mode: %d threads, spinning up to %d us before sleeping\n", threads, busy_spin_us);
+
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    return 0;
+}
+
+/*
+    Creates the server's UDP socket bound to portno. With reuseport, several
+    sockets can share the port and the kernel spreads clients across them.
+*/
+int open_server_socket(int portno, int reuseport)
+{
+    int sockfd;                    /* socket */
+    struct sockaddr_in serveraddr; /* server's addr */
+    int optval;                    /* flag value for setsockopt */
 
     /*
      * socket: create the parent socket
@@ -79,6 +305,7 @@ int main(int argc, char **argv)
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0)
         error("ERROR opening socket");
+    uftp_set_buffers(sockfd);
 
     /* setsockopt: Handy debugging trick that lets
      * us rerun the server immediately after we kill it;
@@ -88,6 +315,9 @@ int main(int argc, char **argv)
     optval = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
                (const void *)&optval, sizeof(int));
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+                                (const void *)&optval, sizeof(int)) < 0)
+        error("ERROR setting SO_REUSEPORT");
 
     /*
      * build the server's Internet address
@@ -104,102 +334,747 @@ int main(int argc, char **argv)
              sizeof(serveraddr)) < 0)
         error("ERROR on binding");
 
+    return sockfd;
+}
+
+/*
+    Asks the kernel to busy-poll the device queue on receive instead of
+    sleeping for the interrupt. Raising SO_BUSY_POLL above the sysctl default
+    needs CAP_NET_ADMIN, so failures only produce a warning.
+*/
+void enable_busy_poll(int sockfd)
+{
+    int usecs = busy_spin_us;
+    int prefer = 1;
+    int budget = BUSY_POLL_BUDGET;
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0)
+        perror("SO_BUSY_POLL");
+    if (setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0)
+        perror("SO_PREFER_BUSY_POLL");
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) < 0)
+        perror("SO_BUSY_POLL_BUDGET");
+}
+
+void *server_thread(void *arg)
+{
+    server_loop(arg);
+    return NULL;
+}
+
+/* xsk_recv_fn: a datagram that came in through AF_XDP, still in its UMEM frame */
+static void xsk_packet(void *ctx, char *buf, int n, struct sockaddr_in *from)
+{
+    struct server *srv = ctx;
+
+    if ((n = crypto_unseal(srv->crypto, buf, n)) >= 0)
+        handle_packet(srv, buf, n, from);
+}
+
+/* Receives every datagram that is waiting, on the socket and through AF_XDP; returns how many there were */
+static int drain_socket(struct server *srv)
+{
+    char buf[UFTP_MAX_PACKET];     /* message buf */
+    struct sockaddr_in clientaddr; /* client addr */
+    socklen_t clientlen = sizeof(clientaddr);
+    int n, count = 0;
+
     /*
-     * main loop: wait for a datagram, then echo it
+     *  recvfrom: receive every UDP datagram that is waiting
      */
-    clientlen = sizeof(clientaddr);
+    while ((n = recvfrom(srv->sockfd, buf, sizeof(buf), MSG_DONTWAIT,
+                         (struct sockaddr *)&clientaddr, &clientlen)) >= 0)
+    {
+        if ((n = crypto_unseal(srv->crypto, buf, n)) >= 0)
+            handle_packet(srv, buf, n, &clientaddr);
+        clientlen = sizeof(clientaddr);
+        count++;
+    }
+    if (srv->xsk)
+        count += xsk_recv(srv->xsk, xsk_packet, srv);
+    return count;
+}
+
+/*
+    main loop: wait for datagrams, hand them to their sessions,
+    then let every session send whatever its timers or window allow.
+    In busy-poll mode the socket is polled in a tight loop for up to
+    busy_spin_us before the thread goes to sleep in epoll_wait, which saves
+    the wakeup latency on request/response traffic.
+*/
+void server_loop(struct server *srv)
+{
+    int epfd = epoll_create1(0);
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = srv->sockfd};
+
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, srv->sockfd, &ev) < 0)
+        error("ERROR setting up epoll");
+    if (srv->xsk)
+    {
+        ev.data.fd = srv->xsk->fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, srv->xsk->fd, &ev) < 0)
+            error("ERROR setting up epoll");
+    }
+
     while (1)
     {
-        char command[100];
-        bzero(command, sizeof(command));
-        /*
-         *  recvfrom: receive a UDP datagram from a client
-            received command from client
-            e.g. get abc.txt
-         */
-        n = recvfrom(sockfd, command, BUFSIZE, 0, (struct sockaddr *)&clientaddr, &clientlen);
-        // if (n < 0)
-        //     printf("ERROR in recvfrom");
+        uint64_t now = uftp_now_us();
+        uint64_t wait = next_wakeup(srv, now);
+        int got = 0;
 
-        printf("server received %ld/%d bytes: %s\n", strlen(command), n, command);
+        if (srv->busy_poll)
+        {
+            uint64_t spin_until = now + (wait < (uint64_t)busy_spin_us ? wait : (uint64_t)busy_spin_us);
+            do
+            {
+                got = drain_socket(srv);
+            } while (!got && uftp_now_us() < spin_until);
 
-        // send timeout
-        struct timeval timeout1;
-        timeout1.tv_sec = 2;
-        timeout1.tv_usec = 0;
-        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout1, sizeof(timeout1));
+            if (!got)
+                wait = next_wakeup(srv, uftp_now_us());
+        }
 
-        char op[16];
-        char filename[256];
+        if (!got && epoll_wait(epfd, &ev, 1, (wait + 999) / 1000) > 0)
+            drain_socket(srv);
 
-        bzero(op, sizeof(op));
-        bzero(filename, sizeof(filename));
+        service_sessions(srv, uftp_now_us());
+    }
+}
 
-        command[strcspn(command, "\n")] = '\0';
+/*------------------------------------ timers ------------------------------------*/
+
+static void timer_swap(struct server *srv, int i, int j)
+{
+    struct session *t = srv->timers[i];
+    srv->timers[i] = srv->timers[j];
+    srv->timers[j] = t;
+    srv->timers[i]->timer_index = i;
+    srv->timers[j]->timer_index = j;
+}
+
+/* Restores the heap order around index i after its due time changed */
+static void timer_fix(struct server *srv, int i)
+{
+    while (i > 0 && srv->timers[(i - 1) / 2]->due_us > srv->timers[i]->due_us)
+    {
+        timer_swap(srv, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1)
+    {
+        int least = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < srv->ntimers && srv->timers[l]->due_us < srv->timers[least]->due_us)
+            least = l;
+        if (r < srv->ntimers && srv->timers[r]->due_us < srv->timers[least]->due_us)
+            least = r;
+        if (least == i)
+            break;
+        timer_swap(srv, i, least);
+        i = least;
+    }
+}
+
+static void timer_remove(struct server *srv, struct session *s)
+{
+    int i = s->timer_index;
+
+    if (i < 0)
+        return;
+    s->timer_index = -1;
+    if (--srv->ntimers == i)
+        return;
+    srv->timers[i] = srv->timers[srv->ntimers];
+    srv->timers[i]->timer_index = i;
+    timer_fix(srv, i);
+}
+
+/* When a session's timers next need running; UINT64_MAX if none is armed */
+static uint64_t session_due(struct session *s)
+{
+    uint64_t t = UINT64_MAX;
+
+    if (s->state == S_SEND)
+    {
+        if (s->sender.rto_deadline_us)
+            t = s->sender.rto_deadline_us;
+        if (s->retry_us && s->retry_us < t)
+            t = s->retry_us;
+        if (s->flow.wake_us && s->flow.wake_us < t)
+            t = s->flow.wake_us;
+    }
+    else if (s->state == S_RECV)
+    {
+        t = s->receiver.ack_due_us ? s->receiver.ack_due_us
+                                   : s->last_heard_us + (uint64_t)UFTP_MAX_RETRIES * UFTP_RTO_MAX_US;
+    }
+    else if (s->state == S_WORK)
+    {
+        t = s->retry_us;
+    }
+    else
+    {
+        t = s->expires_us; // also 0 for a session that never got going, which is dropped right away
+    }
+    return t;
+}
 
-        // segregating command: op -> get filename -> abc.txt
-        sscanf(command, "%s %s", op, filename);
+/* Files the session under its next due time, so the loop only visits sessions whose timers expire */
+static void timer_update(struct server *srv, struct session *s)
+{
+    uint64_t due = session_due(s);
 
-        if (strcmp(op, "get") == 0)
+    if (due == UINT64_MAX)
+    {
+        timer_remove(srv, s);
+        return;
+    }
+    s->due_us = due;
+    if (s->timer_index < 0)
+    {
+        if (srv->ntimers == srv->timers_cap)
         {
-            get_file_from_server(sockfd, filename, clientaddr, clientlen);
+            srv->timers_cap = srv->timers_cap ? srv->timers_cap * 2 : 256;
+            srv->timers = realloc(srv->timers, srv->timers_cap * sizeof(*srv->timers));
         }
-        else if (strcmp(op, "put") == 0)
+        s->timer_index = srv->ntimers;
+        srv->timers[srv->ntimers++] = s;
+    }
+    timer_fix(srv, s->timer_index);
+}
+
+/*------------------------------------ sessions ------------------------------------*/
+
+static unsigned session_hash(uint32_t id)
+{
+    return id % SESSION_BUCKETS;
+}
+
+static struct session *find_session(struct server *srv, uint32_t id)
+{
+    struct session *s = srv->buckets[session_hash(id)];
+
+    for (; s; s = s->hash_next)
+    {
+        if (s->id == id)
+            return s;
+    }
+    return NULL;
+}
+
+/* Remembers where a packet on `path` came from; a sending session may now use that path */
+static void learn_path(struct session *s, int path, struct sockaddr_in *addr)
+{
+    s->addr = *addr;
+    if (path >= UFTP_MAX_PATHS)
+        return;
+    s->path_addr[path] = *addr;
+    if (s->state == S_SEND)
+        sender_add_path(&s->sender, path);
+}
+
+static struct session *new_session(struct server *srv, uint32_t id)
+{
+    struct session *s = calloc(1, sizeof(*s));
+    unsigned h = session_hash(id);
+
+    s->id = id;
+    s->srv = srv;
+    s->fd = -1;
+    s->range_length = -1;
+    s->last_heard_us = uftp_now_us();
+    s->timer_index = -1;
+
+    s->hash_next = srv->buckets[h];
+    srv->buckets[h] = s;
+    return s;
+}
+
+static void free_session(struct server *srv, struct session *s)
+{
+    struct session **pp = &srv->buckets[session_hash(s->id)];
+    while (*pp != s)
+        pp = &(*pp)->hash_next;
+    *pp = s->hash_next;
+
+    timer_remove(srv, s);
+    sched_deactivate(&srv->sched, &s->flow);
+    ra_close(s->ra);
+    if (s->fd >= 0)
+        close(s->fd);
+    free(s);
+}
+
+/* Sends one datagram, through AF_XDP if that can reach `to` and through the UDP socket otherwise */
+static int server_sendv(struct server *srv, struct sockaddr_in *to, struct iovec *iov, int iovcnt)
+{
+    char sealed[UFTP_MAX_PACKET];
+    struct iovec one;
+    int n;
+
+    if (!srv->xsk)
+        return uftp_sendv(srv->crypto, srv->sockfd, to, iov, iovcnt);
+
+    if (srv->crypto)
+    {
+        if ((n = crypto_seal(srv->crypto, iov, iovcnt, sealed)) < 0)
+            return -1;
+        one = (struct iovec){sealed, n};
+        iov = &one;
+        iovcnt = 1;
+    }
+    if ((n = xsk_sendv(srv->xsk, to, iov, iovcnt)) >= 0)
+        return n;
+    return uftp_sendv(NULL, srv->sockfd, to, iov, iovcnt); // already sealed
+}
+
+/* uftp_send_fn for a session: each path goes to the client address it was seen from */
+static int session_send(void *ctx, int path, struct iovec *iov, int iovcnt)
+{
+    struct session *s = ctx;
+
+    for (int i = 0; i < iovcnt; i++)
+        s->sent_bytes += iov[i].iov_len;
+    struct sockaddr_in *to = path < UFTP_MAX_PATHS && s->path_addr[path].sin_family ? &s->path_addr[path] : &s->addr;
+
+    return server_sendv(s->srv, to, iov, iovcnt);
+}
+
+/*
+    uftp_send_fn for text answers. uftp_send_text always names path 0, but
+    an answer belongs where the command (or its retransmission) last came
+    from, whichever path that was, so path is ignored.
+*/
+static int session_reply(void *ctx, int path, struct iovec *iov, int iovcnt)
+{
+    struct session *s = ctx;
+
+    (void)path;
+    return server_sendv(s->srv, &s->addr, iov, iovcnt);
+}
+
+static void finish_session(struct session *s)
+{
+    s->state = S_DONE;
+    s->expires_us = uftp_now_us() + UFTP_SESSION_TTL_US;
+    sched_deactivate(&s->srv->sched, &s->flow);
+
+    ra_close(s->ra);
+    s->ra = NULL;
+    if (s->fd >= 0)
+        close(s->fd);
+    s->fd = -1;
+
+    printf("--------------------------------------------------------------------------------\n");
+}
+
+/*
+    snprintf for answers that quote a path, which can be longer than an
+    answer may be: one that does not fit ends in "..." rather than being
+    cut off without a sign.
+*/
+static void format_reply(char *buf, size_t len, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void format_reply(char *buf, size_t len, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, len, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && (size_t)n >= len && len > 4)
+        memcpy(buf + len - 4, "...", 4);
+}
+
+/* Answers a command with text only; the answer is repeated if the command is */
+static void reply_session(struct session *s, int type, const char *text)
+{
+    s->reply_type = type;
+    snprintf(s->reply, sizeof(s->reply), "%s", text);
+    uftp_send_text(session_reply, s, type, s->id, s->reply);
+    finish_session(s);
+}
+
+/*
+    Runs work(s) on a thread of its own, for commands that read a whole
+    file: done here, they would hold up every other session on this loop.
+    The session polls the worker from its timer and sends the answer the
+    worker leaves with work_answer. Without a thread the work is done here.
+*/
+static void start_work(struct session *s, void *(*work)(void *))
+{
+    pthread_t tid;
+
+    s->state = S_WORK;
+    s->retry_us = uftp_now_us() + WORK_POLL_US;
+    if (pthread_create(&tid, NULL, work, s) == 0)
+        pthread_detach(tid);
+    else
+        work(s);
+}
+
+/* Called by a worker with its answer; it must not touch the session after this */
+static void work_answer(struct session *s, int type, const char *text)
+{
+    snprintf(s->reply, sizeof(s->reply), "%s", text);
+    __atomic_store_n(&s->work_type, type, __ATOMIC_RELEASE);
+}
+
+/* Sends the worker's answer once it has one, or looks again later */
+static void check_worker(struct session *s, uint64_t now)
+{
+    int type = __atomic_load_n(&s->work_type, __ATOMIC_ACQUIRE);
+
+    if (!type)
+    {
+        s->retry_us = now + WORK_POLL_US;
+        return;
+    }
+    s->reply_type = type;
+    uftp_send_text(session_reply, s, type, s->id, s->reply);
+    finish_session(s);
+}
+
+/* Gives up on a transfer; a half-written upload is removed */
+static void abort_session(struct session *s, const char *why)
+{
+    printf("%s\n", why);
+    if (s->state == S_RECV)
+    {
+        close(s->fd);
+        s->fd = -1;
+        remove(s->filename); // remove file created since content is wrong or empty
+    }
+    finish_session(s);
+}
+
+static void check_receiver(struct session *s)
+{
+    if (s->state != S_RECV)
+        return;
+
+    if (s->receiver.done)
+    {
+        printf("File received successfully.\n");
+        if (s->mtime_ns)
         {
-            put_file_to_server(sockfd, filename, &clientaddr, clientlen);
+            struct timespec times[2] = {{0, UTIME_NOW},
+                                        {s->mtime_ns / 1000000000, s->mtime_ns % 1000000000}};
+            futimens(s->fd, times);
         }
-        else if (strcmp(op, "delete") == 0)
+        finish_session(s);
+    }
+    else if (s->receiver.failed)
+    {
+        uftp_send_text(session_reply, s, UFTP_FAIL, s->id, "Error writing file on the server.");
+        abort_session(s, "File not received successfully.");
+    }
+}
+
+static void check_sender(struct session *s)
+{
+    if (s->state != S_SEND)
+        return;
+
+    if (s->sender.done)
+    {
+        printf("File sent successfully.\n");
+        finish_session(s);
+    }
+    else if (s->sender.failed)
+    {
+        uftp_send_text(session_reply, s, UFTP_FAIL, s->id, "Server gave up on the transfer.");
+        abort_session(s, "File not sent successfully.");
+    }
+}
+
+static void start_command(struct session *s, struct uftp_pkt *p)
+{
+    char op[16];
+    char filename[PATH_MAX];
+
+    bzero(op, sizeof(op));
+    bzero(filename, sizeof(filename));
+
+    printf("server received %ld bytes: %s\n", strlen(p->cmd), p->cmd);
+
+    // segregating command: op -> get filename -> abc.txt
+    // everything after the op is the path, so it may contain spaces
+    sscanf(p->cmd, "%15s", op);
+    const char *arg = p->cmd + strlen(op);
+    if (*arg == ' ')
+        arg++;
+
+    // dedup-* operations name their upload with a token picked by the client
+    char token[16];
+    int consumed = 0;
+    bzero(token, sizeof(token));
+    if (strncmp(op, "dedup-", 6) == 0 && sscanf(arg, "%15s%n", token, &consumed) == 1)
+    {
+        arg += consumed;
+        if (*arg == ' ')
+            arg++;
+    }
+
+    // put -t <mtime_ns> <path>: give the uploaded file this modification time
+    long long mtime = 0;
+    consumed = 0;
+    if ((strcmp(op, "put") == 0 || strcmp(op, "dedup-commit") == 0) &&
+        sscanf(arg, "-t %lld %n", &mtime, &consumed) == 1 && consumed)
+    {
+        s->mtime_ns = mtime;
+        arg += consumed;
+    }
+
+    // get -r <offset> <length> <path>: send only that byte range of the file
+    long long offset = 0, length = 0;
+    consumed = 0;
+    if (strcmp(op, "get") == 0 && sscanf(arg, "-r %lld %lld %n", &offset, &length, &consumed) == 2 && consumed)
+    {
+        s->range_offset = offset;
+        s->range_length = length;
+        arg += consumed;
+    }
+    snprintf(filename, sizeof(filename), "%s", arg);
+
+    // file operations stay inside the directory the server was started in
+    int takes_path = (!strcmp(op, "get") || !strcmp(op, "put") || !strcmp(op, "delete") ||
+                      !strcmp(op, "manifest") || !strcmp(op, "hash") || !strcmp(op, "stat") ||
+                      !strcmp(op, "dedup-commit"));
+    if (takes_path && !sync_safe_path(filename))
+    {
+        printf("Rejected path %s\n", filename);
+        reply_session(s, UFTP_FAIL, "Invalid path: must be relative and stay inside the server directory.");
+        return;
+    }
+
+    if (strcmp(op, "get") == 0)
+    {
+        get_file_from_server(s, filename);
+    }
+    else if (strcmp(op, "put") == 0)
+    {
+        put_file_to_server(s, filename, p);
+    }
+    else if (strcmp(op, "delete") == 0)
+    {
+        delete_file_from_server(s, filename);
+    }
+    else if (strcmp(op, "manifest") == 0)
+    {
+        manifest_to_server(s, filename);
+    }
+    else if (strcmp(op, "hash") == 0)
+    {
+        hash_file_on_server(s, filename);
+    }
+    else if (strcmp(op, "stat") == 0)
+    {
+        stat_file_on_server(s, filename);
+    }
+    else if (strncmp(op, "dedup-", 6) == 0 && !store)
+    {
+        reply_session(s, UFTP_FAIL, "Deduplicated storage is not enabled on this server.");
+    }
+    else if (strncmp(op, "dedup-", 6) == 0 && (strlen(token) != 8 || strspn(token, "0123456789abcdef") != 8))
+    {
+        reply_session(s, UFTP_FAIL, "Invalid upload token.");
+    }
+    else if (strcmp(op, "dedup-recipe") == 0)
+    {
+        dedup_recipe_to_server(s, token, p);
+    }
+    else if (strcmp(op, "dedup-missing") == 0)
+    {
+        dedup_missing_to_server(s, token);
+    }
+    else if (strcmp(op, "dedup-fill") == 0)
+    {
+        dedup_fill_to_server(s, token, p);
+    }
+    else if (strcmp(op, "dedup-commit") == 0)
+    {
+        dedup_commit_on_server(s, token, filename);
+    }
+    else if (strcmp(op, "ls") == 0)
+    {
+        ls_to_server(s);
+    }
+    else if (strcmp(op, "exit") == 0)
+    {
+        exit_operation_to_server(s);
+        printf("Exiting from the connection with server \n");
+    }
+    else
+    {
+        printf("Invalid input requested.\n");
+        reply_session(s, UFTP_FAIL, "Invalid input requested.");
+    }
+}
+
+/* Routes one datagram to its session, opening a new session for an unseen CMD */
+void handle_packet(struct server *srv, char *buf, int n, struct sockaddr_in *clientaddr)
+{
+    struct uftp_pkt p;
+
+    if (uftp_parse(buf, n, &p) < 0)
+        return;
+
+    struct session *s = find_session(srv, p.session);
+    if (!s)
+    {
+        if (p.type == UFTP_CMD)
         {
-            delete_file_from_server(sockfd, filename, clientaddr, clientlen);
+            s = new_session(srv, p.session);
+            learn_path(s, p.path, clientaddr);
+            start_command(s, &p);
+            timer_update(srv, s);
         }
-        else if (strcmp(op, "ls") == 0)
+        return;
+    }
+
+    s->last_heard_us = uftp_now_us();
+    learn_path(s, p.path, clientaddr);
+
+    switch (p.type)
+    {
+    case UFTP_CMD:
+    case UFTP_DATA:
+        // uploads (finished or not) take chunks, so a lost final ACK gets repeated
+        if (s->receiver.session == s->id)
         {
-            ls_to_server(sockfd, clientaddr, clientlen);
+            receiver_on_data(&s->receiver, &p, uftp_now_us(), session_send, s);
+            check_receiver(s);
         }
-        else if (strcmp(op, "exit") == 0)
+        else if (p.type == UFTP_CMD && s->reply_type)
         {
-            exit_operation_to_server(sockfd, clientaddr, sizeof(clientaddr));
-            printf("Exiting from the connection with server \n");
+            uftp_send_text(session_reply, s, s->reply_type, s->id, s->reply);
         }
-        else
+        break;
+
+    case UFTP_ACK:
+        if (s->state == S_SEND)
         {
-            printf("Invalid input requested.");
+            sender_on_ack(&s->sender, &p, uftp_now_us());
+            sched_activate(&srv->sched, &s->flow); // the window has room again
+            check_sender(s);
         }
+        break;
+
+    case UFTP_FAIL:
+        if (s->state == S_SEND || s->state == S_RECV)
+            abort_session(s, "Client aborted the transfer.");
+        break;
     }
+    timer_update(srv, s);
 }
 
-void exit_operation_to_server(int sockfd, struct sockaddr_in clientaddr, int clientlen)
+/* Runs the timers of one session that is due */
+static void service_session(struct server *srv, struct session *s, uint64_t now)
 {
-    int n;
-    
-    printf("Client is done with all operations.\n");
-    
-    char buffer1[100];
-    bzero(buffer1, sizeof(buffer1));
-    
-    strcpy(buffer1, "Goodbye Client. Done with all operations!");
+    if (s->state == S_SEND)
+    {
+        s->retry_us = 0;
+        sender_on_timer(&s->sender, now);
+        sched_activate(&srv->sched, &s->flow); // losses to resend, a probe, or the reader has caught up
+        check_sender(s);
+    }
+    else if (s->state == S_RECV)
+    {
+        receiver_on_timer(&s->receiver, now, session_send, s);
+        if (now - s->last_heard_us > (uint64_t)UFTP_MAX_RETRIES * UFTP_RTO_MAX_US)
+            abort_session(s, "Client stopped sending. File not received successfully.");
+    }
+    else if (s->state == S_WORK)
+    {
+        check_worker(s, now);
+    }
+    else if (now >= s->expires_us)
+    {
+        free_session(srv, s);
+        return;
+    }
+    timer_update(srv, s);
+}
 
-    // sending goodbye message to client
-    n = sendto(sockfd, buffer1, strlen(buffer1), 0,
-               (struct sockaddr *)&clientaddr, clientlen);
+/*
+    Lets senders take their turns (see uftp_sched.h) until none has anything
+    left to send or the link's budget is spent. Each turn is a few chunks,
+    so one session never holds the others up for more than its share.
+*/
+static void run_scheduler(struct server *srv, uint64_t now)
+{
+    struct sched_flow *f;
+    int64_t allow;
 
-    // if (n < 0)
-    //     printf("ERROR in sendto");
+    while ((f = sched_next(&srv->sched, now, &allow)))
+    {
+        struct session *s = (struct session *)((char *)f - offsetof(struct session, flow));
 
-    printf("--------------------------------------------------------------------------------\n");
+        if (!f->active)
+        {
+            timer_update(srv, s); // over its rate cap until f->wake_us
+            continue;
+        }
+        if (allow <= 0)
+        {
+            sched_charge(&srv->sched, f, 0); // still paying off the last turn's overshoot
+            continue;
+        }
+
+        uint64_t before = s->sent_bytes;
+        int sent = sender_pump_max(&s->sender, now, (allow + CHUNKSIZE - 1) / CHUNKSIZE, session_send, s);
+        sched_charge(&srv->sched, f, s->sent_bytes - before);
+        if (!sent)
+        {
+            sched_deactivate(&srv->sched, f);
+            // the reader is behind: come back soon to pick up its chunks
+            if (!s->sender.eof && s->sender.next - s->sender.base < (uint32_t)s->sender.window)
+                s->retry_us = now + 1000;
+        }
+        check_sender(s);
+        timer_update(srv, s);
+    }
 }
 
-void ls_to_server(int sockfd, struct sockaddr_in clientaddr, int clientlen)
+/* Runs the timers that are due, then lets senders fill their windows */
+void service_sessions(struct server *srv, uint64_t now)
 {
-    int n;
-    
-    char buffer[BUFSIZE];
-    bzero(buffer, sizeof(buffer));
+    while (srv->ntimers && srv->timers[0]->due_us <= now)
+        service_session(srv, srv->timers[0], now);
+    run_scheduler(srv, now);
+}
+
+/* How long the event loop may sleep before some session needs attention */
+uint64_t next_wakeup(struct server *srv, uint64_t now)
+{
+    uint64_t wakeup = now + 1000000;
+    uint64_t t = sched_wakeup(&srv->sched, now);
+
+    if (srv->ntimers && srv->timers[0]->due_us < wakeup)
+        wakeup = srv->timers[0]->due_us;
+    if (t < wakeup)
+        wakeup = t;
+    return wakeup > now ? wakeup - now : 0;
+}
+
+/*------------------------------------ operations ------------------------------------*/
+
+void exit_operation_to_server(struct session *s)
+{
+    printf("Client is done with all operations.\n");
 
+    // sending goodbye message to client
+    reply_session(s, UFTP_REPLY, "Goodbye Client. Done with all operations!");
+}
+
+void ls_to_server(struct session *s)
+{
     const char *current_working_dir_path = ".";
     char command[256];
+    char output[64];
 
-    snprintf(command, sizeof(command), "ls %s > ../ls_output.txt", current_working_dir_path);
+    // one listing file per server thread, so busy-poll threads don't clobber each other
+    snprintf(output, sizeof(output), "../ls_output_%d.txt", s->srv->index);
+    snprintf(command, sizeof(command), "ls %s > %s", current_working_dir_path, output);
     printf("Server implementing ls command...\n");
     /* 
         Implementing ls . > ../ls_output.txt using system
@@ -207,256 +1082,506 @@ void ls_to_server(int sockfd, struct sockaddr_in clientaddr, int clientlen)
     */
     system(command);
 
-    FILE *fp;
-
-    fp = fopen("../ls_output.txt", "r");
-
-    if (fp == NULL)
-    {
-        printf("Error while opening ls output file!\n");
-        return;
-    }
+    // the listing is streamed like any file, so it can span many datagrams
+    send_file_with_ack(s, output);
 
-    // sending ls file output to client
-    while (fread(buffer, 1, sizeof(buffer), fp) != NULL)
-    {
-        n = sendto(sockfd, buffer, BUFSIZE, 0,
-                   (struct sockaddr *)&clientaddr, clientlen);
-        if (n < 0)
-            printf("ERROR in sendto");
-    }
-
-    fclose(fp);
-
-    //removing temp file
-    remove("../ls_output.txt");
-    
-    printf("Server implementation of ls command complete.\n");
-    printf("--------------------------------------------------------------------------------\n");
+    //removing temp file (the reader keeps its own handle open)
+    remove(output);
 }
 
 /*
     Sends a message to the client, displaying success or failure
 */
-void delete_file_from_server(int sockfd, char *filename, struct sockaddr_in clientaddr, int clientlen)
+void delete_file_from_server(struct session *s, char *filename)
 {
-    int n;
+    char buffer[UFTP_REPLY_MAX];
+    bzero(buffer, sizeof(buffer));
+
     if (remove(filename) == 0)
     {
         printf("Removed file %s \n", filename);
-        
-        char buffer[100];
-        bzero(buffer, sizeof(buffer));
-        
-        sprintf(buffer, "Delete %s successful!", filename);
-        
-        n = sendto(sockfd, buffer, strlen(buffer), 0,
-                   (struct sockaddr *)&clientaddr, clientlen);
-        // if (n < 0)
-        //     printf("ERROR in sendto");
+        if (store)
+            store_forget(store, filename);
+        format_reply(buffer, sizeof(buffer), "Delete %s successful!", filename);
     }
     else
     {
         printf("Error while delete file. File does not exists.\n");
-        
-        char buffer[100];
-        bzero(buffer, sizeof(buffer));
-        
-        sprintf(buffer, "%s does not exist on server!", filename);
-        
-        n = sendto(sockfd, buffer, strlen(buffer), 0,
-                   (struct sockaddr *)&clientaddr, clientlen);
-        // if (n < 0)
-        //     printf("ERROR in sendto");
+        format_reply(buffer, sizeof(buffer), "%s does not exist on server!", filename);
     }
-    printf("--------------------------------------------------------------------------------\n");
+    reply_session(s, UFTP_REPLY, buffer);
 }
 
-void put_file_to_server(int sockfd, char *filename, struct sockaddr_in *clientaddr, int clientlen)
+/* Files held in the store are listed with their own size, not the placeholder's */
+static off_t recipe_size(const char *path, off_t size)
 {
-    char *name = filename;
-
-    /*  this function is to have RECV TIMEOUT. It helps during packet loss. */
-    struct timeval timeout = set_timeout(sockfd, 2); // 2 seconds timeout
-
-    receive_file_with_ack(sockfd, filename, &clientaddr);
-
-    int n;
-
-    char buffer1[100];
-    bzero(buffer1, sizeof(buffer1));
+    off_t logical;
+    return store_lookup(store, path, NULL, 0, &logical, NULL) ? logical : size;
+}
 
-    sprintf(buffer1, "Put %s successful!", name);
+/*
+    Streams the manifest of every file under dirname (see uftp_sync.h) for
+    sync. It is written to an unlinked temporary file first, like ls.
+*/
+void manifest_to_server(struct session *s, char *dirname)
+{
+    char tmpname[] = "/tmp/uftp_manifest_XXXXXX";
+    int fd = mkstemp(tmpname);
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!fp)
+    {
+        if (fd >= 0)
+            close(fd);
+        reply_session(s, UFTP_FAIL, "Server could not create the manifest.");
+        return;
+    }
 
-    n = sendto(sockfd, buffer1, strlen(buffer1), 0,
-               (struct sockaddr *)&clientaddr, clientlen);
-    // if (n < 0)
-    //     printf("ERROR in sendto");
+    int status = sync_write_manifest(fp, dirname, store ? recipe_size : NULL);
+    fclose(fp);
 
-    /*  this function is to disable RECV TIMEOUT. It helps during packet loss. */
-    disable_timeout(timeout, sockfd);
+    if (status < 0)
+    {
+        char reason[UFTP_REPLY_MAX];
+        format_reply(reason, sizeof(reason), "Cannot read %s on server: %s", dirname, strerror(errno));
+        remove(tmpname);
+        reply_session(s, UFTP_FAIL, reason);
+        return;
+    }
 
-    printf("--------------------------------------------------------------------------------\n");
+    send_file_with_ack(s, tmpname);
+    remove(tmpname); // the reader keeps its own handle open
 }
 
-void get_file_from_server(int sockfd, char *filename, struct sockaddr_in clientaddr, int clientlen)
+/* Worker for hash: reads the whole file */
+static void *hash_work(void *arg)
 {
-    send_file_with_ack(filename, sockfd, &clientaddr);
+    struct session *s = arg;
+    char hex[SHA256_HEX_LEN];
 
-    printf("--------------------------------------------------------------------------------\n");
+    if (sha256_file(s->filename, hex) < 0)
+    {
+        char reason[UFTP_REPLY_MAX];
+        format_reply(reason, sizeof(reason), "Cannot hash %s on server: %s", s->filename, strerror(errno));
+        work_answer(s, UFTP_FAIL, reason);
+        return NULL;
+    }
+    work_answer(s, UFTP_REPLY, hex);
+    return NULL;
 }
 
-void send_file_with_ack(char *filename, int sockfd, struct sockaddr_in *clientaddr)
+/* Answers with the SHA-256 of the file, so sync can tell a touched file from a changed one */
+void hash_file_on_server(struct session *s, char *filename)
 {
-    int MAX_RETRIES = 5; // setting maximum number of tries in case of packet loss
+    char hex[SHA256_HEX_LEN];
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
+    // a recipe already knows the hash of the file it stands for
+    if (store && store_lookup(store, filename, NULL, 0, NULL, hex))
     {
-        printf("Error opening file. File does not exists.\n");
+        reply_session(s, UFTP_REPLY, hex);
+        return;
+    }
+    snprintf(s->filename, sizeof(s->filename), "%s", filename);
+    start_work(s, hash_work);
+}
 
-        int n;
-        // if message is DNE -> The file does not exist on server
-        n = sendto(sockfd, "DNE", 3, 0, (struct sockaddr *)clientaddr, sizeof(*clientaddr));
-        if (n < 0)
-            printf("ERROR in sendto");
+/* Answers with "<size> <mtime in ns>", so a client can show progress of a get */
+void stat_file_on_server(struct session *s, char *filename)
+{
+    struct stat st;
+    char buffer[64];
 
+    if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        char reason[UFTP_REPLY_MAX];
+        format_reply(reason, sizeof(reason), "File %s does not exists on server!", filename);
+        reply_session(s, UFTP_FAIL, reason);
         return;
     }
+    snprintf(buffer, sizeof(buffer), "%lld %lld", (long long)(store ? recipe_size(filename, st.st_size) : st.st_size),
+             (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec);
+    reply_session(s, UFTP_REPLY, buffer);
+}
 
-    char buffer[CHUNKSIZE];
-    bzero(buffer, sizeof(buffer));
+void put_file_to_server(struct session *s, char *filename, struct uftp_pkt *first)
+{
+    // the client hears this in the ACK that completes the upload
+    format_reply(s->reply, sizeof(s->reply), "Put %s successful!", filename);
 
-    socklen_t clientlen = sizeof(*clientaddr);
-    int bytes_read, seq_num = 0;
+    // plain data replaces whatever the store held under this name
+    if (store)
+        store_forget(store, filename);
 
-    struct timeval timeout = set_timeout(sockfd, 2); // 2 seconds timeout
+    receive_file_with_ack(s, filename, first);
+}
 
-    while ((bytes_read = fread(buffer, 1, CHUNKSIZE, fp)) > 0)
-    {
-        /*
-            This is logic for sending packets in chunks. Appending an integer value (sequence number)
-            On server side it would be checked and ACK will be sent
-        */
-        char packet[CHUNKSIZE + sizeof(int)];
-        bzero(packet, sizeof(packet));
+void get_file_from_server(struct session *s, char *filename)
+{
+    send_file_with_ack(s, filename);
+}
 
-        memcpy(packet, &seq_num, sizeof(int));
-        memcpy(packet + sizeof(int), buffer, bytes_read);
+/*
+    Starts streaming the file as a windowed chunk stream (see uftp_proto.c).
+    The first chunk doubles as the answer to the client's command; if the
+    file cannot be opened, the client is told so with a FAIL packet.
+*/
+void send_file_with_ack(struct session *s, char *filename)
+{
+    char recipe_path[PATH_MAX];
+    snprintf(s->filename, sizeof(s->filename), "%s", filename);
 
-        int retries = 0;
-        while (retries < MAX_RETRIES) // Try sending packets MAX_RETRIWS times
+    /* chunks are prefetched by a reader thread so the disk never stalls the send loop */
+    if (store && store_lookup(store, filename, recipe_path, sizeof(recipe_path), NULL, NULL))
+        s->ra = store_ra_open(store, recipe_path, s->range_offset, s->range_length,
+                              readahead_depth); // reassembled from the chunk store
+    else
+        s->ra = ra_open_range(filename, s->range_offset, s->range_length, readahead_depth, readahead_direct);
+    if (!s->ra)
+    {
+        char reason[UFTP_REPLY_MAX];
+        if (errno == ERANGE)
         {
-            if (sendto(sockfd, packet, bytes_read + sizeof(int), 0,
-                       (struct sockaddr *)clientaddr, clientlen) == -1)
-            {
-                // printf("sendto failed");
-            }
-
-            else
-            {
-                char ack[16];
-                bzero(ack, sizeof(ack));
-
-                /*  receive ACK from server.
-                    if its the same as current sequence number,
-                    then move to the next chunk
-                */
-                if (recvfrom(sockfd, ack, sizeof(ack), 0, (struct sockaddr *)clientaddr, &clientlen) > 0)
-                {
-                    if (atoi(ack) == seq_num)
-                        break;
-                }
-
-                printf("Retrying sequence no. %d... Remaining tries (%d/%d)\n", seq_num, retries + 1, MAX_RETRIES);
-                retries++;
-            }
+            printf("Range %lld+%lld is outside of %s.\n", (long long)s->range_offset, (long long)s->range_length,
+                   filename);
+            format_reply(reason, sizeof(reason), "Range outside of file %s!", filename);
         }
-
-        if (retries == MAX_RETRIES)
+        else
         {
-            printf("Max retries reached for chunk %d. Aborting...\n", seq_num);
-            sendto(sockfd, "FAIL", 4, 0, (struct sockaddr *)clientaddr, clientlen);
-            fclose(fp);
+            printf("Error opening file. File does not exists.\n");
+            format_reply(reason, sizeof(reason), "File %s does not exists on server!", filename);
         }
+        reply_session(s, UFTP_FAIL, reason);
+        return;
+    }
 
-        seq_num++;
+    sender_init(&s->sender, s->ra, s->id, NULL);
+    s->state = S_SEND;
+    for (int i = 0; i < UFTP_MAX_PATHS; i++)
+    {
+        if (s->path_addr[i].sin_family)
+            sender_add_path(&s->sender, i);
     }
+    // the first chunk goes out on the session's first turn, right after this batch of packets
+    sched_flow_init(&s->srv->sched, &s->flow, s->addr.sin_addr.s_addr, s->ra->size - s->ra->start);
+    sched_activate(&s->srv->sched, &s->flow);
+}
 
-    disable_timeout(timeout, sockfd);
+/*
+    Starts receiving the file with acknowledgement; `first` is the CMD that
+    opened the session, which already carries chunk 0.
+*/
+int receive_file_with_ack(struct session *s, char *filename, struct uftp_pkt *first)
+{
+    snprintf(s->filename, sizeof(s->filename), "%s", filename);
 
-    // Sending EOF messgage to indicate end of file
-    sendto(sockfd, "EOF", 3, 0, (struct sockaddr *)clientaddr, clientlen);
-    fclose(fp);
+    // sync uploads whole trees, so missing directories are created on the way
+    sync_make_parents(filename);
+    s->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (s->fd < 0)
+    {
+        printf("Error creating file %s\n", filename);
+        reply_session(s, UFTP_FAIL, "Server could not create the file.");
+        return UFTP_ERR_IO;
+    }
 
-    printf("File sent successfully.\n");
+    receiver_init(&s->receiver, s->fd, s->id, s->reply);
+    s->state = S_RECV;
+    receiver_on_data(&s->receiver, first, uftp_now_us(), session_send, s);
+    check_receiver(s);
+    return UFTP_OK;
 }
 
+/*------------------------------------ deduplicated uploads ------------------------------------*/
+
 /*
-    Function to carry out receive file contents with acknowledgement
-    Handles packet loss
+    A deduplicated upload (client option -D) takes four steps, all tied
+    together by a token the client picks:
+      dedup-recipe  the client streams the file's recipe (see uftp_store.h)
+      dedup-missing the server streams back the indices of chunks it lacks
+      dedup-fill    the client streams just those chunks, back to back
+      dedup-commit  the server checks and stores them and installs the recipe
+    Everything in between lives in the store's pending directory.
 */
-void receive_file_with_ack(int sockfd, char *filename, struct sockaddr_in *clientaddr)
+static int pending_path(char *path, size_t len, const char *token, const char *ext)
 {
-    FILE *fp = fopen(filename, "w");
+    int n = snprintf(path, len, "%s/pending/%s.%s", store->dir, token, ext);
+    if (n < 0 || (size_t)n >= len)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
 
-    char buffer[CHUNKSIZE + sizeof(int)];
-    socklen_t clientlen = sizeof(*clientaddr);
-    int expected_seq = 0;
+static int compare_chunk_hash(const void *a, const void *b, void *arg)
+{
+    const struct recipe *r = arg;
+    int ia = *(const int *)a, ib = *(const int *)b;
+    int cmp = strcmp(r->chunks[ia].hash, r->chunks[ib].hash);
+    return cmp ? cmp : ia - ib;
+}
 
-    while (1)
+void dedup_recipe_to_server(struct session *s, char *token, struct uftp_pkt *first)
+{
+    char path[PATH_MAX];
+    if (pending_path(path, sizeof(path), token, "recipe") < 0)
+    {
+        reply_session(s, UFTP_FAIL, "The chunk store's path is too long for this upload.");
+        return;
+    }
+
+    snprintf(s->reply, sizeof(s->reply), "Recipe %s received.", token);
+    receive_file_with_ack(s, path, first);
+}
+
+/* Lists every chunk of the pending recipe that the store lacks, each one once */
+void dedup_missing_to_server(struct session *s, char *token)
+{
+    char path[PATH_MAX], missing[PATH_MAX];
+    struct recipe r;
+
+    if (pending_path(path, sizeof(path), token, "recipe") < 0 ||
+        pending_path(missing, sizeof(missing), token, "missing") < 0)
+    {
+        reply_session(s, UFTP_FAIL, "The chunk store's path is too long for this upload.");
+        return;
+    }
+
+    FILE *fp = fopen(path, "r");
+    if (!fp || recipe_read(fp, &r) < 0)
     {
-        int bytes_received = recvfrom(sockfd, buffer, sizeof(buffer), 0,
-                                      (struct sockaddr *)clientaddr, &clientlen);
-        if (bytes_received < 0)
-            printf("recvfrom failed\n");
+        if (fp)
+            fclose(fp);
+        reply_session(s, UFTP_FAIL, "No valid recipe for this upload.");
+        return;
+    }
+    fclose(fp);
 
-        // if message is EOF -> indicates end of file that is being sent
-        if (strncmp(buffer, "EOF", 3) == 0)
+    // sorted by hash, repeats of a chunk are next to each other and only the first is asked for
+    int *order = malloc((r.count + 1) * sizeof(*order));
+    char *need = calloc(r.count + 1, 1);
+    for (int i = 0; i < r.count; i++)
+        order[i] = i;
+    qsort_r(order, r.count, sizeof(*order), compare_chunk_hash, &r);
+    for (int i = 0; i < r.count; i++)
+    {
+        if (i > 0 && strcmp(r.chunks[order[i]].hash, r.chunks[order[i - 1]].hash) == 0)
+            continue;
+        need[order[i]] = !store_has(store, r.chunks[order[i]].hash);
+    }
+
+    fp = fopen(missing, "w");
+    if (fp)
+    {
+        for (int i = 0; i < r.count; i++)
         {
-            printf("File received successfully.\n");
-            break;
+            if (need[i])
+                fprintf(fp, "%d\n", i);
+        }
+        fclose(fp);
+    }
+    free(order);
+    free(need);
+    recipe_free(&r);
+
+    if (!fp)
+    {
+        reply_session(s, UFTP_FAIL, "Server could not list the missing chunks.");
+        return;
+    }
+    send_file_with_ack(s, missing);
+}
+
+void dedup_fill_to_server(struct session *s, char *token, struct uftp_pkt *first)
+{
+    char path[PATH_MAX];
+    if (pending_path(path, sizeof(path), token, "data") < 0)
+    {
+        reply_session(s, UFTP_FAIL, "The chunk store's path is too long for this upload.");
+        return;
+    }
+
+    snprintf(s->reply, sizeof(s->reply), "Chunks for %s received.", token);
+    receive_file_with_ack(s, path, first);
+}
+
+/* Verifies and stores the uploaded chunks; returns the bytes taken from the fill, or -1 */
+static off_t store_fill(struct recipe *r, FILE *missing, FILE *data, char *reason, size_t len)
+{
+    char *buf = malloc(CDC_MAX_SIZE);
+    off_t stored = 0;
+    int i;
+
+    while (fscanf(missing, "%d", &i) == 1)
+    {
+        if (i < 0 || i >= r->count || !data || fread(buf, 1, r->chunks[i].len, data) != (size_t)r->chunks[i].len)
+        {
+            snprintf(reason, len, "Upload is missing chunk %d.", i);
+            free(buf);
+            return -1;
         }
 
-        // if message is FAIL -> indicates file was not saved on server successfully
-        if (strncmp(buffer, "FAIL", 4) == 0)
+        struct sha256_ctx c;
+        uint8_t digest[SHA256_LEN];
+        char hex[SHA256_HEX_LEN];
+        sha256_init(&c);
+        sha256_update(&c, buf, r->chunks[i].len);
+        sha256_final(&c, digest);
+        sha256_hex(digest, hex);
+
+        if (strcmp(hex, r->chunks[i].hash) != 0)
+        {
+            snprintf(reason, len, "Chunk %d does not match its hash.", i);
+            free(buf);
+            return -1;
+        }
+        if (store_put(store, hex, buf, r->chunks[i].len) < 0)
         {
-            printf("File not received successfully. Please try again.\n");
+            snprintf(reason, len, "Server could not store chunk %d: %s", i, strerror(errno));
+            free(buf);
+            return -1;
+        }
+        stored += r->chunks[i].len;
+    }
+    free(buf);
+    return stored;
+}
 
-            char buffer1[100];
-            bzero(buffer1, sizeof(buffer1));
+/* Worker for dedup-commit: stores the chunks, then reads the whole file back to check it */
+static void *dedup_commit_work(void *arg)
+{
+    struct session *s = arg;
+    char *token = s->token, *filename = s->filename;
+    char recipe_path[PATH_MAX], missing_path[PATH_MAX], data_path[PATH_MAX];
+    char reason[UFTP_REPLY_MAX];
+    struct recipe r;
+
+    if (pending_path(recipe_path, sizeof(recipe_path), token, "recipe") < 0 ||
+        pending_path(missing_path, sizeof(missing_path), token, "missing") < 0 ||
+        pending_path(data_path, sizeof(data_path), token, "data") < 0)
+    {
+        work_answer(s, UFTP_FAIL, "The chunk store's path is too long for this upload.");
+        return NULL;
+    }
 
-            sprintf(buffer1, "Put %s not successful!", filename);
+    FILE *fp = fopen(recipe_path, "r");
+    FILE *missing = fopen(missing_path, "r");
+    if (!fp || !missing || recipe_read(fp, &r) < 0)
+    {
+        if (fp)
+            fclose(fp);
+        if (missing)
+            fclose(missing);
+        work_answer(s, UFTP_FAIL, "No valid recipe for this upload.");
+        return NULL;
+    }
+    fclose(fp);
 
-            int n;
-            n = sendto(sockfd, buffer1, strlen(buffer1), 0,
-                       (struct sockaddr *)&clientaddr, clientlen);
-            // if (n < 0)
-            //     printf("ERROR in sendto");
+    FILE *data = fopen(data_path, "r"); // absent when every chunk was already stored
+    off_t sent = store_fill(&r, missing, data, reason, sizeof(reason));
+    fclose(missing);
+    if (data)
+        fclose(data);
 
-            remove(filename); // remove file created since content is wrong or empty
-            break;
+    for (int i = 0; sent >= 0 && i < r.count; i++)
+    {
+        if (!store_has(store, r.chunks[i].hash))
+        {
+            format_reply(reason, sizeof(reason), "Chunk %d never arrived.", i);
+            sent = -1;
+        }
+    }
+
+    // every chunk matches its own hash, but only the assembled file can vouch for the recipe's
+    char hex[SHA256_HEX_LEN];
+    if (sent >= 0 && store_hash(store, &r, hex) < 0)
+    {
+        format_reply(reason, sizeof(reason), "Server could not read back %s: %s", filename, strerror(errno));
+        sent = -1;
+    }
+    else if (sent >= 0 && strcmp(hex, r.hash) != 0)
+    {
+        format_reply(reason, sizeof(reason), "The chunks of %s do not add up to its hash.", filename);
+        sent = -1;
+    }
+
+    // the recipe goes into the store and an empty placeholder takes the file's place,
+    // both written aside first so the old file survives a failure
+    char stored[PATH_MAX], stored_part[PATH_MAX + 16], part[PATH_MAX + 16];
+    snprintf(part, sizeof(part), "%s.uftp-part", filename);
+    if (sent >= 0 && store_recipe_path(store, filename, stored, sizeof(stored)) < 0)
+    {
+        format_reply(reason, sizeof(reason), "Path %s is too long for the store.", filename);
+        sent = -1;
+    }
+    if (sent >= 0)
+    {
+        snprintf(stored_part, sizeof(stored_part), "%s.uftp-part", stored);
+        sync_make_parents(stored_part);
+        fp = fopen(stored_part, "w");
+        if (!fp || recipe_write(fp, &r) < 0)
+        {
+            format_reply(reason, sizeof(reason), "Server could not store the recipe of %s: %s", filename, strerror(errno));
+            sent = -1;
+        }
+        if (fp && fclose(fp) != 0 && sent >= 0)
+        {
+            format_reply(reason, sizeof(reason), "Server could not store the recipe of %s: %s", filename, strerror(errno));
+            sent = -1;
         }
 
-        int received_seq;
-        memcpy(&received_seq, buffer, sizeof(int));
-        // printf("Received seq %d/%d\n", received_seq, expected_seq);
+        sync_make_parents(part);
+        int fd = sent >= 0 ? open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+        if (fd < 0 && sent >= 0)
+        {
+            format_reply(reason, sizeof(reason), "Server could not write %s: %s", filename, strerror(errno));
+            sent = -1;
+        }
+        if (fd >= 0)
+        {
+            if (s->mtime_ns)
+            {
+                struct timespec times[2] = {{0, UTIME_NOW},
+                                            {s->mtime_ns / 1000000000, s->mtime_ns % 1000000000}};
+                futimens(fd, times);
+            }
+            close(fd);
+        }
 
-        // checking if sequence number is correct or packet loss occured
-        if (received_seq == expected_seq)
+        if (sent >= 0 && (rename(stored_part, stored) < 0 || rename(part, filename) < 0))
         {
-            // saving content into file, if there is no packet loss
-            fwrite(buffer + sizeof(int), 1, bytes_received - sizeof(int), fp);
-            expected_seq++;
+            format_reply(reason, sizeof(reason), "Server could not write %s: %s", filename, strerror(errno));
+            sent = -1;
         }
+        if (sent < 0)
+        {
+            remove(stored_part);
+            remove(part);
+        }
+    }
 
-        char ack[16];
-        bzero(ack, sizeof(ack));
+    remove(recipe_path);
+    remove(missing_path);
+    remove(data_path);
 
-        // sending back ACK = received sequence number
-        sprintf(ack, "%d", received_seq);
-        sendto(sockfd, ack, strlen(ack), 0, (struct sockaddr *)clientaddr, clientlen);
+    if (sent < 0)
+    {
+        printf("Deduplicated upload of %s failed: %s\n", filename, reason);
+        recipe_free(&r);
+        work_answer(s, UFTP_FAIL, reason);
+        return NULL;
     }
 
-    fclose(fp);
+    printf("Stored %s: %lld new bytes of %lld.\n", filename, (long long)sent, (long long)r.size);
+    format_reply(reason, sizeof(reason), "Put %s successful! %lld of %lld bytes were new, the rest was already on the server.",
+             filename, (long long)sent, (long long)r.size);
+    recipe_free(&r);
+    work_answer(s, UFTP_REPLY, reason);
+    return NULL;
+}
+
+void dedup_commit_on_server(struct session *s, char *token, char *filename)
+{
+    snprintf(s->token, sizeof(s->token), "%s", token);
+    snprintf(s->filename, sizeof(s->filename), "%s", filename);
+    start_work(s, dedup_commit_work);
 }
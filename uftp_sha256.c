@@ -0,0 +1,157 @@
+/*
+ * uftp_sha256.c - SHA-256 (FIPS 180-4) for comparing file contents
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "uftp_sha256.h"
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void compress(uint32_t state[8], const uint8_t block[64])
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0], b = state[1], c = state[2], d = state[3];
+    e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g, g = f, f = e, e = d + t1;
+        d = c, c = b, b = a, a = t1 + t2;
+    }
+
+    state[0] += a, state[1] += b, state[2] += c, state[3] += d;
+    state[4] += e, state[5] += f, state[6] += g, state[7] += h;
+}
+
+void sha256_init(struct sha256_ctx *c)
+{
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(c->state, iv, sizeof(iv));
+    c->bytes = 0;
+    c->fill = 0;
+}
+
+void sha256_update(struct sha256_ctx *c, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    c->bytes += len;
+    if (c->fill)
+    {
+        size_t take = 64 - c->fill < len ? 64 - c->fill : len;
+        memcpy(c->block + c->fill, p, take);
+        c->fill += take;
+        p += take;
+        len -= take;
+        if (c->fill < 64)
+            return;
+        compress(c->state, c->block);
+        c->fill = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        compress(c->state, p);
+    memcpy(c->block, p, len);
+    c->fill = len;
+}
+
+void sha256_final(struct sha256_ctx *c, uint8_t digest[SHA256_LEN])
+{
+    uint64_t bits = c->bytes * 8;
+
+    c->block[c->fill++] = 0x80;
+    if (c->fill > 56)
+    {
+        memset(c->block + c->fill, 0, 64 - c->fill);
+        compress(c->state, c->block);
+        c->fill = 0;
+    }
+    memset(c->block + c->fill, 0, 56 - c->fill);
+    for (int i = 0; i < 8; i++)
+        c->block[56 + i] = bits >> (56 - 8 * i);
+    compress(c->state, c->block);
+
+    for (int i = 0; i < 8; i++)
+    {
+        digest[4 * i] = c->state[i] >> 24;
+        digest[4 * i + 1] = c->state[i] >> 16;
+        digest[4 * i + 2] = c->state[i] >> 8;
+        digest[4 * i + 3] = c->state[i];
+    }
+}
+
+void sha256_hex(const uint8_t digest[SHA256_LEN], char hex[SHA256_HEX_LEN])
+{
+    for (int i = 0; i < SHA256_LEN; i++)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+/* Tells whether s is a hex digest as sha256_hex writes it: 64 lowercase hex digits */
+int sha256_is_hex(const char *s)
+{
+    if (strlen(s) != SHA256_HEX_LEN - 1)
+        return 0;
+    return strspn(s, "0123456789abcdef") == SHA256_HEX_LEN - 1;
+}
+
+/* Hashes the whole file into a hex digest; returns -1 (errno set) if it can't be read */
+int sha256_file(const char *filename, char hex[SHA256_HEX_LEN])
+{
+    struct sha256_ctx c;
+    uint8_t digest[SHA256_LEN];
+    char buf[1 << 16];
+    ssize_t n;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    sha256_init(&c);
+    while ((n = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        sha256_update(&c, buf, n);
+    }
+    close(fd);
+
+    sha256_final(&c, digest);
+    sha256_hex(digest, hex);
+    return 0;
+}
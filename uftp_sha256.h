@@ -0,0 +1,28 @@
+/*
+ * uftp_sha256.h - SHA-256 (FIPS 180-4) for comparing file contents
+ */
+#ifndef UFTP_SHA256_H
+#define UFTP_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+#define SHA256_HEX_LEN (2 * SHA256_LEN + 1) /* hex digest plus NUL */
+
+struct sha256_ctx
+{
+    uint32_t state[8];
+    uint64_t bytes; /* total length hashed so far */
+    uint8_t block[64];
+    size_t fill; /* bytes waiting in block */
+};
+
+void sha256_init(struct sha256_ctx *c);
+void sha256_update(struct sha256_ctx *c, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *c, uint8_t digest[SHA256_LEN]);
+void sha256_hex(const uint8_t digest[SHA256_LEN], char hex[SHA256_HEX_LEN]);
+int sha256_is_hex(const char *s);
+int sha256_file(const char *filename, char hex[SHA256_HEX_LEN]);
+
+#endif
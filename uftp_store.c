@@ -0,0 +1,483 @@
+/*
+ * uftp_store.c - content-addressed chunk store for deduplicated uploads
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "uftp_cdc.h"
+#include "uftp_store.h"
+
+#define RECIPE_READ_BUF (4 << 20) /* file data chunked per read in recipe_from_file */
+
+static void add_chunk(struct recipe *r, int *cap, const uint8_t *data, int len, off_t offset)
+{
+    struct sha256_ctx c;
+    uint8_t digest[SHA256_LEN];
+
+    if (r->count == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 64;
+        r->chunks = realloc(r->chunks, *cap * sizeof(*r->chunks));
+    }
+
+    sha256_init(&c);
+    sha256_update(&c, data, len);
+    sha256_final(&c, digest);
+
+    struct recipe_chunk *ch = &r->chunks[r->count++];
+    sha256_hex(digest, ch->hash);
+    ch->len = len;
+    ch->offset = offset;
+}
+
+/*
+    Cuts the file into content-defined chunks and hashes each of them and
+    the whole file. Returns -1 (errno set) if the file cannot be read.
+*/
+int recipe_from_file(const char *filename, struct recipe *r)
+{
+    struct sha256_ctx whole;
+    uint8_t digest[SHA256_LEN];
+    int cap = 0, eof = 0;
+    size_t fill = 0;
+    off_t offset = 0;
+
+    memset(r, 0, sizeof(*r));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint8_t *buf = malloc(RECIPE_READ_BUF);
+    sha256_init(&whole);
+
+    while (1)
+    {
+        while (!eof && fill < RECIPE_READ_BUF)
+        {
+            ssize_t n = read(fd, buf + fill, RECIPE_READ_BUF - fill);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                int saved = errno;
+                free(buf);
+                close(fd);
+                recipe_free(r);
+                errno = saved;
+                return -1;
+            }
+            if (n == 0)
+                eof = 1;
+            fill += n;
+        }
+
+        // a cut needs CDC_MAX_SIZE bytes of look-ahead, except at the end of the file
+        size_t pos = 0;
+        while (pos < fill && (eof || fill - pos >= CDC_MAX_SIZE))
+        {
+            size_t cut = cdc_next_cut(buf + pos, fill - pos);
+            add_chunk(r, &cap, buf + pos, cut, offset + pos);
+            sha256_update(&whole, buf + pos, cut);
+            pos += cut;
+        }
+
+        memmove(buf, buf + pos, fill - pos);
+        fill -= pos;
+        offset += pos;
+        if (eof && fill == 0)
+            break;
+    }
+
+    free(buf);
+    close(fd);
+
+    r->size = offset;
+    sha256_final(&whole, digest);
+    sha256_hex(digest, r->hash);
+    return 0;
+}
+
+int recipe_write(FILE *fp, const struct recipe *r)
+{
+    fprintf(fp, "%s %lld %s\n", RECIPE_MAGIC, (long long)r->size, r->hash);
+    for (int i = 0; i < r->count; i++)
+        fprintf(fp, "%s %d\n", r->chunks[i].hash, r->chunks[i].len);
+    return ferror(fp) ? -1 : 0;
+}
+
+/*
+    Parses a recipe, checking that every line is well formed and that the
+    chunk lengths add up to the file size. Returns -1 (errno EINVAL) if not.
+*/
+int recipe_read(FILE *fp, struct recipe *r)
+{
+    char line[256];
+    long long size;
+    int cap = 0;
+
+    memset(r, 0, sizeof(*r));
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, RECIPE_MAGIC " ", strlen(RECIPE_MAGIC) + 1) != 0 ||
+        sscanf(line + strlen(RECIPE_MAGIC), "%lld %64s", &size, r->hash) != 2 || !sha256_is_hex(r->hash) || size < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    r->size = size;
+
+    off_t offset = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        char hash[SHA256_HEX_LEN];
+        int len;
+
+        if (sscanf(line, "%64s %d", hash, &len) != 2 || !sha256_is_hex(hash) || len <= 0 || len > CDC_MAX_SIZE)
+            break;
+        if (r->count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            r->chunks = realloc(r->chunks, cap * sizeof(*r->chunks));
+        }
+        struct recipe_chunk *ch = &r->chunks[r->count++];
+        memcpy(ch->hash, hash, SHA256_HEX_LEN);
+        ch->len = len;
+        ch->offset = offset;
+        offset += len;
+    }
+
+    if (offset != r->size || !feof(fp))
+    {
+        recipe_free(r);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Reads the header of the recipe at path: the size and hash of the file it
+    stands for. Returns 1 for a recipe, 0 for anything else, -1 if it cannot
+    be read.
+*/
+int recipe_probe(const char *path, off_t *size, char hash[SHA256_HEX_LEN])
+{
+    char line[256];
+    long long sz;
+    char h[SHA256_HEX_LEN];
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    int is_recipe = fgets(line, sizeof(line), fp) &&
+                    strncmp(line, RECIPE_MAGIC " ", strlen(RECIPE_MAGIC) + 1) == 0 &&
+                    sscanf(line + strlen(RECIPE_MAGIC), "%lld %64s", &sz, h) == 2 && sha256_is_hex(h);
+    fclose(fp);
+
+    if (is_recipe)
+    {
+        if (size)
+            *size = sz;
+        if (hash)
+            memcpy(hash, h, SHA256_HEX_LEN);
+    }
+    return is_recipe;
+}
+
+void recipe_free(struct recipe *r)
+{
+    free(r->chunks);
+    r->chunks = NULL;
+    r->count = 0;
+}
+
+/*------------------------------------ chunk store ------------------------------------*/
+
+/* Checks the snprintf result n for a path: -1 (errno ENAMETOOLONG) if it was cut short */
+static int path_fits(int n, size_t len)
+{
+    if (n >= 0 && (size_t)n < len)
+        return 0;
+    errno = ENAMETOOLONG;
+    return -1;
+}
+
+static int chunk_path(struct store *st, const char *hash, char *path, size_t len)
+{
+    return path_fits(snprintf(path, len, "%s/chunks/%.2s/%s", st->dir, hash, hash), len);
+}
+
+/* Creates the store's directories under dir; returns -1 (errno set) on failure */
+int store_open(struct store *st, const char *dir)
+{
+    char path[PATH_MAX];
+
+    if (path_fits(snprintf(st->dir, sizeof(st->dir), "%s", dir), sizeof(st->dir)) < 0)
+        return -1;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+    if (path_fits(snprintf(path, sizeof(path), "%s/chunks", dir), sizeof(path)) < 0 ||
+        (mkdir(path, 0755) < 0 && errno != EEXIST))
+        return -1;
+    if (path_fits(snprintf(path, sizeof(path), "%s/pending", dir), sizeof(path)) < 0 ||
+        (mkdir(path, 0755) < 0 && errno != EEXIST))
+        return -1;
+    if (path_fits(snprintf(path, sizeof(path), "%s/recipes", dir), sizeof(path)) < 0 ||
+        (mkdir(path, 0755) < 0 && errno != EEXIST))
+        return -1;
+    return 0;
+}
+
+/*
+    Names the recipe for the served file `file`: dir/recipes/<file>, with
+    empty and "." components dropped so "./a//b" and "a/b" are one file.
+    Returns -1 for a path that is absolute or climbs out with ".." (errno
+    EINVAL), or that does not fit in len (ENAMETOOLONG).
+*/
+int store_recipe_path(struct store *st, const char *file, char *path, size_t len)
+{
+    size_t n = snprintf(path, len, "%s/recipes", st->dir);
+
+    if (file[0] == '/')
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (const char *p = file; *p && n < len;)
+    {
+        size_t seg = strcspn(p, "/");
+        if (seg == 2 && p[0] == '.' && p[1] == '.')
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        if (seg && !(seg == 1 && p[0] == '.'))
+            n += snprintf(path + n, len - n, "/%.*s", (int)seg, p);
+        p += seg;
+        p += strspn(p, "/");
+    }
+    return path_fits(n < len ? (int)n : -1, len);
+}
+
+/*
+    Tells whether the served file is held in the store. Its recipe lives
+    under dir/recipes, never in the file itself, and the file is an empty
+    placeholder carrying the name and modification time; a placeholder that
+    has been written to since is plain data again. For a stored file the
+    recipe's path (if recipe_path is not NULL), size and hash are returned.
+    Returns 1 for a stored file, 0 for anything else.
+*/
+int store_lookup(struct store *st, const char *file, char *recipe_path, size_t len, off_t *size,
+                 char hash[SHA256_HEX_LEN])
+{
+    char path[PATH_MAX];
+    struct stat sb;
+
+    if (store_recipe_path(st, file, path, sizeof(path)) < 0)
+        return 0;
+    if (stat(file, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_size != 0)
+        return 0;
+    if (recipe_probe(path, size, hash) != 1)
+        return 0;
+    if (recipe_path)
+        snprintf(recipe_path, len, "%s", path);
+    return 1;
+}
+
+/* Drops the recipe of a served file that is being replaced or deleted */
+void store_forget(struct store *st, const char *file)
+{
+    char path[PATH_MAX];
+
+    if (store_recipe_path(st, file, path, sizeof(path)) == 0)
+        unlink(path);
+}
+
+int store_has(struct store *st, const char *hash)
+{
+    char path[PATH_MAX];
+    return chunk_path(st, hash, path, sizeof(path)) == 0 && access(path, F_OK) == 0;
+}
+
+/*
+    Stores a chunk under its hash. It is written to a temporary name and
+    renamed into place, so a chunk that exists is always complete.
+*/
+int store_put(struct store *st, const char *hash, const char *data, int len)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+
+    if (store_has(st, hash))
+        return 0;
+
+    if (path_fits(snprintf(path, sizeof(path), "%s/chunks/%.2s", st->dir, hash), sizeof(path)) < 0)
+        return -1;
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        return -1;
+
+    if (chunk_path(st, hash, path, sizeof(path)) < 0)
+        return -1;
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path); // tmp has room for the suffix
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return -1;
+
+    int done = 0;
+    while (done < len)
+    {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        done += n;
+    }
+    if (close(fd) < 0 || done < len || rename(tmp, path) < 0)
+    {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+/* reads a file back from its chunks, in recipe order */
+struct store_reader
+{
+    struct store *st;
+    struct recipe r;
+    int next; /* next chunk to open */
+    int fd;   /* chunk being read, -1 between chunks */
+    int left; /* bytes still to read from it */
+};
+
+static int store_read(void *ctx, char *buf, int want)
+{
+    struct store_reader *rd = ctx;
+
+    while (rd->fd < 0 || rd->left == 0)
+    {
+        if (rd->fd >= 0)
+            close(rd->fd);
+        rd->fd = -1;
+        if (rd->next == rd->r.count)
+            return 0;
+
+        char path[PATH_MAX];
+        if (chunk_path(rd->st, rd->r.chunks[rd->next].hash, path, sizeof(path)) < 0)
+            return -1;
+        rd->fd = open(path, O_RDONLY);
+        if (rd->fd < 0)
+            return -1;
+        rd->left = rd->r.chunks[rd->next].len;
+        rd->next++;
+    }
+
+    ssize_t n;
+    do
+        n = read(rd->fd, buf, want < rd->left ? want : rd->left);
+    while (n < 0 && errno == EINTR);
+
+    if (n == 0)
+    {
+        errno = EIO; // the chunk is shorter than the recipe says
+        return -1;
+    }
+    if (n > 0)
+        rd->left -= n;
+    return n;
+}
+
+static void store_reader_close(void *ctx)
+{
+    struct store_reader *rd = ctx;
+
+    if (rd->fd >= 0)
+        close(rd->fd);
+    recipe_free(&rd->r);
+    free(rd);
+}
+
+/*
+    Opens a read-ahead ring that streams `length` bytes from `offset` on
+    (negative: to the end) of the file a recipe stands for, reassembled from
+    the store. Returns NULL (errno set) on failure, ERANGE for an offset
+    past the end.
+*/
+struct readahead *store_ra_open(struct store *st, const char *recipe_path, off_t offset, off_t length, int depth)
+{
+    FILE *fp = fopen(recipe_path, "r");
+    if (!fp)
+        return NULL;
+
+    struct store_reader *rd = calloc(1, sizeof(*rd));
+    rd->st = st;
+    rd->fd = -1;
+    int status = recipe_read(fp, &rd->r);
+    fclose(fp);
+    if (status < 0)
+    {
+        free(rd);
+        return NULL;
+    }
+    if (offset < 0 || offset > rd->r.size)
+    {
+        store_reader_close(rd);
+        errno = ERANGE;
+        return NULL;
+    }
+
+    // skip whole chunks before the offset, then seek into the one holding it
+    off_t skip = offset;
+    while (rd->next < rd->r.count && skip >= rd->r.chunks[rd->next].len)
+        skip -= rd->r.chunks[rd->next++].len;
+    if (skip > 0)
+    {
+        char path[PATH_MAX];
+        if (chunk_path(st, rd->r.chunks[rd->next].hash, path, sizeof(path)) == 0)
+            rd->fd = open(path, O_RDONLY);
+        if (rd->fd < 0 || lseek(rd->fd, skip, SEEK_SET) < 0)
+        {
+            store_reader_close(rd);
+            return NULL;
+        }
+        rd->left = rd->r.chunks[rd->next].len - skip;
+        rd->next++;
+    }
+
+    off_t size = rd->r.size - offset;
+    if (length >= 0 && length < size)
+        size = length;
+    return ra_open_source(size, depth, store_read, store_reader_close, rd);
+}
+
+/*
+    Computes the SHA-256 of the file a recipe stands for by reading its
+    chunks back from the store, so the hash the recipe claims can be
+    checked. Returns -1 (errno set) if a chunk is missing or short.
+*/
+int store_hash(struct store *st, const struct recipe *r, char hex[SHA256_HEX_LEN])
+{
+    struct store_reader rd = {.st = st, .r = *r, .fd = -1};
+    struct sha256_ctx c;
+    uint8_t digest[SHA256_LEN];
+    char buf[1 << 16];
+    int n;
+
+    sha256_init(&c);
+    while ((n = store_read(&rd, buf, sizeof(buf))) > 0)
+        sha256_update(&c, buf, n);
+    if (rd.fd >= 0)
+        close(rd.fd);
+    if (n < 0)
+        return -1;
+
+    sha256_final(&c, digest);
+    sha256_hex(digest, hex);
+    return 0;
+}
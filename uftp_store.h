@@ -0,0 +1,67 @@
+/*
+ * uftp_store.h - content-addressed chunk store for deduplicated uploads
+ *
+ * With a store enabled, the server keeps every distinct chunk (cut by
+ * FastCDC, see uftp_cdc.h) once under its SHA-256, and a deduplicated
+ * upload becomes a recipe: a small text file listing the chunks it is made
+ * of. Recipes are kept in the store (dir/recipes/<path>), apart from the
+ * files being served, which hold an empty placeholder; so no uploaded data
+ * is ever mistaken for a recipe.
+ *
+ *     UFTP-RECIPE 1 <size> <sha256 of the whole file>
+ *     <sha256 of chunk 0> <length>
+ *     <sha256 of chunk 1> <length>
+ *     ...
+ *
+ * The client builds the same recipe from its copy and sends that first;
+ * only the chunks the server does not have yet travel over the network.
+ */
+#ifndef UFTP_STORE_H
+#define UFTP_STORE_H
+
+#include <stdio.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include "uftp_readahead.h"
+#include "uftp_sha256.h"
+
+#define RECIPE_MAGIC "UFTP-RECIPE 1"
+
+struct recipe_chunk
+{
+    char hash[SHA256_HEX_LEN];
+    int len;
+    off_t offset; /* position in the file */
+};
+
+struct recipe
+{
+    off_t size;
+    char hash[SHA256_HEX_LEN]; /* of the whole file */
+    int count;
+    struct recipe_chunk *chunks;
+};
+
+struct store
+{
+    char dir[PATH_MAX]; /* chunks live in dir/chunks/<first two hex digits>/<hash>, recipes in dir/recipes */
+};
+
+int recipe_from_file(const char *filename, struct recipe *r);
+int recipe_write(FILE *fp, const struct recipe *r);
+int recipe_read(FILE *fp, struct recipe *r);
+int recipe_probe(const char *path, off_t *size, char hash[SHA256_HEX_LEN]);
+void recipe_free(struct recipe *r);
+
+int store_open(struct store *st, const char *dir);
+int store_has(struct store *st, const char *hash);
+int store_put(struct store *st, const char *hash, const char *data, int len);
+int store_recipe_path(struct store *st, const char *file, char *path, size_t len);
+int store_lookup(struct store *st, const char *file, char *recipe_path, size_t len, off_t *size,
+                 char hash[SHA256_HEX_LEN]);
+void store_forget(struct store *st, const char *file);
+int store_hash(struct store *st, const struct recipe *r, char hex[SHA256_HEX_LEN]);
+struct readahead *store_ra_open(struct store *st, const char *recipe_path, off_t offset, off_t length, int depth);
+
+#endif
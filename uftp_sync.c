@@ -0,0 +1,183 @@
+/*
+ * uftp_sync.c - directory manifests shared by the client and server
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "uftp_sync.h"
+
+/*
+    Accepts only relative paths that stay inside the current directory:
+    no leading '/', no ".." component, nothing empty.
+*/
+int sync_safe_path(const char *path)
+{
+    if (path[0] == '\0' || path[0] == '/')
+        return 0;
+
+    for (const char *p = path; *p;)
+    {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.')
+            return 0;
+        p += len;
+        p += strspn(p, "/");
+    }
+    return 1;
+}
+
+/* mkdir -p for every directory above path; returns -1 (errno set) on failure */
+int sync_make_parents(const char *path)
+{
+    char dir[PATH_MAX];
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    return 0;
+}
+
+/* Checks the snprintf result n for a path: -1 (errno ENAMETOOLONG) if it was cut short */
+static int path_fits(int n, size_t len)
+{
+    if (n >= 0 && (size_t)n < len)
+        return 0;
+    errno = ENAMETOOLONG;
+    return -1;
+}
+
+/*
+    Writes a manifest line for every regular file below root/rel. A path
+    too long to name fails the whole walk, rather than listing a wrong file.
+*/
+static int walk(FILE *fp, const char *root, const char *rel, sync_size_fn logical_size)
+{
+    char path[PATH_MAX];
+    if (path_fits(snprintf(path, sizeof(path), "%s%s%s", root, *rel ? "/" : "", rel), sizeof(path)) < 0)
+        return -1;
+
+    DIR *d = opendir(path);
+    if (!d)
+        return -1;
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        // a newline would end the manifest line early
+        if (strchr(de->d_name, '\n'))
+            continue;
+
+        char child[PATH_MAX], full[PATH_MAX];
+        if (path_fits(snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", de->d_name), sizeof(child)) < 0 ||
+            path_fits(snprintf(full, sizeof(full), "%s/%s", root, child), sizeof(full)) < 0)
+        {
+            closedir(d);
+            return -1;
+        }
+
+        // symlinks are neither followed nor copied
+        struct stat st;
+        if (lstat(full, &st) < 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+        {
+            // an unreadable subdirectory is skipped, but not a name we cannot build
+            if (walk(fp, root, child, logical_size) < 0 && errno == ENAMETOOLONG)
+            {
+                closedir(d);
+                return -1;
+            }
+        }
+        else if (S_ISREG(st.st_mode))
+            fprintf(fp, "%lld %lld %s\n", (long long)(logical_size ? logical_size(full, st.st_size) : st.st_size),
+                    (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec, child);
+    }
+    closedir(d);
+    return 0;
+}
+
+/*
+    Writes the manifest of every regular file under dir to fp.
+    A directory that does not exist yet has an empty manifest. logical_size
+    lets the server list stored recipes with the size of the file they hold.
+    Returns -1 (errno set) if dir exists but cannot be read.
+*/
+int sync_write_manifest(FILE *fp, const char *dir, sync_size_fn logical_size)
+{
+    struct stat st;
+
+    if (stat(dir, &st) < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISDIR(st.st_mode))
+    {
+        errno = ENOTDIR;
+        return -1;
+    }
+    return walk(fp, dir, "", logical_size);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct sync_entry *)a)->path, ((const struct sync_entry *)b)->path);
+}
+
+/*
+    Reads a manifest from fp into a newly allocated array sorted by path.
+    Returns the number of entries; malformed lines are skipped, and so are
+    paths that are absolute or climb out with "..", since the manifest may
+    come from the server and its paths are written to.
+*/
+int sync_load_manifest(FILE *fp, struct sync_entry **entries)
+{
+    char line[PATH_MAX + 64];
+    int count = 0, cap = 64;
+    struct sync_entry *e = malloc(cap * sizeof(*e));
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        long long size, mtime;
+        int pos = 0;
+
+        line[strcspn(line, "\n")] = '\0';
+        // exactly one space before the path, which may itself start with spaces
+        if (sscanf(line, "%lld %lld%n", &size, &mtime, &pos) != 2 || line[pos] != ' ' || !line[pos + 1])
+            continue;
+        pos++;
+        if (!sync_safe_path(line + pos))
+            continue;
+
+        if (count == cap)
+        {
+            cap *= 2;
+            e = realloc(e, cap * sizeof(*e));
+        }
+        e[count].path = strdup(line + pos);
+        e[count].size = size;
+        e[count].mtime_ns = mtime;
+        count++;
+    }
+
+    qsort(e, count, sizeof(*e), compare_entries);
+    *entries = e;
+    return count;
+}
+
+void sync_free_manifest(struct sync_entry *entries, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(entries[i].path);
+    free(entries);
+}
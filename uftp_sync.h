@@ -0,0 +1,35 @@
+/*
+ * uftp_sync.h - directory manifests shared by the client and server
+ *
+ * A manifest lists every regular file under a directory, one per line:
+ * "<size> <mtime in ns> <path relative to the directory>". The path comes
+ * last so it may contain spaces. Both sides build one for `sync` and
+ * compare them entry by entry; contents are only hashed when size and
+ * mtime alone cannot decide.
+ */
+#ifndef UFTP_SYNC_H
+#define UFTP_SYNC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SYNC_DEFAULT_JOBS 4 /* files transferred concurrently by sync */
+
+struct sync_entry
+{
+    char *path; /* relative to the synced directory */
+    off_t size;
+    int64_t mtime_ns;
+};
+
+/* size a file should be listed with, given its size on disk */
+typedef off_t (*sync_size_fn)(const char *path, off_t size);
+
+int sync_safe_path(const char *path);
+int sync_make_parents(const char *path);
+int sync_write_manifest(FILE *fp, const char *dir, sync_size_fn logical_size);
+int sync_load_manifest(FILE *fp, struct sync_entry **entries);
+void sync_free_manifest(struct sync_entry *entries, int count);
+
+#endif
@@ -0,0 +1,563 @@
+/*
+ * uftp_xsk.c - AF_XDP packet I/O for the server, bypassing the UDP stack
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+
+#include "uftp_xsk.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define ETH_LEN 14
+#define IP_LEN 20 /* we send no IP options */
+#define UDP_LEN 8
+
+/*------------------------------------ the XDP program ------------------------------------*/
+
+static long sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+#define MOV_REG(d, s) INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV_IMM(d, i) INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD_IMM(d, i) INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define AND_IMM(d, i) INSN(BPF_ALU64 | BPF_AND | BPF_K, d, 0, 0, i)
+#define LOAD(size, d, s, o) INSN(BPF_LDX | BPF_MEM | (size), d, s, o, 0)
+#define JUMP_IMM(op, d, i, to) INSN(BPF_JMP | (op) | BPF_K, d, 0, (to) - pc - 1, i)
+#define JUMP_REG(op, d, s, to) INSN(BPF_JMP | (op) | BPF_X, d, s, (to) - pc - 1, 0)
+
+/*
+    Loads the program that redirects the port's datagrams to the socket
+    registered in map_fd for the queue they arrived on. Fragments, IP
+    options and frames that do not fit a UMEM frame go to the stack, as
+    does everything on a queue without a socket.
+*/
+static int load_program(int map_fd, int port)
+{
+    enum { PASS = 26 };
+    struct bpf_insn prog[28];
+    int pc = 0;
+
+    prog[pc++] = MOV_REG(BPF_REG_6, BPF_REG_1);
+    prog[pc++] = LOAD(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data));
+    prog[pc++] = LOAD(BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end));
+    prog[pc++] = MOV_REG(BPF_REG_4, BPF_REG_2); // Ethernet, IP and UDP headers present
+    prog[pc++] = ADD_IMM(BPF_REG_4, ETH_LEN + IP_LEN + UDP_LEN);
+    prog[pc] = JUMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, PASS), pc++;
+    prog[pc++] = MOV_REG(BPF_REG_4, BPF_REG_2); // and it fits in a frame
+    prog[pc++] = ADD_IMM(BPF_REG_4, XSK_FRAME_SIZE - XDP_PACKET_HEADROOM);
+    prog[pc] = JUMP_REG(BPF_JLT, BPF_REG_4, BPF_REG_3, PASS), pc++;
+    prog[pc++] = LOAD(BPF_H, BPF_REG_5, BPF_REG_2, 12); // IPv4
+    prog[pc] = JUMP_IMM(BPF_JNE, BPF_REG_5, htons(ETH_P_IP), PASS), pc++;
+    prog[pc++] = LOAD(BPF_B, BPF_REG_5, BPF_REG_2, ETH_LEN); // without options
+    prog[pc] = JUMP_IMM(BPF_JNE, BPF_REG_5, 0x45, PASS), pc++;
+    prog[pc++] = LOAD(BPF_B, BPF_REG_5, BPF_REG_2, ETH_LEN + 9); // UDP
+    prog[pc] = JUMP_IMM(BPF_JNE, BPF_REG_5, IPPROTO_UDP, PASS), pc++;
+    prog[pc++] = LOAD(BPF_H, BPF_REG_5, BPF_REG_2, ETH_LEN + 6); // not a fragment
+    prog[pc++] = AND_IMM(BPF_REG_5, htons(IP_MF | IP_OFFMASK));
+    prog[pc] = JUMP_IMM(BPF_JNE, BPF_REG_5, 0, PASS), pc++;
+    prog[pc++] = LOAD(BPF_H, BPF_REG_5, BPF_REG_2, ETH_LEN + IP_LEN + 2); // to our port
+    prog[pc] = JUMP_IMM(BPF_JNE, BPF_REG_5, htons(port), PASS), pc++;
+    prog[pc++] = LOAD(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index));
+    prog[pc++] = INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+    prog[pc++] = INSN(0, 0, 0, 0, 0);
+    prog[pc++] = MOV_IMM(BPF_REG_3, XDP_PASS); // what to do if the queue has no socket
+    prog[pc++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    prog[pc++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    prog[pc++] = MOV_IMM(BPF_REG_0, XDP_PASS); // PASS
+    prog[pc++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    char log[8192] = "";
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t)prog;
+    attr.insn_cnt = pc;
+    attr.license = (uintptr_t) "GPL";
+    attr.log_buf = (uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+
+    int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0)
+    {
+        perror("Loading the XDP program");
+        if (log[0])
+            fprintf(stderr, "%s", log);
+    }
+    return fd;
+}
+
+/* Attaches the program to the interface in driver mode, or in generic mode if the driver can't (or generic is set) */
+static int attach_program(struct uftp_xsk *x, const char *ifname, int generic)
+{
+    union bpf_attr attr;
+
+    for (int mode = generic; mode < 2; mode++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = x->prog_fd;
+        attr.link_create.target_ifindex = x->ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = mode ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+        x->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+        if (x->link_fd >= 0)
+        {
+            printf("XDP program attached to %s queue %d in %s mode\n", ifname, x->queue,
+                   mode ? "generic" : "driver");
+            return 0;
+        }
+        if (!mode)
+            printf("No driver mode XDP on %s (%s), trying generic mode.\n", ifname, strerror(errno));
+    }
+    perror("Attaching the XDP program");
+    return -1;
+}
+
+/*------------------------------------ rings ------------------------------------*/
+
+static int map_ring(struct uftp_xsk *x, struct xsk_ring *r, struct xdp_ring_offset *off, size_t desc_size,
+                    off_t pgoff)
+{
+    size_t len = off->desc + XSK_RING_SIZE * desc_size;
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, x->fd, pgoff);
+
+    if (map == MAP_FAILED)
+        return -1;
+    r->producer = (uint32_t *)(map + off->producer);
+    r->consumer = (uint32_t *)(map + off->consumer);
+    r->flags = (uint32_t *)(map + off->flags);
+    r->descs = map + off->desc;
+    r->mask = XSK_RING_SIZE - 1;
+    return 0;
+}
+
+static int setup_rings(struct uftp_xsk *x)
+{
+    struct xdp_umem_reg reg = {
+        .addr = (uintptr_t)x->umem,
+        .len = (uint64_t)XSK_FRAMES * XSK_FRAME_SIZE,
+        .chunk_size = XSK_FRAME_SIZE,
+    };
+    int size = XSK_RING_SIZE;
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+
+    if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0 ||
+        getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+        return -1;
+
+    if (map_ring(x, &x->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        map_ring(x, &x->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+        map_ring(x, &x->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+        map_ring(x, &x->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+    Opens an AF_XDP socket on queue `queue` of ifname and steers the
+    datagrams for UDP port `port` into it, in driver mode if the driver
+    supports XDP and generic mode otherwise (or always, with generic set).
+    Returns -1 after printing what failed; the server then keeps to its
+    UDP socket.
+*/
+int xsk_open(struct uftp_xsk *x, const char *ifname, int queue, int port, int generic)
+{
+    memset(x, 0, sizeof(*x));
+    x->fd = x->prog_fd = x->map_fd = x->link_fd = -1;
+    x->queue = queue;
+    x->port = htons(port);
+
+    if (!(x->ifindex = if_nametoindex(ifname)))
+    {
+        perror(ifname);
+        return -1;
+    }
+
+    struct ifreq ifr;
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    x->mtu = s >= 0 && ioctl(s, SIOCGIFMTU, &ifr) == 0 ? ifr.ifr_mtu : 1500;
+    if (s >= 0)
+        close(s);
+
+    // the UMEM is pinned, which counts against the locked memory limit
+    struct rlimit unlimited = {RLIM_INFINITY, RLIM_INFINITY};
+    setrlimit(RLIMIT_MEMLOCK, &unlimited);
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = queue < 64 ? 64 : queue + 1;
+    if ((x->map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0)
+    {
+        perror("Creating the XSK map");
+        goto fail;
+    }
+    if ((x->prog_fd = load_program(x->map_fd, port)) < 0)
+        goto fail;
+
+    x->umem = mmap(NULL, (size_t)XSK_FRAMES * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (x->umem == MAP_FAILED)
+    {
+        x->umem = NULL;
+        perror("Allocating the UMEM");
+        goto fail;
+    }
+    if ((x->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0 || setup_rings(x) < 0)
+    {
+        perror("Setting up the AF_XDP socket");
+        goto fail;
+    }
+
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = x->ifindex,
+        .sxdp_queue_id = queue,
+        .sxdp_flags = XDP_USE_NEED_WAKEUP | (generic ? XDP_COPY : 0),
+    };
+    if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+    {
+        perror("Binding the AF_XDP socket");
+        goto fail;
+    }
+
+    // the first half of the frames waits for packets, the second half for replies
+    uint64_t *fill = x->fill.descs;
+    for (int i = 0; i < XSK_FRAMES / 2; i++)
+        fill[i] = (uint64_t)i * XSK_FRAME_SIZE;
+    __atomic_store_n(x->fill.producer, XSK_FRAMES / 2, __ATOMIC_RELEASE);
+    for (int i = 0; i < XSK_FRAMES / 2; i++)
+        x->free_frames[i] = (uint64_t)(XSK_FRAMES / 2 + i) * XSK_FRAME_SIZE;
+    x->nfree = XSK_FRAMES / 2;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = x->map_fd;
+    attr.key = (uintptr_t)&queue;
+    attr.value = (uintptr_t)&x->fd;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+    {
+        perror("Registering the AF_XDP socket");
+        goto fail;
+    }
+    if (attach_program(x, ifname, generic) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    xsk_close(x);
+    return -1;
+}
+
+void xsk_close(struct uftp_xsk *x)
+{
+    if (x->link_fd >= 0)
+        close(x->link_fd); // detaches the program
+    if (x->prog_fd >= 0)
+        close(x->prog_fd);
+    if (x->map_fd >= 0)
+        close(x->map_fd);
+    if (x->fd >= 0)
+        close(x->fd); // the rings stay mapped until exit
+    if (x->umem)
+        munmap(x->umem, (size_t)XSK_FRAMES * XSK_FRAME_SIZE);
+    x->fd = x->prog_fd = x->map_fd = x->link_fd = -1;
+    x->umem = NULL;
+}
+
+/*------------------------------------ receiving ------------------------------------*/
+
+static struct xsk_peer *peer_slot(struct uftp_xsk *x, uint32_t addr, uint16_t port)
+{
+    return &x->peers[(ntohl(addr) * 31 + port) & (XSK_PEERS - 1)];
+}
+
+/* Parses one frame and hands its payload on; frames that are not for us are ignored */
+static int handle_frame(struct uftp_xsk *x, char *frame, uint32_t len, xsk_recv_fn fn, void *ctx)
+{
+    struct ethhdr *eth = (struct ethhdr *)frame;
+    struct iphdr *ip = (struct iphdr *)(frame + ETH_LEN);
+
+    if (len < ETH_LEN + IP_LEN + UDP_LEN || eth->h_proto != htons(ETH_P_IP) || ip->version != 4 ||
+        ip->ihl < 5 || ip->protocol != IPPROTO_UDP)
+        return 0;
+
+    uint32_t iplen = ip->ihl * 4;
+    struct udphdr *udp = (struct udphdr *)(frame + ETH_LEN + iplen);
+    uint32_t udplen = ntohs(udp->len);
+    if (ETH_LEN + iplen + UDP_LEN > len || udplen < UDP_LEN || ETH_LEN + iplen + udplen > len ||
+        udp->dest != x->port)
+        return 0;
+
+    struct xsk_peer *p = peer_slot(x, ip->saddr, udp->source);
+    p->addr = ip->saddr;
+    p->port = udp->source;
+    memcpy(p->mac, eth->h_source, 6);
+    memcpy(p->local_mac, eth->h_dest, 6);
+    p->local_addr = ip->daddr;
+
+    struct sockaddr_in from = {.sin_family = AF_INET, .sin_port = udp->source};
+    from.sin_addr.s_addr = ip->saddr;
+    fn(ctx, (char *)udp + UDP_LEN, udplen - UDP_LEN, &from);
+    return 1;
+}
+
+/*
+    Hands every waiting datagram's payload to fn, in the frame it arrived
+    in, and gives the frames back for new packets. Returns how many there
+    were.
+*/
+int xsk_recv(struct uftp_xsk *x, xsk_recv_fn fn, void *ctx)
+{
+    struct xdp_desc *descs = x->rx.descs;
+    uint64_t *fill = x->fill.descs;
+    int count = 0;
+
+    while (1)
+    {
+        uint32_t cons = *x->rx.consumer;
+        uint32_t n = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE) - cons;
+
+        if (!n)
+            break;
+        if (n > XSK_RX_BATCH)
+            n = XSK_RX_BATCH;
+
+        // every receiving frame is either in the fill ring or the RX ring, so the fill ring has room
+        uint32_t prod = *x->fill.producer;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            struct xdp_desc *d = &descs[(cons + i) & x->rx.mask];
+            count += handle_frame(x, x->umem + d->addr, d->len, fn, ctx);
+            fill[(prod + i) & x->fill.mask] = d->addr - d->addr % XSK_FRAME_SIZE;
+        }
+        __atomic_store_n(x->fill.producer, prod + n, __ATOMIC_RELEASE);
+        __atomic_store_n(x->rx.consumer, cons + n, __ATOMIC_RELEASE);
+    }
+
+    // a driver that ran out of frames to receive into waits to be told there are new ones
+    if (__atomic_load_n(x->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+        recvfrom(x->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    return count;
+}
+
+/*------------------------------------ sending ------------------------------------*/
+
+/* Sum of 16-bit words in memory order, for the Internet checksum */
+static uint64_t csum_partial(const uint8_t *p, size_t len)
+{
+    uint64_t sum = 0;
+    uint32_t w;
+
+    for (; len >= 4; p += 4, len -= 4)
+    {
+        memcpy(&w, p, 4);
+        sum += w;
+    }
+    w = 0;
+    memcpy(&w, p, len);
+    return sum + w;
+}
+
+static uint16_t csum_fold(uint64_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+/* Checksum of the UDP header and payload, with the IP pseudo header */
+static uint16_t udp_checksum(uint32_t saddr, uint32_t daddr, struct iovec *segs, int nsegs, uint16_t udplen)
+{
+    struct
+    {
+        uint32_t saddr, daddr;
+        uint8_t zero, protocol;
+        uint16_t len;
+    } __attribute__((packed)) pseudo = {saddr, daddr, 0, IPPROTO_UDP, udplen};
+    uint64_t sum = csum_partial((uint8_t *)&pseudo, sizeof(pseudo));
+    size_t pos = 0;
+
+    for (int i = 0; i < nsegs; i++)
+    {
+        uint16_t part = csum_fold(csum_partial(segs[i].iov_base, segs[i].iov_len));
+        // a segment starting at an odd offset has its bytes in the other halves of the words
+        sum += pos & 1 ? (uint16_t)(part << 8 | part >> 8) : part;
+        pos += segs[i].iov_len;
+    }
+    uint16_t check = ~csum_fold(sum);
+    return check ? check : 0xffff;
+}
+
+/* Takes back the frames the kernel has finished sending */
+static void reclaim_frames(struct uftp_xsk *x)
+{
+    uint64_t *comp = x->comp.descs;
+    uint32_t cons = *x->comp.consumer;
+    uint32_t n = __atomic_load_n(x->comp.producer, __ATOMIC_ACQUIRE) - cons;
+
+    for (uint32_t i = 0; i < n; i++)
+        x->free_frames[x->nfree++] = comp[(cons + i) & x->comp.mask];
+    __atomic_store_n(x->comp.consumer, cons + n, __ATOMIC_RELEASE);
+}
+
+/* Tells the kernel there is something to send; in copy mode each call sends a limited batch */
+static void kick(struct uftp_xsk *x)
+{
+    for (int tries = 0; tries < 64; tries++)
+    {
+        if (!(__atomic_load_n(x->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) ||
+            __atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE) == *x->tx.producer)
+            return;
+        if (sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN && errno != EBUSY)
+            return;
+    }
+}
+
+/* Copies the next `len` bytes of the segments into dst */
+static void gather(char *dst, size_t len, struct iovec *segs, int *seg, size_t *off)
+{
+    while (len)
+    {
+        size_t take = segs[*seg].iov_len - *off;
+        if (take > len)
+            take = len;
+        memcpy(dst, (char *)segs[*seg].iov_base + *off, take);
+        dst += take;
+        len -= take;
+        *off += take;
+        if (*off == segs[*seg].iov_len)
+        {
+            (*seg)++;
+            *off = 0;
+        }
+    }
+}
+
+/*
+    Sends the datagram assembled from iov to `to`, split into IP fragments
+    at the interface's MTU. Fails (-1) with EHOSTUNREACH if nothing has come
+    from `to` through this socket yet, or ENOBUFS if it is out of frames;
+    the caller should use the UDP socket then.
+*/
+int xsk_sendv(struct uftp_xsk *x, struct sockaddr_in *to, struct iovec *iov, int iovcnt)
+{
+    struct xsk_peer *p = peer_slot(x, to->sin_addr.s_addr, to->sin_port);
+
+    if (p->addr != to->sin_addr.s_addr || p->port != to->sin_port || !p->addr)
+    {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    struct iovec segs[iovcnt + 1];
+    struct udphdr udp;
+    size_t len = 0;
+
+    segs[0] = (struct iovec){&udp, sizeof(udp)};
+    for (int i = 0; i < iovcnt; i++)
+    {
+        segs[i + 1] = iov[i];
+        len += iov[i].iov_len;
+    }
+    if (len > 0xffff - UDP_LEN - IP_LEN)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    int room = x->mtu < XSK_FRAME_SIZE - ETH_LEN ? x->mtu : XSK_FRAME_SIZE - ETH_LEN;
+    size_t per_frame = (room - IP_LEN) & ~7; // fragment offsets count 8-byte units
+    size_t total = UDP_LEN + len;
+    int nframes = (total + per_frame - 1) / per_frame;
+
+    if (x->nfree < nframes)
+        reclaim_frames(x);
+    if (x->nfree < nframes)
+    {
+        kick(x);
+        reclaim_frames(x);
+    }
+    if (x->nfree < nframes)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    udp.source = x->port;
+    udp.dest = to->sin_port;
+    udp.len = htons(total);
+    udp.check = 0;
+    udp.check = udp_checksum(p->local_addr, p->addr, segs, iovcnt + 1, udp.len);
+
+    struct xdp_desc *descs = x->tx.descs;
+    uint32_t prod = *x->tx.producer; // every sending frame has a slot, so the ring has room
+    uint16_t id = htons(x->ip_id++);
+    int seg = 0;
+    size_t seg_off = 0;
+
+    for (int i = 0; i < nframes; i++)
+    {
+        size_t offset = (size_t)i * per_frame;
+        size_t n = total - offset < per_frame ? total - offset : per_frame;
+        uint64_t addr = x->free_frames[--x->nfree];
+        char *frame = x->umem + addr;
+        struct ethhdr *eth = (struct ethhdr *)frame;
+        struct iphdr *ip = (struct iphdr *)(frame + ETH_LEN);
+
+        memcpy(eth->h_dest, p->mac, 6);
+        memcpy(eth->h_source, p->local_mac, 6);
+        eth->h_proto = htons(ETH_P_IP);
+
+        memset(ip, 0, IP_LEN);
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->tot_len = htons(IP_LEN + n);
+        ip->id = id;
+        ip->frag_off = htons(offset / 8 | (i < nframes - 1 ? IP_MF : 0));
+        ip->ttl = 64;
+        ip->protocol = IPPROTO_UDP;
+        ip->saddr = p->local_addr;
+        ip->daddr = p->addr;
+        ip->check = ~csum_fold(csum_partial((uint8_t *)ip, IP_LEN));
+
+        gather(frame + ETH_LEN + IP_LEN, n, segs, &seg, &seg_off);
+        descs[(prod + i) & x->tx.mask] = (struct xdp_desc){.addr = addr, .len = ETH_LEN + IP_LEN + n};
+    }
+    __atomic_store_n(x->tx.producer, prod + nframes, __ATOMIC_RELEASE);
+    kick(x);
+    return len;
+}
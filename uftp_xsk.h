@@ -0,0 +1,72 @@
+/*
+ * uftp_xsk.h - AF_XDP packet I/O for the server, bypassing the UDP stack
+ *
+ * A small XDP program, loaded straight through bpf(2), sends every
+ * unfragmented IPv4 UDP datagram for the server's port on one queue of an
+ * interface into an AF_XDP socket. The frames land in a shared memory area
+ * (the UMEM), and the server parses them where they lie. Replies are built
+ * in UMEM frames too: Ethernet, IP and UDP headers written by hand, with
+ * chunks split into IP fragments at the interface's MTU.
+ *
+ * Everything else still reaches the normal UDP socket, which keeps
+ * serving: IP fragments (uploaded chunks, since the XDP program sees only
+ * one fragment at a time), other queues, packets too big for a frame. A
+ * reply goes through AF_XDP only to an address we have received a frame
+ * from, since that frame tells us the next hop's MAC; anything else is
+ * sent through the socket.
+ */
+#ifndef UFTP_XSK_H
+#define UFTP_XSK_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <linux/if_xdp.h>
+
+#define XSK_FRAME_SIZE 4096
+#define XSK_FRAMES 4096 /* UMEM frames, half for receiving and half for sending */
+#define XSK_RING_SIZE 2048
+#define XSK_RX_BATCH 64 /* frames taken off the RX ring at a time */
+#define XSK_PEERS 4096  /* reply addresses remembered, direct mapped */
+
+struct xsk_ring
+{
+    uint32_t *producer, *consumer, *flags;
+    void *descs; /* struct xdp_desc (RX, TX) or uint64_t frame addresses (fill, completion) */
+    uint32_t mask;
+};
+
+/* how to reach one client address: taken from the frames it sent us */
+struct xsk_peer
+{
+    uint32_t addr; /* network order, 0 for a free slot */
+    uint16_t port;
+    uint8_t mac[6];       /* its next hop */
+    uint8_t local_mac[6]; /* the address it sent to */
+    uint32_t local_addr;
+};
+
+struct uftp_xsk
+{
+    int fd;
+    int ifindex, queue;
+    uint16_t port; /* ours, network order */
+    int mtu;
+    int prog_fd, map_fd, link_fd; /* the XDP program stays attached while link_fd is open */
+    char *umem;
+    struct xsk_ring fill, comp, rx, tx;
+    uint64_t free_frames[XSK_FRAMES / 2]; /* sending frames not in the TX ring */
+    int nfree;
+    uint16_t ip_id;
+    struct xsk_peer peers[XSK_PEERS];
+};
+
+/* called for the UDP payload of each frame received; buf may be changed in place */
+typedef void (*xsk_recv_fn)(void *ctx, char *buf, int len, struct sockaddr_in *from);
+
+int xsk_open(struct uftp_xsk *x, const char *ifname, int queue, int port, int generic);
+int xsk_recv(struct uftp_xsk *x, xsk_recv_fn fn, void *ctx);
+int xsk_sendv(struct uftp_xsk *x, struct sockaddr_in *to, struct iovec *iov, int iovcnt);
+void xsk_close(struct uftp_xsk *x);
+
+#endif